@@ -36,6 +36,55 @@ lcr3(uint64_t addr)
                  : "r" (addr));
 }
 
+static inline uint64_t
+rcr3(void)
+{
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0"
+                 : "=r" (cr3));
+    return cr3;
+}
+
+static inline uint64_t
+rcr4(void)
+{
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0"
+                 : "=r" (cr4));
+    return cr4;
+}
+
+static inline void
+lcr4(uint64_t val)
+{
+    asm volatile("mov %0, %%cr4"
+                 :
+                 : "r" (val));
+}
+
+static inline void
+invlpg(vaddr_t addr)
+{
+    asm volatile("invlpg (%0)"
+                 :
+                 : "r" (addr)
+                 : "memory");
+}
+
+static inline void
+pause(void)
+{
+    asm volatile("pause" : : : "memory");
+}
+
+static inline void
+cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    asm volatile("cpuid"
+                 : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+                 : "a" (leaf), "c" (0));
+}
+
 static inline void
 lgdt(struct segdesc *gdt, size_t size)
 {
@@ -32,6 +32,14 @@
 
 #define CR4_PSE         0x00000010      // Page size extension
 #define CR4_PAE         0x00000020      // Page size extension
+#define CR4_PCIDE       0x00020000      // Process-context identifiers
+
+// CR3 flags once CR4_PCIDE is set
+#define CR3_PCID_MASK   0xfff
+#define CR3_NOFLUSH     0x8000000000000000  // keep the PCID's TLB entries on load
+
+// CPUID.01H:ECX
+#define CPUID_ECX_PCID  0x00020000
 
 
 #ifndef __ASSEMBLER__
@@ -39,6 +47,16 @@
 #include <stdint.h>
 #include <arch/mmu.h>
 
+#define PCP_HIGH 64              // most free pages pmem keeps per cpu
+#define NPCID 8                  // PCIDs a cpu hands out to vpmaps, see vpmap.c
+
+// Address space a PCID was last used for
+struct pcid_slot {
+    uint64_t vpmap_id;
+    uint64_t tlb_gen;            // vpmap's tlb_gen when last loaded
+    uint64_t ktlb_gen;           // kvpmap's tlb_gen when last loaded
+};
+
 // X86-64 specific CPU data structure
 struct x86_64_cpu {
     uint8_t lapic_id;
@@ -49,6 +67,12 @@ struct x86_64_cpu {
     volatile uint32_t started;   // Has the CPU started?
     int num_disabled;            // Depth of cli nesting.
     int intr_enabled;            // Were interrupts enabled before it's first diabled?
+    paddr_t pcp[PCP_HIGH];       // free single pages cached by pmem, see pmem.c
+    int pcp_count;
+    int pcid_on;                 // CR4_PCIDE is set
+    int pcid_next;               // slot to hand out next
+    struct pcid_slot pcid[NPCID]; // PCID i + 1 is slot i, PCID 0 is unused
+    struct vpmap *vpmap;         // vpmap loaded on this cpu
     struct x86_64_cpu *cpu;          // stores current cpu struct address
 };
 #define MAX_NCPU 32
@@ -24,4 +24,9 @@ uint8_t lapic_read_id(void);
 
 void lapic_eoi(void);
 
+/*
+ * Send interrupt ``vector`` to the processor with LAPIC ID ``apicid``.
+ */
+void lapic_send_ipi(uint8_t apicid, int vector);
+
 #endif /* _ARCH_X86_64_LAPIC_H_ */
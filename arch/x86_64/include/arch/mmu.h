@@ -145,6 +145,10 @@ struct gatedesc {
 #define PDPTX_SHIFT 30
 #define PML4X_SHIFT 39
 
+// A huge page is mapped directly by a page directory entry with PTE_PS set
+#define HUGE_PG_SIZE    (1UL << PDX_SHIFT)
+#define HUGE_PG_ORDER   (PDX_SHIFT - PG_SHIFT)
+
 #define VPN(v) ((vaddr_t)(v) & ~0xFFF)
 #define PPN(p) ((paddr_t)(p) & ~0xFFF & PHYS_ADDR_MASK)
 #define ENTRY_IDX(v, shift) (((v) >> shift) & 0x1FF)
@@ -172,7 +176,7 @@ struct gatedesc {
 #define PTE_PCD         0x010   // Cache-Disable
 #define PTE_A           0x020   // Accessed
 #define PTE_D           0x040   // Dirty
-#define PTE_PS          0x080   // Page Size (4MB)
+#define PTE_PS          0x080   // Page Size (2MB in a page directory entry)
 #define PTE_MBZ         0x180   // Bits must be zero
 
 #ifndef __ASSEMBLER__
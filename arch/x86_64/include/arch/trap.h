@@ -29,6 +29,7 @@
 #define T_IRQ_COM1      (T_IRQ0+4)
 #define T_IRQ_IDE       (T_IRQ0+14)
 #define T_IRQ_ERROR     (T_IRQ0+19)
+#define T_IRQ_TLB       (T_IRQ0+30) // TLB shootdown IPI
 #define T_IRQ_SPURIOUS  (T_IRQ0+31)
 
 // Syscall
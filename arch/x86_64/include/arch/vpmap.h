@@ -2,9 +2,29 @@
 #define _ARCH_X86_64_VPMAP_H_
 
 #include <kernel/types.h>
+#include <kernel/synch.h>
+
+/*
+ * TLB entries are dropped one page at a time with invlpg for up to INVLPG_MAX
+ * pages, past that reloading CR3 is cheaper.
+ */
+#define INVLPG_MAX 32
 
 struct vpmap {
     pml4e_t *pml4;
+    uint64_t id;        // never reused, names the vpmap in per-cpu PCID slots
+    uint64_t tlb_gen;   // bumped after entries are removed or changed
+    volatile uint32_t cpus;     // bit i set while x86_64_cpus[i] has it loaded
+    // invalidations queued by vpmap_invalidate_defer
+    struct spinlock tlb_lock;
+    int tlb_n;                  // pages queued, more than INVLPG_MAX to flush all
+    vaddr_t tlb_addrs[INVLPG_MAX];
 };
 
+/*
+ * Use PCIDs on this cpu if it has them, so loading a vpmap keeps the TLB
+ * entries of the others. Must run on each cpu, with no PCID in CR3.
+ */
+void vpmap_pcid_init(void);
+
 #endif /* _ARCH_X86_64_VPMAP_H_ */
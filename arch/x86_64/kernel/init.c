@@ -6,6 +6,7 @@
 #include <arch/vm.h>
 #include <arch/trap.h>
 #include <arch/cpu.h>
+#include <arch/vpmap.h>
 
 void
 arch_init(void)
@@ -17,6 +18,7 @@ arch_init(void)
     seg_init();
     idt_init();
     idt_load();
+    vpmap_pcid_init();
     xchg(&(mycpu()->started), 1); // inform other processors we are up
 }
 
@@ -26,5 +28,6 @@ arch_init_ap(void)
     seg_init();
     lapic_init();
     idt_load();
+    vpmap_pcid_init();
     xchg(&(mycpu()->started), 1); // inform other processors we are up
 }
\ No newline at end of file
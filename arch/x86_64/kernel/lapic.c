@@ -153,3 +153,13 @@ lapic_eoi(void)
 {
     lapic_reg_write(REG_EOI, 0);
 }
+
+void
+lapic_send_ipi(uint8_t apicid, int vector)
+{
+    lapic_reg_write(REG_ICR_HI, (uint32_t) apicid << 24);
+    lapic_reg_write(REG_ICR_LO, vector);
+    // Wait until sent
+    while (lapic[REG_ICR_LO] & IPI_DELIVER) {
+    }
+}
@@ -34,12 +34,19 @@ void
 pmem_info(void)
 {
     struct e820_entry *entry;
+    struct pmem_stats stats;
     kprintf("E820: physical memory map [mem %p-%p]\n", pmemconfig.pmem_start, pmemconfig.pmem_end);
     for (entry = e820_map.entries; entry < &e820_map.entries[e820_map.n_entries]; entry++) {
         paddr_t end = entry->base_addr + entry->len;
         kprintf(" [%p - %p] %s\n", entry->base_addr, end, e820_string[entry->type]);
     }
-    kprintf("\n");
+    pmem_get_stats(&stats);
+    kprintf("Free pages: %d, largest free block order %d\n", stats.free_pages, stats.largest_order);
+    kprintf(" free blocks per order:");
+    for (int i = 0; i <= PMEM_MAX_ORDER; i++) {
+        kprintf(" %d", stats.free_blocks[i]);
+    }
+    kprintf("\n\n");
 }
 
 void
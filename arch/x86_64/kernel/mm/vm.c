@@ -6,6 +6,8 @@
 #include <arch/asm.h>
 
 size_t pg_size = PG_SIZE;
+size_t huge_pg_size = HUGE_PG_SIZE;
+int huge_pg_order = HUGE_PG_ORDER;
 
 void
 seg_init(void)
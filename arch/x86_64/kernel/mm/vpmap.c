@@ -10,58 +10,189 @@
 #include <lib/stddef.h>
 #include <arch/mmu.h>
 #include <arch/asm.h>
+#include <arch/cpu.h>
+#include <arch/trap.h>
+#include <arch/lapic.h>
 
 /*
  * vpmap allocator
  */
 static struct kmem_cache *vpmap_allocator = NULL;
 
+/*
+ * With PCIDs, each cpu tags the TLB entries of up to NPCID vpmaps, and loading
+ * one of them keeps its entries unless its page tables changed since this cpu
+ * last loaded it: every change that needs a TLB flush bumps vpmap->tlb_gen,
+ * and kvpmap->tlb_gen for kernel mappings shared by all vpmaps.
+ */
+// Last vpmap id handed out
+static uint64_t vpmap_ids;
+
+// Set once the boot cpu found PCID support
+static bool pcid_supported;
+
+/*
+ * TLB shootdown: vpmap->cpus tracks the cpus that have a vpmap loaded. A cpu
+ * that invalidates entries of a vpmap loaded elsewhere posts one request for
+ * the whole batch, sends T_IRQ_TLB to those cpus only, and spins until each of
+ * them cleared its bit in ``pending``. shootdown_lock allows one request at a
+ * time; cpus spinning with interrupts off serve it through
+ * vpmap_shootdown_poll, so two cpus never wait on each other.
+ */
+static struct spinlock shootdown_lock;
+static struct {
+    struct vpmap *vpmap;
+    int n;                          // pages, more than INVLPG_MAX to flush all
+    vaddr_t addrs[INVLPG_MAX];
+    volatile uint32_t pending;      // cpus yet to flush
+} shootdown;
+
+/*
+ * Initialize the TLB shootdown state of a new vpmap.
+ */
+static void vpmap_tlb_init(struct vpmap *vpmap);
+
+/*
+ * Move the invalidations queued for vpmap into addrs and return their number.
+ */
+static int vpmap_tlb_take(struct vpmap *vpmap, vaddr_t *addrs);
+
+/*
+ * Drop n entries at addrs of vpmap from the current cpu's TLB, or all of them
+ * if n > INVLPG_MAX, if vpmap is loaded.
+ */
+static void vpmap_tlb_flush_local(struct vpmap *vpmap, vaddr_t *addrs, int n);
+
+/*
+ * T_IRQ_TLB handler.
+ */
+static void vpmap_shootdown_trap_handler(irq_t irq, void *dev, void *regs);
+
+/*
+ * Note that TLB entries of vpmap may be stale on cpus that don't have it
+ * loaded.
+ */
+static void vpmap_tlb_changed(struct vpmap *vpmap);
+
+/*
+ * Return True if vpmap is loaded on the current cpu.
+ */
+static bool vpmap_loaded(struct vpmap *vpmap);
+
+/*
+ * Find the page directory entry for virtual address ``vaddr``. If ``alloc`` is
+ * set, allocate upper level tables if not present.
+ */
+static pde_t *find_pde(pml4e_t *pml4, vaddr_t vaddr, int alloc);
+
 /*
  * Find the page table entry for virtual address ``vaddr``. If ``alloc`` is set,
- * allocate a page table if not present.
+ * allocate a page table if not present. If ``vaddr`` is mapped by a huge page,
+ * return its page directory entry, which has PTE_PS set.
  */
 static pte_t *find_pte(pml4e_t *pml4, vaddr_t vaddr, int alloc);
 
 /*
- * Clear entry of a pte. Decrement page reference count if page present. Free
- * swap entry if in swap.
+ * Page tables shared since a fork: vpmap_cow_copy points the child's page
+ * directory entry at a page table of the parent that lies fully inside the
+ * copied region, and clears PTE_W in both entries, so neither vpmap can write
+ * through it. The page table's reference count is the number of vpmaps using
+ * it, and pages mapped by it hold one reference for all of them. A vpmap
+ * changing an entry under it first gets its own copy, see pt_unshare; the
+ * hardware may still set accessed bits in a shared table. pt_share_lock
+ * serializes copying with dropping references.
+ */
+static struct spinlock pt_share_lock;
+
+#define PDE_SHARED(pde) (((pde) & (PTE_P | PTE_PS | PTE_W)) == PTE_P)
+
+/*
+ * Give the vpmap owning pde its own copy of the shared page table pde points
+ * to, or take it back if no other vpmap uses it. Pages mapped by both copies
+ * lose PTE_W in both. Cached walks through the old table must be invalidated.
+ * Return ERR_NOMEM if out of memory.
+ */
+static err_t pt_unshare(pde_t *pde);
+
+/*
+ * Drop the reference to the shared page table pde points to, and clear pde.
+ * Return False, changing nothing but giving PTE_W back, if no other vpmap
+ * uses it.
+ */
+static bool pt_drop(pde_t *pde);
+
+/*
+ * Like find_pte, for changing the entry: a shared page table is unshared
+ * first. Return NULL if out of memory.
+ */
+static pte_t *find_pte_write(struct vpmap *vpmap, vaddr_t vaddr, int alloc);
+
+/*
+ * Return the end of the entry at level ``shift`` that maps vaddr, or end if
+ * that is before.
+ */
+static vaddr_t entry_end(vaddr_t vaddr, vaddr_t end, int shift);
+
+/*
+ * Walk of the leaf page tables covering [va, end) in address order. Ranges
+ * without a page directory or page directory pointer table are skipped whole,
+ * instead of walking down from the PML4 for every page.
+ */
+struct pt_walk {
+    pml4e_t *pml4;
+    vaddr_t va;     // where the next table's part of the range starts
+    vaddr_t end;
+};
+
+/*
+ * Return the next present page directory entry, pointing at a page table or
+ * mapping a huge page, and store the part of the range under it in
+ * [*start, *stop). Return NULL once the range is exhausted.
+ */
+static pde_t *pt_walk_next(struct pt_walk *w, vaddr_t *start, vaddr_t *stop);
+
+/*
+ * Clear entry of a pte. Decrement page reference count if page present, marking
+ * the page dirty if the pte was. Free swap entry if in swap.
  */
 static void clear_pte(pml4e_t *pml4, int free_swap);
 
 /*
  * Map a range of virtual addresses from ``vaddr`` to ``vaddr + size``, to
  * physical address starting at ``paddr``. Set all page permission to ``perm``.
+ * Set *replaced if a page was mapped already.
  * Return ERR_VPMAP_MAP if failed to map any page in range.
  */
-static err_t map_pages(pml4e_t *pml4, vaddr_t vaddr, paddr_t paddr, size_t size, pteperm_t perm);
+static err_t map_pages(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr, size_t size, pteperm_t perm,
+                       bool *replaced);
 
 /*
  * Unmap a range of virtual addresses from ``vaddr`` to ``end``. end exclusive
  * When ``free_swap`` is set, entry in swap will be freed.
  * When ``free_imm`` is set, all intermediate page tables are freed as well
+ * Return ERR_NOMEM if a shared page table partly in the range could not be
+ * copied, see vpmap_unmap. Never fails for whole page tables.
  */
-static void unmap_pages(pml4e_t *pml4, vaddr_t vaddr, vaddr_t end, int free_swap, int free_imm);
+static err_t unmap_pages(pml4e_t *pml4, vaddr_t vaddr, vaddr_t end, int free_swap, int free_imm);
 
-/* Utility functions for unmapping other page dir*/
-static void unmap_pdpt(pdpte_t *pdpt, vaddr_t start_addr, vaddr_t end_addr,
-    int pdptx_start, int pdptx_end, int free_swap, int free_imm);
+/* Utility functions for unmapping other page dir, [start_addr, end_addr) lies
+ * within the range of the table */
+static err_t unmap_pdpt(pdpte_t *pdpt, vaddr_t start_addr, vaddr_t end_addr, int free_swap, int free_imm);
 
-static void unmap_pd(pde_t *pde, vaddr_t start_addr, vaddr_t end_addr,
-    int pdx_start, int pdx_end, int free_swap, int free_imm);
+static err_t unmap_pd(pde_t *pd, vaddr_t start_addr, vaddr_t end_addr, int free_swap, int free_imm);
 
 /*
  * memperm to pteperm translation.
  */
 static pteperm_t memperm_to_pteperm(memperm_t memperm);
 
-static pte_t*
-find_pte(pml4e_t *pml4, vaddr_t vaddr, int alloc)
+static pde_t*
+find_pde(pml4e_t *pml4, vaddr_t vaddr, int alloc)
 {
     kassert(pml4);
     pml4e_t *pml4e;
     pdpte_t *pdpt, *pdpte;
-    pde_t *pgdir, *pde;
-    pte_t *pgtab;
+    pde_t *pgdir;
     paddr_t paddr;
 
     // top level walk
@@ -85,9 +216,24 @@ find_pte(pml4e_t *pml4, vaddr_t vaddr, int alloc)
         *pdpte = paddr | PTE_P | PTE_W | PTE_U;
     }
 
-    // third level walk
     pgdir = (pde_t*) KMAP_P2V(PDPTE_ADDR(*pdpte));
-    pde = &pgdir[PDX(vaddr)];
+    return &pgdir[PDX(vaddr)];
+}
+
+static pte_t*
+find_pte(pml4e_t *pml4, vaddr_t vaddr, int alloc)
+{
+    pde_t *pde;
+    pte_t *pgtab;
+    paddr_t paddr;
+
+    // third level walk
+    if ((pde = find_pde(pml4, vaddr, alloc)) == NULL) {
+        return NULL;
+    }
+    if (*pde & PTE_PS) {
+        return pde;
+    }
     if ((*pde & PTE_P) == 0) {
         if (!alloc || pmem_alloc(&paddr) != ERR_OK) {
             return NULL;
@@ -104,6 +250,11 @@ static void
 clear_pte(pte_t *pte, int free_swap) {
     kassert(pte);
     if (*pte & PTE_P) {
+        // carry the hardware dirty bit over to the page for write-back,
+        // a racing write-back at worst writes the page once more
+        if (*pte & PTE_D) {
+            pmem_set_page_dirty(paddr_to_page(PPN(*pte)), True);
+        }
         pmem_dec_refcnt(PPN(*pte));
     }
     //*pte = PTE_FLAGS(*pte) & 0xffe;
@@ -111,12 +262,12 @@ clear_pte(pte_t *pte, int free_swap) {
 }
 
 static err_t
-map_pages(pml4e_t *pml4, vaddr_t vaddr, paddr_t paddr, size_t size, pteperm_t perm)
+map_pages(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr, size_t size, pteperm_t perm, bool *replaced)
 {
     pte_t *pte;
     vaddr_t v, vend;
 
-    kassert(pml4 != 0);
+    kassert(vpmap->pml4 != 0);
 
     v = pg_round_down(vaddr);
     vend = pg_round_down(vaddr + size);
@@ -125,68 +276,229 @@ map_pages(pml4e_t *pml4, vaddr_t vaddr, paddr_t paddr, size_t size, pteperm_t pe
     // We can't test using '<=' in the for loop, because some mappings end at
     // virtual address 0
     for (; v != vend; v += pg_size, paddr += pg_size) {
-        if ((pte = find_pte(pml4, v, 1)) == NULL) {
+        // never let a base page overwrite a huge page mapping
+        if ((pte = find_pte_write(vpmap, v, 1)) == NULL || (*pte & PTE_PS)) {
             return ERR_VPMAP_MAP;
         }
+        if (*pte & PTE_P) {
+            *replaced = True;
+        }
         *pte = PPN(paddr) | PTE_P | perm;
     }
     return ERR_OK;
 }
 
+static err_t
+map_huge_pages(pml4e_t *pml4, vaddr_t vaddr, paddr_t paddr, size_t size, pteperm_t perm)
+{
+    pde_t *pde;
+    vaddr_t v, vend;
 
-static void
+    kassert(pml4 != 0);
+    kassert(vaddr % HUGE_PG_SIZE == 0 && paddr % HUGE_PG_SIZE == 0);
+
+    for (v = vaddr, vend = vaddr + size; v != vend; v += HUGE_PG_SIZE, paddr += HUGE_PG_SIZE) {
+        if ((pde = find_pde(pml4, v, 1)) == NULL ||
+            ((*pde & PTE_P) && !(*pde & PTE_PS))) {
+            return ERR_VPMAP_MAP;
+        }
+        *pde = PDE_ADDR(paddr) | PTE_P | PTE_PS | perm;
+    }
+    return ERR_OK;
+}
+
+
+static err_t
 unmap_pages(pml4e_t *pml4, vaddr_t start, vaddr_t end, int free_swap, int free_imm)
 {
     kassert(PML4X(start) <= PML4X(end-1));
 
-    int pml4x, pdptx, limit;
+    vaddr_t next;
+    err_t err = ERR_OK;
     // Optimization: instead of walking the page table for each page in range
     // (using find_pte), iterate through the page directory and each page table.
-    for (pml4x = PML4X(start), pdptx = PDPTX(start); pml4x <= PML4X(end-1); pml4x++, pdptx = 0) {
-        if (pml4[pml4x] & PTE_P) {  
-            limit = pdptx < PDPTX(end) ? N_PDPTE_PER_PG : PDPTX(end) + 1;
-            unmap_pdpt((pdpte_t*) KMAP_P2V(PML4E_ADDR(pml4[pml4x])), start, end, pdptx, limit, free_swap, free_imm);
+    for (; start < end; start = next) {
+        next = entry_end(start, end, PML4X_SHIFT);
+        if (pml4[PML4X(start)] & PTE_P) {
+            if (unmap_pdpt((pdpte_t*) KMAP_P2V(PML4E_ADDR(pml4[PML4X(start)])), start, next, free_swap, free_imm) != ERR_OK) {
+                err = ERR_NOMEM;
+            }
             if (free_imm) {
-                pmem_free(PML4E_ADDR(pml4[pml4x]));
+                pmem_free(PML4E_ADDR(pml4[PML4X(start)]));
             }
         }
     }
+    return err;
 }
 
-static void
-unmap_pdpt(pdpte_t *pdpt, vaddr_t start_addr, vaddr_t end_addr, int pdptx_start, int pdptx_end, int free_swap, int free_imm)
+static err_t
+unmap_pdpt(pdpte_t *pdpt, vaddr_t start_addr, vaddr_t end_addr, int free_swap, int free_imm)
 {
-    int pdptx, pdx, limit;
+    vaddr_t next;
+    err_t err = ERR_OK;
 
-    for (pdptx = pdptx_start, pdx = PDX(start_addr); pdptx < pdptx_end; pdptx++, pdx = 0) {
-        if (pdpt[pdptx] & PTE_P) {
-            limit = pdx < PDX(end_addr) ? N_PDE_PER_PG : PDX(end_addr) + 1;
-            unmap_pd((pde_t*) KMAP_P2V(PDPTE_ADDR(pdpt[pdptx])), start_addr, end_addr, pdx, limit, free_swap, free_imm);
+    for (; start_addr < end_addr; start_addr = next) {
+        next = entry_end(start_addr, end_addr, PDPTX_SHIFT);
+        if (pdpt[PDPTX(start_addr)] & PTE_P) {
+            if (unmap_pd((pde_t*) KMAP_P2V(PDPTE_ADDR(pdpt[PDPTX(start_addr)])), start_addr, next, free_swap, free_imm) != ERR_OK) {
+                err = ERR_NOMEM;
+            }
             if (free_imm) {
-                pmem_free(PDPTE_ADDR(pdpt[pdptx]));
+                pmem_free(PDPTE_ADDR(pdpt[PDPTX(start_addr)]));
             }
         }
     }
+    return err;
 }
 
-static void
-unmap_pd(pde_t *pde, vaddr_t start_addr, vaddr_t end_addr, int pdx_start, int pdx_end, int free_swap, int free_imm)
+static err_t
+unmap_pd(pde_t *pd, vaddr_t start_addr, vaddr_t end_addr, int free_swap, int free_imm)
 {
-    int pdx, ptx, limit;
+    vaddr_t next;
+    pde_t *pde;
     pte_t *pgtable;
+    size_t ptx, limit;
+    err_t err = ERR_OK;
 
-    for (pdx = pdx_start, ptx = PTX(start_addr); pdx < pdx_end; pdx++, ptx = 0) {
-        if (pde[pdx] & PTE_P) {
-            limit = ptx < PTX(end_addr) ? N_PTE_PER_PG : PTX(end_addr) + 1;
-            pgtable = (pte_t*) KMAP_P2V(PDE_ADDR(pde[pdx]));
-            for (; ptx < limit; ptx++) {
+    for (; start_addr < end_addr; start_addr = next) {
+        next = entry_end(start_addr, end_addr, PDX_SHIFT);
+        pde = &pd[PDX(start_addr)];
+        if ((*pde & PTE_P) && (*pde & PTE_PS)) {
+            // huge pages are torn down whole, there is no page table to free
+            clear_pte(pde, free_swap);
+        } else if (*pde & PTE_P) {
+            if (PDE_SHARED(*pde)) {
+                // let the other vpmaps have a shared page table going away
+                // whole, copy it when only part of it does
+                if (next - start_addr == HUGE_PG_SIZE && pt_drop(pde)) {
+                    continue;
+                }
+                if (pt_unshare(pde) != ERR_OK) {
+                    // leave the entries to the caller rather than panic when
+                    // memory is low
+                    err = ERR_NOMEM;
+                    continue;
+                }
+            }
+            pgtable = (pte_t*) KMAP_P2V(PDE_ADDR(*pde));
+            limit = PTX(start_addr) + (next - start_addr) / pg_size;
+            for (ptx = PTX(start_addr); ptx < limit; ptx++) {
                 clear_pte(&pgtable[ptx], free_swap);
             }
             if (free_imm) {
-                pmem_free(PDE_ADDR(pde[pdx]));
+                pmem_free(PDE_ADDR(*pde));
             }
         }
     }
+    return err;
+}
+
+static vaddr_t
+entry_end(vaddr_t vaddr, vaddr_t end, int shift)
+{
+    vaddr_t next = (vaddr | ((1UL << shift) - 1)) + 1;
+    return next > end || next == 0 ? end : next;
+}
+
+static pde_t*
+pt_walk_next(struct pt_walk *w, vaddr_t *start, vaddr_t *stop)
+{
+    pml4e_t pml4e;
+    pdpte_t pdpte;
+    pde_t *pde;
+
+    while (w->va < w->end) {
+        pml4e = w->pml4[PML4X(w->va)];
+        if ((pml4e & PTE_P) == 0) {
+            w->va = entry_end(w->va, w->end, PML4X_SHIFT);
+            continue;
+        }
+        pdpte = ((pdpte_t*) KMAP_P2V(PML4E_ADDR(pml4e)))[PDPTX(w->va)];
+        if ((pdpte & PTE_P) == 0) {
+            w->va = entry_end(w->va, w->end, PDPTX_SHIFT);
+            continue;
+        }
+        pde = &((pde_t*) KMAP_P2V(PDPTE_ADDR(pdpte)))[PDX(w->va)];
+        *start = w->va;
+        *stop = w->va = entry_end(w->va, w->end, PDX_SHIFT);
+        if (*pde & PTE_P) {
+            return pde;
+        }
+    }
+    return NULL;
+}
+
+static err_t
+pt_unshare(pde_t *pde)
+{
+    pte_t *old, *new;
+    paddr_t paddr;
+    size_t i;
+
+    spinlock_acquire(&pt_share_lock);
+    // another thread of the vpmap may have been first
+    if (!PDE_SHARED(*pde)) {
+        spinlock_release(&pt_share_lock);
+        return ERR_OK;
+    }
+    if (paddr_to_page(PDE_ADDR(*pde))->refcnt == 1) {
+        *pde |= PTE_W;
+        spinlock_release(&pt_share_lock);
+        return ERR_OK;
+    }
+    if (pmem_alloc(&paddr) != ERR_OK) {
+        spinlock_release(&pt_share_lock);
+        return ERR_NOMEM;
+    }
+    old = (pte_t*) KMAP_P2V(PDE_ADDR(*pde));
+    new = (pte_t*) KMAP_P2V(paddr);
+    for (i = 0; i < N_PTE_PER_PG; i++) {
+        if (old[i] & PTE_P) {
+            // the hardware may set accessed bits concurrently
+            __sync_fetch_and_and(&old[i], ~(pte_t)PTE_W);
+            pmem_inc_refcnt(PPN(old[i]), 1);
+        }
+        new[i] = old[i];
+    }
+    pmem_dec_refcnt(PDE_ADDR(*pde));
+    *pde = paddr | PTE_P | PTE_W | PTE_U;
+    spinlock_release(&pt_share_lock);
+    return ERR_OK;
+}
+
+static bool
+pt_drop(pde_t *pde)
+{
+    bool dropped = False;
+
+    spinlock_acquire(&pt_share_lock);
+    if (paddr_to_page(PDE_ADDR(*pde))->refcnt > 1) {
+        pmem_dec_refcnt(PDE_ADDR(*pde));
+        *pde = 0;
+        dropped = True;
+    } else {
+        *pde |= PTE_W;
+    }
+    spinlock_release(&pt_share_lock);
+    return dropped;
+}
+
+static pte_t*
+find_pte_write(struct vpmap *vpmap, vaddr_t vaddr, int alloc)
+{
+    pde_t *pde;
+
+    if ((pde = find_pde(vpmap->pml4, vaddr, alloc)) == NULL) {
+        return NULL;
+    }
+    if (PDE_SHARED(*pde)) {
+        if (pt_unshare(pde) != ERR_OK) {
+            return NULL;
+        }
+        vpmap_tlb_changed(vpmap);
+        vpmap_invalidate(vpmap, vaddr, 1);
+    }
+    return find_pte(vpmap->pml4, vaddr, alloc);
 }
 
 static pteperm_t
@@ -243,10 +555,16 @@ vpmap_init(void)
     }
     kvpmap->pml4 = (pde_t*)KMAP_P2V(paddr);
     memset(kvpmap->pml4, 0, pg_size);
+    kvpmap->id = ++vpmap_ids;
+    kvpmap->tlb_gen = 0;
+    vpmap_tlb_init(kvpmap);
+    spinlock_init(&shootdown_lock, True);
+    spinlock_init(&pt_share_lock, False);
 
     // Create kernel mappings
+    bool replaced = False;
     for (m = kernel_mappings; m < &kernel_mappings[N_ELEM(kernel_mappings)]; m++) {
-        if (map_pages(kvpmap->pml4, m->vaddr, m->paddr_start, m->paddr_end - m->paddr_start, m->perm) != ERR_OK) {
+        if (map_pages(kvpmap, m->vaddr, m->paddr_start, m->paddr_end - m->paddr_start, m->perm, &replaced) != ERR_OK) {
             panic("vpmap: failed to create kernel mappings");
         }
     }
@@ -265,7 +583,7 @@ vpmap_create(void)
 
     // Create allocator for vpmap
     if (vpmap_allocator == NULL) {
-        if ((vpmap_allocator = kmem_cache_create(sizeof(struct vpmap))) == NULL) {
+        if ((vpmap_allocator = kmem_cache_create("vpmap", sizeof(struct vpmap))) == NULL) {
             panic("vpmap: failed to create allocator");
         }
     }
@@ -278,17 +596,85 @@ vpmap_create(void)
     }
     vpmap->pml4 = (pde_t*)KMAP_P2V(paddr);
     memset(vpmap->pml4, 0, pg_size);
+    vpmap->id = __sync_add_and_fetch(&vpmap_ids, 1);
+    vpmap->tlb_gen = 0;
+    vpmap_tlb_init(vpmap);
 
     // TODO: initialize with no regions?
     return vpmap;
 }
 
+void
+vpmap_pcid_init(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    struct x86_64_cpu *c = mycpu();
+
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if ((ecx & CPUID_ECX_PCID) == 0) {
+        return;
+    }
+    kassert((rcr3() & CR3_PCID_MASK) == 0);
+    memset(c->pcid, 0, sizeof(c->pcid));
+    c->pcid_next = 0;
+    lcr4(rcr4() | CR4_PCIDE);
+    c->pcid_on = 1;
+    pcid_supported = True;
+}
+
 err_t
 vpmap_load(struct vpmap *vpmap)
 {
+    struct x86_64_cpu *c;
+    struct pcid_slot *slot;
+    uint64_t cr3;
+    int i;
+
     kassert(vpmap);
     kassert(vpmap->pml4);
-    lcr3(KMAP_V2P(vpmap->pml4));
+    cr3 = KMAP_V2P(vpmap->pml4);
+    if (ncpu == 0) {
+        // cpus aren't known yet
+        lcr3(cr3);
+        return ERR_OK;
+    }
+
+    intr_set_level(INTR_OFF);
+    c = mycpu();
+    if (c->vpmap != vpmap) {
+        // the bit must be set before tlb_gen is read: a concurrent change
+        // either sees it and sends an IPI, or bumps tlb_gen before the read
+        if (c->vpmap != NULL) {
+            __sync_fetch_and_and(&c->vpmap->cpus, ~(1u << (c - x86_64_cpus)));
+        }
+        __sync_fetch_and_or(&vpmap->cpus, 1u << (c - x86_64_cpus));
+        c->vpmap = vpmap;
+    }
+    if (!pcid_supported || !c->pcid_on) {
+        lcr3(cr3);
+        intr_set_level(INTR_ON);
+        return ERR_OK;
+    }
+    for (i = 0; i < NPCID && c->pcid[i].vpmap_id != vpmap->id; i++) {}
+    if (i == NPCID) {
+        // take a PCID from another vpmap, its entries must go
+        i = c->pcid_next;
+        c->pcid_next = (i + 1) % NPCID;
+        slot = &c->pcid[i];
+        slot->vpmap_id = vpmap->id;
+        slot->tlb_gen = slot->ktlb_gen = ~(uint64_t)0;
+    }
+    slot = &c->pcid[i];
+    // keep the entries if neither the vpmap nor the kernel mappings changed
+    // since this cpu last loaded it
+    cr3 |= i + 1;
+    if (slot->tlb_gen == vpmap->tlb_gen && slot->ktlb_gen == kvpmap->tlb_gen) {
+        cr3 |= CR3_NOFLUSH;
+    }
+    slot->tlb_gen = vpmap->tlb_gen;
+    slot->ktlb_gen = kvpmap->tlb_gen;
+    lcr3(cr3);
+    intr_set_level(INTR_ON);
     return ERR_OK;
 }
 
@@ -299,20 +685,62 @@ vpmap_map(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr, size_t n, memperm_t
     if (n == 0) {
         return ERR_OK;
     }
-    return map_pages(vpmap->pml4, pg_round_down(vaddr), pg_round_down(paddr), n * pg_size, memperm_to_pteperm(memperm));
+    bool replaced = False;
+    err_t err = map_pages(vpmap, pg_round_down(vaddr), pg_round_down(paddr), n * pg_size,
+                          memperm_to_pteperm(memperm), &replaced);
+    if (replaced) {
+        vpmap_tlb_changed(vpmap);
+    }
+    return err;
 }
 
-void
+err_t
+vpmap_map_huge(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr, size_t n, memperm_t memperm)
+{
+    kassert(vpmap);
+    if (n == 0) {
+        return ERR_OK;
+    }
+    return map_huge_pages(vpmap->pml4, vaddr, paddr, n * HUGE_PG_SIZE, memperm_to_pteperm(memperm));
+}
+
+err_t
 vpmap_unmap(struct vpmap *vpmap, vaddr_t vaddr, size_t n, int free_swap)
 {
+    err_t err;
+
     if (vpmap == NULL || vpmap->pml4 == NULL || n == 0) {
-        return;
+        return ERR_OK;
     }
 
     vaddr_t start = pg_round_down(vaddr);
     vaddr_t end = start + n * pg_size;
     kassert(PML4X(start) <= PML4X(end));
-    unmap_pages(vpmap->pml4, start, end, free_swap, 0);
+    err = unmap_pages(vpmap->pml4, start, end, free_swap, 0);
+    vpmap_tlb_changed(vpmap);
+    return err;
+}
+
+void
+vpmap_unmap_page(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr)
+{
+    pde_t *pde;
+    pte_t *pte;
+
+    kassert(vpmap);
+    if ((pde = find_pde(vpmap->pml4, vaddr, 0)) != NULL) {
+        // pt_unshare can't copy the table while the entry goes away, and a
+        // shared table holds one page reference for all of its vpmaps
+        spinlock_acquire(&pt_share_lock);
+        if ((*pde & (PTE_P | PTE_PS)) == PTE_P) {
+            pte = &((pte_t*) KMAP_P2V(PDE_ADDR(*pde)))[PTX(vaddr)];
+            if ((*pte & PTE_P) && PPN(*pte) == pg_round_down(paddr)) {
+                clear_pte(pte, 0);
+            }
+        }
+        spinlock_release(&pt_share_lock);
+    }
+    vpmap_tlb_changed(vpmap);
 }
 
 void
@@ -322,6 +750,10 @@ vpmap_destroy(struct vpmap *vpmap)
         return;
     }
     kassert(vpmap != kvpmap);
+    // wait for cpus still switching away from it
+    while (vpmap->cpus != 0) {
+        pause();
+    }
     // Deallocate all allocated userspace memory and their corresponding
     // page tables. shouldn't use unmap because we need to free intermediate page tables.
     unmap_pages(vpmap->pml4, 0, USTACK_UPPERBOUND, 1, 1);
@@ -343,7 +775,7 @@ vpmap_copy(struct vpmap *srcvpmap, struct vpmap *dstvpmap, vaddr_t srcaddr, vadd
             PPN(*src_pte) == 0) {
             continue;
         }
-        if ((dst_pte = find_pte(dstvpmap->pml4, dstaddr, 1)) == NULL ||
+        if ((dst_pte = find_pte_write(dstvpmap, dstaddr, 1)) == NULL ||
             PPN(*dst_pte) != 0) {
             // Return an error if address already mapped
             return ERR_VPMAP_MAP;
@@ -374,33 +806,85 @@ vpmap_copy_kernel_mapping(struct vpmap *dstvpmap) {
 err_t
 vpmap_cow_copy(struct vpmap *srcvpmap, struct vpmap *dstvpmap, vaddr_t srcaddr, vaddr_t dstaddr, size_t n) {
     kassert(srcvpmap && dstvpmap);
-    pte_t *src_pte, *dst_pte;
+    struct pt_walk walk;
+    pte_t *src_pt, *src_pte, *dst_pt, *dst_pte;
+    pde_t *src_pde, *dst_pde;
+    vaddr_t start, stop, va, dst_pt_va, delta;
+    err_t err = ERR_OK;
 
     srcaddr = pg_round_down(srcaddr);
     dstaddr = pg_round_down(dstaddr);
-
-    // Set all pages in this region to readonly
-    vpmap_set_perm(srcvpmap, srcaddr, n, MEMPERM_UR);
-    vpmap_flush_tlb();
-    for (int i = 0; i < n; i++, srcaddr += pg_size, dstaddr += pg_size) {
-        if ((src_pte = find_pte(srcvpmap->pml4, srcaddr, 0)) == NULL ||
-            PPN(*src_pte) == 0) {
+    delta = dstaddr - srcaddr;
+    walk.pml4 = srcvpmap->pml4;
+    walk.va = srcaddr;
+    walk.end = srcaddr + n * pg_size;
+    dst_pt = NULL;
+    dst_pt_va = 0;
+    while (err == ERR_OK && (src_pde = pt_walk_next(&walk, &start, &stop)) != NULL) {
+        // huge pages only back shared regions, which aren't copied
+        if (*src_pde & PTE_PS) {
             continue;
         }
-        if ((dst_pte = find_pte(dstvpmap->pml4, dstaddr, 1)) == NULL ||
-            PPN(*dst_pte) != 0) {
-            // Return an error if address already mapped
-            return ERR_VPMAP_MAP;
+        // share a page table lying fully inside the range rather than copying
+        // its entries
+        if (stop - start == HUGE_PG_SIZE && (start + delta) % HUGE_PG_SIZE == 0) {
+            if ((dst_pde = find_pde(dstvpmap->pml4, start + delta, 1)) == NULL) {
+                err = ERR_VPMAP_MAP;
+                break;
+            }
+            if ((*dst_pde & PTE_P) == 0) {
+                spinlock_acquire(&pt_share_lock);
+                pmem_inc_refcnt(PDE_ADDR(*src_pde), 1);
+                *src_pde &= ~(pde_t)PTE_W;
+                *dst_pde = *src_pde;
+                spinlock_release(&pt_share_lock);
+                continue;
+            }
         }
-        paddr_t *paddr;
-        if (vpmap_lookup_vaddr(srcvpmap, srcaddr, (paddr_t*)&paddr, NULL) != ERR_OK) {
-            return ERR_VPMAP_MAP;
+        // copy the present entries, looking up a destination page table only
+        // when crossing into another one
+        src_pt = (pte_t*) KMAP_P2V(PDE_ADDR(*src_pde));
+        for (va = start; va < stop; va += pg_size) {
+            src_pte = &src_pt[PTX(va)];
+            if (PPN(*src_pte) == 0) {
+                continue;
+            }
+            if (dst_pt == NULL || (va + delta) - dst_pt_va >= HUGE_PG_SIZE) {
+                if ((dst_pte = find_pte_write(dstvpmap, va + delta, 1)) == NULL || (*dst_pte & PTE_PS)) {
+                    err = ERR_VPMAP_MAP;
+                    break;
+                }
+                dst_pt = dst_pte - PTX(va + delta);
+                dst_pt_va = (va + delta) & ~(HUGE_PG_SIZE - 1);
+            }
+            dst_pte = &dst_pt[PTX(va + delta)];
+            if (PPN(*dst_pte) != 0) {
+                // Return an error if address already mapped
+                err = ERR_VPMAP_MAP;
+                break;
+            }
+            // Set the page readonly, the entry may be in a page table shared
+            // with another vpmap which can't write it anyway
+            __sync_fetch_and_and(src_pte, ~(pte_t)PTE_W);
+            pmem_inc_refcnt(PPN(*src_pte), 1);
+            // Make child pte point to the same physical page
+            *dst_pte = *src_pte;
         }
-        pmem_inc_refcnt((paddr_t)paddr, 1);
-        // Make child pte point to the same physical page
-        *dst_pte = *src_pte;
     }
-    return ERR_OK;
+    vpmap_tlb_changed(srcvpmap);
+    vpmap_invalidate(srcvpmap, srcaddr, n);
+    return err;
+}
+
+err_t
+vpmap_unshare(struct vpmap *vpmap, vaddr_t vaddr)
+{
+    kassert(vpmap);
+    pde_t *pde = find_pde(vpmap->pml4, vaddr, 0);
+    if (pde == NULL || !PDE_SHARED(*pde)) {
+        return ERR_OK;
+    }
+    return find_pte_write(vpmap, vaddr, 0) != NULL ? ERR_OK : ERR_NOMEM;
 }
 
 err_t
@@ -417,7 +901,9 @@ vpmap_lookup_vaddr(struct vpmap *vpmap, vaddr_t vaddr, paddr_t *paddr, swapid_t
     pte_t *pte = find_pte(vpmap->pml4, vaddr, 0);
     if (pte) {
         if (*pte & PTE_P) {
-            if (paddr) {
+            if (paddr && (*pte & PTE_PS)) {
+                *paddr = PDE_ADDR(*pte) + (vaddr & (HUGE_PG_SIZE - 1));
+            } else if (paddr) {
                 *paddr = PPN(*pte) + (vaddr - VPN(vaddr));
             }
             return ERR_OK;
@@ -453,16 +939,17 @@ vpmap_set_perm(struct vpmap *vpmap, vaddr_t vaddr, size_t n, memperm_t memperm)
     vaddr = pg_round_down(vaddr);
     // TODO: fix pte flags. only using the last 3 bits right now.
     for (i = 0; i < n; i++) {
-        pte_t* pte = find_pte(vpmap->pml4, vaddr+i*pg_size, 0);
+        pte_t* pte = find_pte_write(vpmap, vaddr+i*pg_size, 0);
         if (pte) {
-            *pte = PPN(*pte) | (PTE_FLAGS(*pte)&PTE_P) | perm;
+            *pte = PPN(*pte) | (PTE_FLAGS(*pte)&(PTE_P|PTE_PS)) | perm;
         }
     }
+    vpmap_tlb_changed(vpmap);
 }
 
 void
 vpmap_set_dirty(struct vpmap *vpmap, vaddr_t vaddr) {
-    pte_t *pte = find_pte(vpmap->pml4, vaddr, 0);
+    pte_t *pte = find_pte_write(vpmap, vaddr, 0);
     if (pte) {
         *pte = *pte | PTE_D;
     }
@@ -491,13 +978,175 @@ vpmap_get_accessed(struct vpmap *vpmap, vaddr_t vaddr, int *accessed) {
 }
 
 void
-vpmap_flush_tlb() {
+vpmap_clear_accessed(struct vpmap *vpmap, vaddr_t vaddr) {
+    pte_t *pte = find_pte(vpmap->pml4, vaddr, 0);
+    if (pte) {
+        // may be in a shared page table, where the bit is only a hint
+        __sync_fetch_and_and(pte, ~(pte_t)PTE_A);
+        // a cached entry would let the page be used without setting the bit
+        vpmap_tlb_changed(vpmap);
+    }
+}
+
+void
+vpmap_invalidate(struct vpmap *vpmap, vaddr_t vaddr, size_t n)
+{
+    vpmap_invalidate_defer(vpmap, vaddr, n);
+    vpmap_invalidate_sync(vpmap);
+}
+
+void
+vpmap_invalidate_defer(struct vpmap *vpmap, vaddr_t vaddr, size_t n)
+{
+    kassert(vpmap);
+    spinlock_acquire(&vpmap->tlb_lock);
+    if (vpmap->tlb_n + n > INVLPG_MAX) {
+        vpmap->tlb_n = INVLPG_MAX + 1;
+    } else {
+        vaddr = pg_round_down(vaddr);
+        for (size_t i = 0; i < n; i++, vaddr += pg_size) {
+            vpmap->tlb_addrs[vpmap->tlb_n++] = vaddr;
+        }
+    }
+    spinlock_release(&vpmap->tlb_lock);
+}
+
+void
+vpmap_invalidate_sync(struct vpmap *vpmap)
+{
+    struct x86_64_cpu *c, *self;
+    vaddr_t addrs[INVLPG_MAX];
+    uint32_t targets = 0;
+    int n;
+
+    kassert(vpmap);
     intr_set_level(INTR_OFF);
-    vaddr_t pml4 = (vaddr_t) kvpmap->pml4;
-    struct proc *p = proc_current();
-    if (p) {
-        pml4 = (vaddr_t) p->as.vpmap->pml4;
+    if (ncpu > 0) {
+        self = mycpu();
+        if (vpmap == kvpmap) {
+            // kernel mappings are in every vpmap
+            for (c = x86_64_cpus; c < x86_64_cpus + ncpu; c++) {
+                if (c != self && c->started) {
+                    targets |= 1u << (c - x86_64_cpus);
+                }
+            }
+        } else {
+            targets = vpmap->cpus & ~(1u << (self - x86_64_cpus));
+        }
+    }
+    if (targets == 0) {
+        // cpus that load vpmap later see its tlb_gen bumped and flush then
+        n = vpmap_tlb_take(vpmap, addrs);
+        vpmap_tlb_flush_local(vpmap, addrs, n);
+        intr_set_level(INTR_ON);
+        return;
     }
-    lcr3(KMAP_V2P(pml4));
+
+    // Take the batch with shootdown_lock held, so that a cpu finding it empty
+    // can't return before the cpu that took it is done.
+    spinlock_acquire(&shootdown_lock);
+    n = vpmap_tlb_take(vpmap, shootdown.addrs);
+    if (n > 0) {
+        vpmap_tlb_flush_local(vpmap, shootdown.addrs, n);
+        shootdown.vpmap = vpmap;
+        shootdown.n = n;
+        __sync_synchronize();
+        shootdown.pending = targets;
+        for (c = x86_64_cpus; c < x86_64_cpus + ncpu; c++) {
+            if (targets & (1u << (c - x86_64_cpus))) {
+                lapic_send_ipi(c->lapic_id, T_IRQ_TLB);
+            }
+        }
+        while (shootdown.pending != 0) {
+            pause();
+        }
+    }
+    spinlock_release(&shootdown_lock);
     intr_set_level(INTR_ON);
 }
+
+void
+vpmap_shootdown_poll(void)
+{
+    uint32_t self;
+
+    if (shootdown.pending == 0) {
+        return;
+    }
+    self = 1u << (mycpu() - x86_64_cpus);
+    if (shootdown.pending & self) {
+        vpmap_tlb_flush_local(shootdown.vpmap, shootdown.addrs, shootdown.n);
+        __sync_fetch_and_and(&shootdown.pending, ~self);
+    }
+}
+
+err_t
+vpmap_register_trap_handler(void)
+{
+    return trap_register_handler(T_IRQ_TLB, NULL, vpmap_shootdown_trap_handler);
+}
+
+static void
+vpmap_shootdown_trap_handler(irq_t irq, void *dev, void *regs)
+{
+    vpmap_shootdown_poll();
+    trap_notify_irq_completion();
+}
+
+void
+vpmap_flush_tlb() {
+    // reloading CR3 without CR3_NOFLUSH drops the loaded PCID's entries
+    intr_set_level(INTR_OFF);
+    lcr3(rcr3());
+    intr_set_level(INTR_ON);
+}
+
+static void
+vpmap_tlb_init(struct vpmap *vpmap)
+{
+    vpmap->cpus = 0;
+    spinlock_init(&vpmap->tlb_lock, True);
+    vpmap->tlb_n = 0;
+}
+
+static int
+vpmap_tlb_take(struct vpmap *vpmap, vaddr_t *addrs)
+{
+    int n;
+
+    spinlock_acquire(&vpmap->tlb_lock);
+    n = vpmap->tlb_n;
+    if (n <= INVLPG_MAX) {
+        memcpy(addrs, vpmap->tlb_addrs, n * sizeof(vaddr_t));
+    }
+    vpmap->tlb_n = 0;
+    spinlock_release(&vpmap->tlb_lock);
+    return n;
+}
+
+static void
+vpmap_tlb_flush_local(struct vpmap *vpmap, vaddr_t *addrs, int n)
+{
+    if (vpmap != kvpmap && !vpmap_loaded(vpmap)) {
+        return;
+    }
+    if (n > INVLPG_MAX) {
+        vpmap_flush_tlb();
+    } else {
+        for (int i = 0; i < n; i++) {
+            invlpg(addrs[i]);
+        }
+    }
+}
+
+static void
+vpmap_tlb_changed(struct vpmap *vpmap)
+{
+    __sync_add_and_fetch(&vpmap->tlb_gen, 1);
+}
+
+static bool
+vpmap_loaded(struct vpmap *vpmap)
+{
+    return (rcr3() & ~(uint64_t)CR3_PCID_MASK) == KMAP_V2P(vpmap->pml4);
+}
@@ -0,0 +1,79 @@
+#ifndef _AVL_TREE_H_
+#define _AVL_TREE_H_
+
+#include <kernel/types.h>
+#include <lib/stddef.h>
+
+/*
+ * An intrusive AVL tree. Nodes are embedded in the caller's structs, and
+ * lookups walk the tree from root->node comparing the caller's own keys.
+ *
+ * A tree can be augmented: each node summarizes its subtree in fields of the
+ * embedding struct, and root->augment recomputes them from the node and its
+ * children. The tree calls it on every node whose subtree changed, children
+ * before parents.
+ *
+ * The tree does no locking, callers serialize all accesses.
+ */
+
+struct avl_node {
+    struct avl_node *left;
+    struct avl_node *right;
+    struct avl_node *parent;
+    int height;             // of the subtree, 1 for a leaf
+};
+
+struct avl_root {
+    struct avl_node *node;
+    void (*augment)(struct avl_node *node); // NULL if the tree is not augmented
+};
+
+/**
+ * avl_entry - get the struct for this entry
+ * @node:	the struct avl_node* of this entry.
+ * @struct:	the type of the struct this is embedded in.
+ * @member:	the name of the struct avl_node within the struct.
+ */
+#define avl_entry(node, struct, member) \
+	retrieve_struct(node, struct, member)
+
+/*
+ * Return value > 0 when a > b, value == 0 when a = b, value < 0 when a < b.
+ */
+typedef int64_t avl_comparator(const struct avl_node *a, const struct avl_node *b);
+
+/*
+ * Initialize an empty tree. augment may be NULL.
+ */
+void avl_init(struct avl_root *root, void (*augment)(struct avl_node *node));
+
+/*
+ * Insert node into the tree, after the nodes it compares equal to.
+ */
+void avl_insert(struct avl_root *root, struct avl_node *node, avl_comparator *compare);
+
+/*
+ * Remove node from the tree.
+ */
+void avl_remove(struct avl_root *root, struct avl_node *node);
+
+/*
+ * Recompute the augmented data of node and its ancestors, after the caller
+ * changed what root->augment reads from node. The change must not move node
+ * relative to the others.
+ */
+void avl_update(struct avl_root *root, struct avl_node *node);
+
+/*
+ * Return the first (last) node in order, NULL if the tree is empty.
+ */
+struct avl_node *avl_first(struct avl_root *root);
+struct avl_node *avl_last(struct avl_root *root);
+
+/*
+ * Return the node after (before) node in order, NULL if there is none.
+ */
+struct avl_node *avl_next(struct avl_node *node);
+struct avl_node *avl_prev(struct avl_node *node);
+
+#endif /* _AVL_TREE_H_ */
@@ -52,7 +52,8 @@ typedef enum {
 
 typedef enum {
     BIO_PENDING,
-    BIO_COMPLETE
+    BIO_COMPLETE,
+    BIO_ERROR
 } bio_status_t;
 
 /*
@@ -99,7 +100,8 @@ void bio_free(struct bio *bio);
 
 /*
  * Submit a block device request. This function is synchronous: it returns only
- * when the request is completed by the block device.
+ * when the request is completed by the block device. bio->status is then
+ * BIO_COMPLETE, or BIO_ERROR if the device reported an error.
  */
 void bdev_make_request(struct bio *bio);
 
@@ -3,6 +3,7 @@
 
 #include <kernel/memstore.h>
 #include <kernel/fs.h>
+#include <kernel/vm.h>
 
 /*
  * Memstore backed by regular files.
@@ -20,6 +21,33 @@ struct filems_info {
  */
 struct memstore *filems_alloc(struct inode *inode);
 
+// mmap protection and flags, shared with user/lib
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define MAP_SHARED 0x10
+#define MAP_PRIVATE 0x20
+
+/*
+ * Map len bytes of file starting at page aligned offset ofs into as. A shared
+ * mapping maps the file's page cache pages directly, a private one maps them
+ * read-only and copies on write. The region holds a reference to file until
+ * it is unmapped. Store the start of the mapping in addr.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to find room for or allocate the region.
+ */
+err_t filems_mmap(struct file *file, offset_t ofs, size_t len, memperm_t perm, int shared,
+                  struct addrspace *as, vaddr_t *addr);
+
+/*
+ * Write the dirty cached pages of store within [ofs, ofs + len) back through
+ * store->write. Pages are marked dirty when a mapping with a dirty pte goes away.
+ *
+ * Precondition:
+ * Caller must not hold store->pgcache_lock.
+ */
+void filems_writeback(struct memstore *store, offset_t ofs, size_t len);
+
 /*
  * Free a file memstore.
  */
@@ -283,6 +283,17 @@ struct inode_operations {
      * ERR_INCOMP - Failed to fill in the entire page.
      */
     err_t (*fillpage)(struct inode *inode, offset_t ofs, struct page *page);
+    /*
+     * Write a memory page back to an inode at offset ofs. Never extends the
+     * file: only the part of the page below i_size is written.
+     *
+     * Precondition:
+     * Caller must hold inode->i_lock.
+     *
+     * Return:
+     * ERR_INCOMP - Failed to write the part of the page within the file.
+     */
+    err_t (*writepage)(struct inode *inode, offset_t ofs, struct page *page);
     /*
      * Create a new hard link in directory dir that refers to inode src. The
      * new hard link has name ``name``.
@@ -11,12 +11,15 @@
  * allocate and free objects.
  *
  * 2. A generic kmalloc function. The caller specifies the size of allocation.
- * The function however may allocate more memory than requested.
+ * The function however may allocate more memory than requested. Sizes up to
+ * 4096 bytes come from object allocators of fixed size classes, larger ones
+ * from whole pages.
  */
 
 #include <kernel/types.h>
 #include <kernel/list.h>
 #include <kernel/synch.h>
+#include <arch/cpu.h>
 
 /*
  * Slab metadata.
@@ -30,6 +33,34 @@ struct slab {
     int free;
     // Size of the slab (number of pages)
     size_t n_pages;
+    // Number of slots, and of slots handed out (magazines included)
+    int n_objs;
+    int in_use;
+};
+
+/*
+ * A magazine is a stack of free objects [Bonwick]. Each CPU allocates from and
+ * frees to its own magazines without locking, and exchanges full and empty
+ * magazines with its cache's depot.
+ */
+#define MAGAZINE_SIZE 15
+struct magazine {
+    Node node;
+    int rounds;                 // number of objects held
+    void *objs[MAGAZINE_SIZE];
+};
+
+/*
+ * Per-CPU state of an object allocator, only touched by its CPU with
+ * interrupts off.
+ */
+struct kmem_cpu_cache {
+    struct magazine *loaded;    // used first
+    struct magazine *prev;      // swapped with loaded when that one can't serve
+    size_t alloc_hits;          // allocations served from a magazine
+    size_t alloc_misses;
+    size_t free_hits;           // frees taken by a magazine
+    size_t free_misses;
 };
 
 /*
@@ -38,8 +69,44 @@ struct slab {
 struct kmem_cache {
     List full; // Linked-list of slabs that are fully allocated
     List free; // Linked-list of slabs that have free slots
+    List empty; // Linked-list of slabs with no object out
+    size_t n_empty;
     struct spinlock lock;
     size_t obj_size;
+    const char *name;
+    Node cache_node;    // on the list of all allocators
+    // Slab level counters, protected by lock
+    size_t slab_allocs;
+    size_t slab_frees;
+    size_t out;         // objects out of the slabs, magazines included
+    size_t peak;        // max of out
+    // Depot, protected by lock
+    List full_mags;
+    List empty_mags;
+    bool use_mags;
+    struct kmem_cpu_cache cpu[MAX_NCPU];
+};
+
+/*
+ * Statistics of an object allocator.
+ */
+struct kmem_cache_stats {
+    const char *name;
+    size_t obj_size;
+    size_t allocs;          // successful allocations
+    size_t frees;
+    size_t in_use;          // allocs - frees
+    size_t peak;            // most objects out of the slabs at once, magazines included
+    size_t total;           // object slots in all slabs
+    size_t slabs_full;
+    size_t slabs_partial;
+    size_t slabs_free;      // slabs with no object out
+    size_t pages;           // pages held by slabs
+    // magazine hit and miss counts, summed over CPUs
+    size_t alloc_hits;
+    size_t alloc_misses;
+    size_t free_hits;
+    size_t free_misses;
 };
 
 /*
@@ -48,9 +115,15 @@ struct kmem_cache {
 void kmalloc_init(void);
 
 /*
- * Create an allocator that allocates/frees objects of size ``size``.
+ * Start using per-CPU magazines. Must run once mycpu works.
+ */
+void kmalloc_cpu_init(void);
+
+/*
+ * Create an allocator that allocates/frees objects of size ``size``. name is
+ * used in statistics and must outlive the allocator.
  */
-struct kmem_cache *kmem_cache_create(size_t size);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size);
 
 /*
  * Destroy an object allocator.
@@ -68,7 +141,38 @@ void *kmem_cache_alloc(struct kmem_cache *kmem_cache);
 void kmem_cache_free(struct kmem_cache *kmem_cache, void *obj);
 
 /*
- * Allocate ``size`` bytes of memory.
+ * Number of empty slabs an object allocator keeps after a reclaim.
+ */
+#define SLAB_EMPTY_KEEP 1
+
+/*
+ * Return the objects in an allocator's depot of magazines to its slabs, free
+ * the magazines and give all but SLAB_EMPTY_KEEP of its empty slabs back to
+ * pmem. The magazines loaded on CPUs are left alone. Return the number of
+ * pages released.
+ */
+size_t kmem_cache_reclaim(struct kmem_cache *kmem_cache);
+
+/*
+ * kmem_cache_reclaim every object allocator. Return the number of pages
+ * released.
+ */
+size_t kmem_reclaim(void);
+
+/*
+ * Fill in stats for an object allocator.
+ */
+void kmem_cache_get_stats(struct kmem_cache *kmem_cache, struct kmem_cache_stats *stats);
+
+/*
+ * Fill in stats for the first n object allocators in one pass. Return the
+ * number of allocators, which may be more than n.
+ */
+size_t kmem_cache_get_all_stats(struct kmem_cache_stats *stats, size_t n);
+
+/*
+ * Allocate ``size`` bytes of memory. Return NULL if size is 0 or no memory is
+ * left.
  */
 void *kmalloc(size_t size);
 
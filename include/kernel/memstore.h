@@ -10,6 +10,9 @@
 #define ERR_MEMSTORE_NORES 2
 #define ERR_MEMSTORE_IO 3
 
+// Default fault-around window in pages
+#define MEMSTORE_FAULT_AROUND 16
+
 struct page;
 
 /*
@@ -36,6 +39,20 @@ struct memstore {
     struct sleeplock pgcache_lock;
     struct radix_tree_root cached_pages;
 
+    /*
+     * Size in pages, a power of two, of the aligned window around a faulting
+     * page in which already cached pages are mapped by the same fault.
+     * 1 disables fault-around.
+     */
+    size_t fault_around;
+
+    /*
+     * Order of the physical blocks backing each cached page, 0 for base
+     * pages. A block is cached under the page index of its first page and is
+     * mapped with huge pages when page_order == huge_pg_order.
+     */
+    int page_order;
+
     /*
      * Fill a page with data read from this store at the offset position. Each
      * type of memstore implements its own version of the fillpage function.
@@ -64,4 +81,10 @@ struct memstore *memstore_alloc(void);
  */
 void memstore_free(struct memstore *store);
 
+/*
+ * Set the fault-around window of store to n pages, a power of two. 1 disables
+ * fault-around.
+ */
+void memstore_set_fault_around(struct memstore *store, size_t n);
+
 #endif /* _MEMSTORE_H_ */
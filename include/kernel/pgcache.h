@@ -10,9 +10,36 @@
 struct page;
 struct memstore;
 
+/*
+ * Free page watermarks: pmem wakes kswapd when an allocation leaves fewer
+ * than PGCACHE_FREE_LOW pages free, kswapd reclaims up to PGCACHE_FREE_HIGH.
+ */
+#define PGCACHE_FREE_LOW 256
+#define PGCACHE_FREE_HIGH 512
+
+/*
+ * kswapd also wakes up every PGCACHE_SLAB_TICKS timer ticks to give empty
+ * slabs back to pmem.
+ */
+#define PGCACHE_SLAB_TICKS 1000
+
+/*
+ * Radix tree tag on cached pages that may be dirty: they are tagged once
+ * mapped writable, and write-back untags them once clean and unmapped.
+ */
+#define PGCACHE_TAG_DIRTY 0
+
+/*
+ * Initialize the page cache and start kswapd. Must run in a thread, before
+ * anything is cached.
+ */
+void pgcache_init(void);
+
 /*
  * Query a page from the page cache. If the page is not present in the cache,
  * read the page using the memstore, and store the page into the cache.
+ * For stores with page_order > 0, return the first page of the block that
+ * contains ofs.
  *
  * Precondition:
  * Caller must hold store->pgcache_lock.
@@ -22,6 +49,28 @@ struct memstore;
  */
 struct page *pgcache_get_page(struct memstore *store, offset_t ofs);
 
+/*
+ * Look up a cached page without store->pgcache_lock. Return the page with
+ * page->lock held and an extra reference that keeps it from being freed, or
+ * NULL if the page is not cached. The caller releases both with
+ * pgcache_put_page. Blocks larger than a page are not looked up.
+ */
+struct page *pgcache_find_page(struct memstore *store, offset_t ofs);
+
+/*
+ * Unlock and unpin a page returned by pgcache_find_page.
+ */
+void pgcache_put_page(struct page *page);
+
+/*
+ * Tag the cached page at ofs PGCACHE_TAG_DIRTY, called after mapping it
+ * writable. Does nothing if the page is no longer cached.
+ *
+ * Precondition:
+ * Caller must not hold store->pgcache_lock or the page's lock.
+ */
+void pgcache_tag_dirty(struct memstore *store, offset_t ofs);
+
 /*
  * Remove a cached page from the page cache.
  *
@@ -30,4 +79,32 @@ struct page *pgcache_get_page(struct memstore *store, offset_t ofs);
  */
 void pgcache_remove_page(struct memstore *memstore, offset_t ofs);
 
+/*
+ * Drop every cached page of a store that nothing maps anymore, called as the
+ * store is freed.
+ *
+ * Precondition:
+ * Caller must not hold store->pgcache_lock.
+ */
+void pgcache_remove_all(struct memstore *store);
+
+/*
+ * Evict up to target pages from the inactive end of the page cache LRU,
+ * unmapping them from every address space through their store's rmap and
+ * writing dirty ones through store->write first. Stores whose pgcache_lock
+ * is held are skipped. Return the number of pages freed.
+ */
+size_t pgcache_reclaim(size_t target);
+
+/*
+ * Try to free a 2^order pages aligned block of physical memory by migrating
+ * the page cache pages in it to pages elsewhere. Their mappings are removed
+ * and fault the new pages back in. Return True if every page of the chosen
+ * block was moved and a free block of that order exists afterwards.
+ *
+ * Precondition:
+ * Caller must not hold a spinlock.
+ */
+bool pgcache_compact(int order);
+
 #endif /* _PGCACHE_H_ */
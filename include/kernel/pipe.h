@@ -98,25 +98,23 @@ ssize_t kpipe_write(struct file *f, const void *buf, size_t count, offset_t *ofs
 
   args:
     f - file with kpipe
-    fd - file descriptor associated with pipe
   requires:
     f->kpipe != NULL    
   modifies:
     f->kpipe
 */
-void kpipe_ref_decrease(struct file *f, int fd);
+void kpipe_ref_decrease(struct file *f);
 /*
   Increases the appropriate reader/write count for pipe
 
   args:
     f - file with kpipe
-    fd - file descriptor associated with pipe
   requires:
     f->kpipe != NULL    
   modifies:
     f->kpipe
 */
-void kpipe_ref_increase(struct file *f, int fd);
+void kpipe_ref_increase(struct file *f);
 /**/
 #endif  // _PIPE_H_
 /*EOF*/
@@ -10,6 +10,11 @@
  * Physical memory allocator.
  */
 
+/*
+ * Largest buddy block is 2^PMEM_MAX_ORDER pages.
+ */
+#define PMEM_MAX_ORDER 10
+
 /*
  * Each physical page has an associated struct page.
  */
@@ -18,8 +23,13 @@ struct page {
     Node node;
     struct kmem_cache *kmem_cache;
     struct slab *slab;
-    // reverse mapping
+    // reverse mapping, the owning memstore's rmap for page cache pages
     struct rmap *rmap;
+    // offset of a page cache page in its memstore
+    offset_t ofs;
+    // page cache LRU list node and flags, see pgcache.c
+    Node lru_node;
+    state_t lru_state;
     // reference count
     int refcnt;
     // size of the block (power of two number of pages)
@@ -51,6 +61,11 @@ void pmem_boot_init(void);
  */
 void pmem_init(void);
 
+/*
+ * Start caching free pages per CPU. Must run once mycpu works.
+ */
+void pmem_pcp_init(void);
+
 /*
  * Print physical memory status
  */
@@ -106,12 +121,75 @@ int pmem_is_page_dirty(struct page *page);
 void pmem_set_page_dirty(struct page *page, int dirty);
 
 /*
- * Increment the reference count of a physical page by n.
+ * Number of free physical pages.
+ */
+size_t pmem_free_count(void);
+
+/*
+ * Fragmentation statistics of physical memory.
+ */
+struct pmem_stats {
+    size_t free_pages;                          // including pages cached per CPU
+    size_t free_blocks[PMEM_MAX_ORDER + 1];     // free buddy blocks of each order
+    int largest_order;                          // largest order with a free block, -1 if none
+};
+
+/*
+ * Fill in stats with a snapshot of the buddy free lists.
+ */
+void pmem_get_stats(struct pmem_stats *stats);
+
+/*
+ * Find the 2^order pages aligned block with the fewest allocated pages such
+ * that every allocated page in it is movable: a single page cache page
+ * without block buffers. A block with pages in a cpu's free page cache is
+ * skipped, other cpus' caches can't be drained from here; drain the current
+ * cpu's with pmem_drain_pcp first. Store its address in start. Return False
+ * if no block has movable pages only, or if there is a free block of that
+ * order.
+ */
+bool pmem_compact_candidate(int order, paddr_t *start);
+
+/*
+ * Return True if the buddy allocator has a free block of 2^order pages or
+ * larger.
+ */
+bool pmem_has_free_block(int order);
+
+/*
+ * Return the largest order a multi-page allocation failed at since the last
+ * call, -1 if none did. pmem calls the shrinker when such an allocation fails.
+ */
+int pmem_compact_request(void);
+
+/*
+ * Return the current CPU's cached free pages to the buddy free lists, so they
+ * can merge.
+ */
+void pmem_drain_pcp(void);
+
+/*
+ * Register a function that pmem_alloc and pmem_nalloc call whenever they leave
+ * fewer than low pages free, or fail a multi-page allocation. It may run with any lock but pmem's held, so it
+ * should only wake up whoever frees memory.
+ */
+void pmem_register_shrinker(size_t low, void (*shrink)(void));
+
+/*
+ * Increment the reference count of a physical page by n. For a block of more
+ * than one page, the count lives in the first page of the block.
  */
 void pmem_inc_refcnt(paddr_t paddr, size_t n);
 
 /*
- * Decrement the reference count of a physical page by 1.
+ * Increment the reference count of a physical page by 1 unless it is free.
+ * Return False if the page was free.
+ */
+bool pmem_try_inc_refcnt(paddr_t paddr);
+
+/*
+ * Decrement the reference count of a physical page by 1. The whole block is
+ * freed when the count drops to zero.
  */
 void pmem_dec_refcnt(paddr_t paddr);
 
@@ -11,6 +11,17 @@
 #define PROC_MAX_ARG 128
 #define PROC_NAME_LEN 32
 #define PROC_MAX_FILE 128
+#define SPAWN_MAX_ACTIONS 16
+
+// File actions for proc_spawn_actions
+#define SPAWN_DUP2 1    // new process's newfd refers to the spawning process's fd
+#define SPAWN_CLOSE 2   // new process's fd is closed
+
+struct spawn_action {
+    int op;
+    int fd;
+    int newfd;
+};
 
 struct proc {
     pid_t pid;
@@ -33,6 +44,15 @@ void proc_sys_init(void);
 /* Spawn a new process specified by executable name and argument */
 err_t proc_spawn(char *name, char** argv, struct proc **p);
 
+/*
+ * Same as proc_spawn, and apply n file actions, in order, to the new process's
+ * file table before it starts. The new process starts with standard I/O only,
+ * the current process's address space is never copied.
+ * Return ERR_INVAL if an action is malformed or names an unopened fd.
+ */
+err_t proc_spawn_actions(char *name, char** argv, struct spawn_action *actions, int n,
+                         struct proc **p);
+
 /* Fork a new process identical to current process */
 struct proc* proc_fork();
 
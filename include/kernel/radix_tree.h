@@ -5,6 +5,16 @@
 
 /*
  * A radix tree implementation
+ *
+ * Writers (insert, remove, destroy, tag changes) must be serialized by the
+ * caller, and so must gang lookups and iteration. radix_tree_lookup and
+ * radix_tree_tag_get take no lock: they retry when a writer ran concurrently,
+ * and nodes removed while a lookup is in progress are only freed once no
+ * lookup is.
+ *
+ * Each leaf slot carries RADIX_TREE_MAX_TAGS tag bits. A tag is also set on
+ * every internal slot leading to a tagged leaf, so tagged leaves are found
+ * without visiting untagged subtrees.
  */
 
 struct radix_tree_root;
@@ -19,17 +29,34 @@ struct radix_tree_node;
 #define RADIX_TREE_WIDTH_POWER 6 // width is always power of 2
 #define RADIX_TREE_WIDTH (1 << RADIX_TREE_WIDTH_POWER)
 
+#define RADIX_TREE_MAX_TAGS 2
+#define RADIX_TREE_ANY -1 // iterate every leaf rather than tagged ones
+
 struct radix_tree_root {
     int height;
     struct radix_tree_node *root_node;
+    uint32_t seq;                       // odd while a writer changes the tree
+    int readers;                        // lookups in progress
+    struct radix_tree_node *retired;    // removed nodes waiting for readers to leave
 };
 
 struct radix_tree_node {
     int count;
-    struct radix_tree_node *parent;
+    struct radix_tree_node *parent;     // next retired node once removed
+    uint64_t tags[RADIX_TREE_MAX_TAGS]; // one bit per slot
     void *slots[RADIX_TREE_WIDTH];
 };
 
+/*
+ * Iterator over the leaves with index in [start, end), in index order.
+ */
+struct radix_tree_iter {
+    offset_t index; // index of the last leaf returned
+    offset_t next;
+    offset_t end;
+    int tag;        // only visit leaves with this tag, or RADIX_TREE_ANY
+};
+
 /*
  * Constructor for a radix tree.
  */
@@ -47,20 +74,71 @@ int radix_tree_empty(struct radix_tree_root *root);
 
 /*
  * Search and return a leaf node with an index. Return NULL if node not present.
+ * Safe to call concurrently with writers, the leaf may be removed by the time
+ * the caller uses it.
  */
-void *radix_tree_lookup(struct radix_tree_root *root, int index);
+void *radix_tree_lookup(struct radix_tree_root *root, offset_t index);
 
 /*
  * Insert a new leaf node into a tree. Return the following errors:
  * ERR_RADIX_TREE_ALLOC if failed to allocate node
  * ERR_RADIX_TREE_NODE_EXIST if leaf node already exist
  */
-err_t radix_tree_insert(struct radix_tree_root *root, int index, void *leaf);
+err_t radix_tree_insert(struct radix_tree_root *root, offset_t index, void *leaf);
 
 /*
  * Remove a leaf node from a tree and return the leaf node (if present). Return
  * NULL if leaf node is not found.
  */
-void *radix_tree_remove(struct radix_tree_root *root, int index);
+void *radix_tree_remove(struct radix_tree_root *root, offset_t index);
+
+/*
+ * Replace the leaf at index with leaf, keeping its tags, and return the old
+ * leaf. Return NULL and change nothing if there is no leaf at index. Lookups
+ * see either the old or the new leaf.
+ */
+void *radix_tree_replace(struct radix_tree_root *root, offset_t index, void *leaf);
+
+/*
+ * Store up to max leaves with index >= first into results, in index order.
+ * Return the number of leaves stored.
+ */
+size_t radix_tree_gang_lookup(struct radix_tree_root *root, void **results, offset_t first, size_t max);
+
+/*
+ * Same as radix_tree_gang_lookup, for leaves with tag set only.
+ */
+size_t radix_tree_gang_lookup_tag(struct radix_tree_root *root, void **results, offset_t first,
+                                  size_t max, int tag);
+
+/*
+ * Start iterating over leaves with index in [start, end) that have tag, or
+ * every leaf if tag is RADIX_TREE_ANY.
+ */
+void radix_tree_iter_init(struct radix_tree_iter *iter, offset_t start, offset_t end, int tag);
+
+/*
+ * Return the next leaf of an iteration and store its index in iter->index.
+ * Return NULL once the range is exhausted. The tree may change between calls.
+ */
+void *radix_tree_iter_next(struct radix_tree_root *root, struct radix_tree_iter *iter);
+
+/*
+ * Set or clear tag on the leaf at index. Return the leaf, or NULL if there is
+ * no leaf at index.
+ */
+void *radix_tree_tag_set(struct radix_tree_root *root, offset_t index, int tag);
+void *radix_tree_tag_clear(struct radix_tree_root *root, offset_t index, int tag);
+
+/*
+ * Return True if the leaf at index has tag set. Safe to call concurrently with
+ * writers, like radix_tree_lookup.
+ */
+int radix_tree_tag_get(struct radix_tree_root *root, offset_t index, int tag);
+
+/*
+ * Return True if any leaf in the tree has tag set.
+ */
+int radix_tree_tagged(struct radix_tree_root *root, int tag);
 
 #endif /* _RADIX_TREE_H_ */
@@ -2,15 +2,28 @@
 #define _RMAP_H_
 
 #include <kernel/list.h>
+#include <kernel/synch.h>
+#include <kernel/types.h>
+
+struct addrspace;
+struct memregion;
 
 /*
- * Reverse mapping for tracking shared memory regions.
+ * Reverse mapping for tracking the memory regions that map a memstore.
  */
 
 struct rmap {
+    struct spinlock lock;   // protects regions
     List regions;
 };
 
+// used for rmap->regions
+struct pid2mem {
+  Node node;
+  struct addrspace *as;
+  struct memregion *mr;
+};
+
 /*
  * Allocate a new reverse mapping.
  */
@@ -32,8 +45,33 @@ void rmap_construct(struct rmap *rmap);
 void rmap_destroy(struct rmap *rmap);
 
 /*
- * Unmap all memory mappings of a physical page
+ * Record that mr maps the memstore owning rmap. The region must be taken out
+ * with rmap_remove before it is unmapped.
+ *
+ * Return:
+ * ERR_NOMEM - Failed to allocate the entry.
+ */
+err_t rmap_add(struct rmap *rmap, struct memregion *mr);
+
+/*
+ * Remove and return the region of as containing vaddr, NULL if there is none.
+ */
+struct memregion *rmap_remove(struct rmap *rmap, struct addrspace *as, vaddr_t vaddr);
+
+/*
+ * Unmap all memory mappings of a physical page cached by the memstore owning
+ * rmap. Mappings of private copies at the same offset are left alone.
+ *
+ * Precondition:
+ * Caller must hold the memstore's pgcache_lock so the page can't be faulted
+ * back in behind us.
  */
 err_t rmap_unmap(struct rmap *rmap, paddr_t paddr);
 
+/*
+ * Clear the accessed bit of every mapping of a cached physical page. Return
+ * the number of mappings that had it set.
+ */
+int rmap_referenced(struct rmap *rmap, paddr_t paddr);
+
 #endif /* _RMAP_H_ */
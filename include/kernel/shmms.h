@@ -13,34 +13,45 @@
 // Region-specific flags
 #define RS_DEFAULT 0x0
 #define RS_PERSIST 0x100
+#define RS_HUGE 0x200       // Back with huge pages if the size allows it
+// Map cached pages in aligned windows of 2^order pages on a fault, order 0
+// turns fault-around off; without it the store's default window is used
+#define RS_FAULT_AROUND(order) ((order) + 1)
+#define RS_FAULT_AROUND_MASK 0xf
+
+// Mapping-specific flags
+#define MAP_DEFAULT 0x0
+#define MAP_POPULATE 0x1    // Fault in and map every page up front
 
 // Errors
 #define ERR_MAPPED -1
 #define ERR_PERSIST -2
 
 typedef int rs_flag;
+typedef int map_flag;
+
+// Number of buckets in the context table, must be a power of two
+#define CTABLE_N_BUCKETS 512
 
-// Kernel keep track of a list of this
+// Kernel keep track of a hash table of this
 // Each represents an active shared region
 //  uniquely identified by name
 struct smemcontext {
     char name[MAX_NAME_LEN];    // Unique identifier of the region
+    uint32_t hash;              // Hash of name, selects the ctable bucket
     struct memstore* store;     // Memory backing store
     struct spinlock m_lock;     // Lock for smemcontext
-    Node ctable_node;           // List node for ctable
+    Node ctable_node;           // List node for ctable bucket chain
     tid_t lock_by;              // ThreadID of the locking thread
+    struct condvar lock_cv;     // Threads waiting in lockRegion on this region
+    List futex_waiters;         // Threads waiting in waitRegion on this region
     int size;                   // Size of region in # pages
     int refcnt;                 // Current reference count
+    int pins;                   // Temporary references while the bucket lock is dropped
+    int destroy_unpinned;       // Last mapping was force unmapped while pinned
     rs_flag flag;               // flag to keep s.m. open
 };
 
-// used for store->rmap
-struct pid2mem {
-  Node node;
-  struct addrspace *as;
-  struct memregion *mr;
-};
-
 void smem_sys_init();
 
 // Create a shared memory region that spans n pages
@@ -54,7 +65,9 @@ err_t destroySharedRegion(char* name);
 
 // Map the given shared memory region into current process address space
 //  region_beg will be filled with the virtual address of beginning of region
-err_t createMapping(char* name, vaddr_t* region_beg, struct addrspace *as);
+//  MAP_POPULATE maps all pages now instead of faulting them in one by one,
+//  pages that can't be allocated are left to the fault handler
+err_t createMapping(char* name, vaddr_t* region_beg, map_flag flag, struct addrspace *as);
 
 // Unmap the given shared memory region from current address space
 err_t destroyMapping(char* name, vaddr_t vaddr, struct addrspace *as);
@@ -86,6 +99,40 @@ err_t lockRegion(char* name, struct addrspace *as);
 */
 err_t unlockRegion(char* name, struct addrspace *as);
 
+/*
+    Resize the region to n pages
+    Every mapping grows or shrinks in place. When region_beg is not NULL and
+    holds the start of one of as's mappings, that mapping is moved if it
+    can't grow in place, and region_beg is set to its new start.
+    Returns:
+        ERR_OK on success
+        ERR_NOTEXIST if region does not exist
+        ERR_INVAL if n is not positive or not a whole number of the region's pages
+        ERR_NOMEM if some mapping can't grow, no mapping is changed then
+    Shrinking wakes the waitRegion waiters in the cut-off tail
+*/
+err_t resizeRegion(char* name, int n, vaddr_t* region_beg, struct addrspace *as);
+
+/*
+    Sleep until woken by wakeRegion, if the int at addr still equals val.
+    A shrink of the region that cuts off addr wakes the thread as well
+    Pre:
+        addr must be int aligned and inside a mapped shared region
+    Returns:
+        ERR_OK when woken up
+        ERR_INVAL if addr is not inside a shared region or is misaligned
+        ERR_INCOMP if the int at addr does not equal val
+*/
+err_t waitRegion(vaddr_t addr, int val, struct addrspace *as);
+
+/*
+    Wake up to n threads sleeping in waitRegion on the same region offset as addr
+    Returns:
+        Number of threads woken up
+        ERR_INVAL if addr is not inside a shared region or is misaligned
+*/
+int wakeRegion(vaddr_t addr, int n, struct addrspace *as);
+
 /*
     Map the context to the address space
 */
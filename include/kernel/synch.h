@@ -39,6 +39,9 @@ void sleeplock_init(struct sleeplock *lock);
 
 void sleeplock_acquire(struct sleeplock *lock);
 
+/* Acquire the lock only if nobody holds it, return ERR_LOCK_BUSY otherwise */
+err_t sleeplock_try_acquire(struct sleeplock *lock);
+
 void sleeplock_release(struct sleeplock *lock);
 
 
@@ -8,6 +8,19 @@
 #define DEFAULT_PRI 10
 
 /* States a thread can be in. */
+struct addrspace;
+struct memregion;
+
+/* Number of memregions a thread remembers from as_find_memregion */
+#define THREAD_MR_CACHE 2
+
+/* A memregion found by as_find_memregion, valid while gen is as->gen */
+struct mr_cache_entry {
+    struct addrspace *as;
+    uint64_t gen;
+    struct memregion *mr;
+};
+
 typedef enum {
     RUNNING,    /* running */
     READY,      /* ready to run */
@@ -26,6 +39,7 @@ struct thread {
     struct trapframe *tf;       // current trapframe of the thread
     Node node;                  // used to track the thread in ready list or other blocking list 
     Node thread_node;           // connect threads belonging to the same process
+    struct mr_cache_entry mr_cache[THREAD_MR_CACHE];   // most recently found first
 };
 
 typedef int thread_func(void *aux);
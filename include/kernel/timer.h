@@ -8,4 +8,10 @@
  */
 err_t timer_register_trap_handler(void);
 
+/*
+ * Register a function that the timer trap handler calls every period ticks.
+ * It runs in interrupt context, so it should only wake up a thread.
+ */
+void timer_register_periodic(uint32_t period, void (*fn)(void));
+
 #endif /* _TIMER_H_ */
@@ -11,6 +11,9 @@
 #include <kernel/types.h>
 #include <kernel/list.h>
 #include <kernel/synch.h>
+#include <kernel/avl_tree.h>
+
+struct file;
 
 #define ADDR_ANYWHERE 0Xfffffff
 #define UHEAP_INIT_PAGES 1000
@@ -32,21 +35,32 @@ typedef enum {
 
 /*
  * Address space. Each address space consists of a set of memory regions, and a
- * machine dependent virtual-to-physical translation unit ``vpmap``.
+ * machine dependent virtual-to-physical translation unit ``vpmap``. Regions
+ * are kept in a tree ordered by address, augmented so that both finding the
+ * region of an address and finding a free range take O(log n).
  */
 struct memregion {
     struct addrspace *as;
-    Node as_node;           // used to connect all memregions within an addrspace
+    struct avl_node as_node;    // used to connect all memregions within an addrspace
     vaddr_t start;          // starting addr of memregion
     vaddr_t end;            // ending addr of memregion
+    // over the regions in this one's subtree: lowest start, highest end and
+    // largest hole between two of them
+    vaddr_t subtree_start;
+    vaddr_t subtree_end;
+    size_t max_gap;
     memperm_t perm;
     int shared;             // 1:shared 0:private
     struct memstore *store;
     offset_t ofs;           // offset into memstore
+    struct file *file;      // mapped file, NULL unless created by mmap
 };
 
 struct addrspace {
-    List regions;
+    struct avl_root regions;
+    // changes, under as_lock, before a region is added, removed or resized.
+    // Values are never reused, even by another address space.
+    uint64_t gen;
     struct vpmap *vpmap;
     struct spinlock as_lock;
     struct memregion *heap; // track heap memregion to ease extension
@@ -58,11 +72,14 @@ extern struct addrspace *kas;
 /*
  * Machine-dependent vm attributes
  * ``pg_size``: page size
+ * ``huge_pg_size``: size of a huge page, pg_size << huge_pg_order
  * ``kvm_base``: base address of kernel memory
  * ``kmap_start``: starting virtual address of kmap
  * ``kmap_end``: end virtual address of kmap
  */
 extern size_t pg_size;
+extern size_t huge_pg_size;
+extern int huge_pg_order;
 extern vaddr_t kvm_base;
 extern vaddr_t kmap_start;
 extern vaddr_t kmap_end;
@@ -105,6 +122,8 @@ struct memregion *as_map_memregion(struct addrspace *as, vaddr_t addr, size_t si
  * Find which region is associated with the specific address.
  * Return NULL if the address is not associated with any region.
  * size: in bytes
+ * The current thread remembers the last regions found, and finds them again
+ * without taking as_lock while as->gen is unchanged.
  */
 struct memregion *as_find_memregion(struct addrspace *as, vaddr_t addr, size_t size);
 
@@ -129,7 +148,14 @@ void as_meminfo(struct addrspace *as);
  * Return ERR_VM_BOUND if the extended region overlaps with other regions in the
  * address space.
  */
-err_t memregion_extend(struct memregion *region, int size, vaddr_t *old_bound);
+err_t memregion_extend(struct memregion *region, ssize_t size, vaddr_t *old_bound);
+
+/*
+ * Update the address space after region->start or region->end was changed in
+ * place. The region must not overlap another one.
+ * Caller must hold region->as->as_lock.
+ */
+void memregion_update(struct memregion *region);
 
 /*
  * Change permission of a region of memory.
@@ -138,7 +164,9 @@ err_t memregion_extend(struct memregion *region, int size, vaddr_t *old_bound);
 err_t memregion_set_perm(struct memregion *region, memperm_t perm);
 
 /*
- * Unmap and free a memory region.
+ * Unmap and free a memory region. A shared file mapping's dirty pages are
+ * written back and the region's file reference is dropped.
+ * Caller must not hold region->as->as_lock.
  */
 void memregion_unmap(struct memregion *region);
 
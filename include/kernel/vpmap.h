@@ -40,11 +40,33 @@ err_t vpmap_load(struct vpmap *vpmap);
  */
 err_t vpmap_map(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr, size_t n, memperm_t memperm);
 
+/*
+ * Map n huge pages (huge_pg_size bytes each) starting at ``vaddr`` to
+ * contiguous physical memory starting at ``paddr``. Both addresses must be
+ * huge page aligned. Huge page mappings are only ever unmapped whole.
+ * Return ERR_VPMAP_MAP if failed map any pages in range, or if part of the
+ * range is already mapped with base pages.
+ */
+err_t vpmap_map_huge(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr, size_t n, memperm_t memperm);
+
 /*
  * Remove mappings starting at virtual address vaddr for n pages.
  * If free_swap is set, any mapping that resides in swap will be removed from swap.
+ * Return ERR_NOMEM if a page table shared since fork and only partly in the
+ * range could not be copied; its entries stay, the rest of the range is
+ * still unmapped.
  */
-void vpmap_unmap(struct vpmap *vpmap, vaddr_t vaddr, size_t n, int free_swap);
+err_t vpmap_unmap(struct vpmap *vpmap, vaddr_t vaddr, size_t n, int free_swap);
+
+/*
+ * Remove the mapping of vaddr if it maps the page at paddr. A page table
+ * shared with other vpmaps is changed in place, removing the page from all of
+ * them, so this never allocates; the caller must invalidate the TLB entries
+ * of every vpmap that may map vaddr through the table. Counts as a page table
+ * change for vpmap even when nothing was mapped, since a call for another
+ * vpmap sharing the table may have removed its entry.
+ */
+void vpmap_unmap_page(struct vpmap *vpmap, vaddr_t vaddr, paddr_t paddr);
 
 /*
  * Remove all mappings in a vpmap.
@@ -65,10 +87,22 @@ err_t vpmap_copy(struct vpmap *srcvpmap, struct vpmap *dstvpmap, vaddr_t srcaddr
 err_t vpmap_copy_kernel_mapping(struct vpmap *dstvpmap);
 
 /*
- * Mark pages as readonly
+ * Map n pages of src vpmap at srcaddr into dst vpmap at dstaddr copy-on-write,
+ * marking them readonly in both. Page tables lying fully inside the range are
+ * shared by both vpmaps instead of copied, until either changes an entry under
+ * them.
+ * Return ERR_VPMAP_MAP if failed to map pages in dstvpmap
  */
 err_t vpmap_cow_copy(struct vpmap *srcvpmap, struct vpmap *dstvpmap, vaddr_t srcaddr, vaddr_t dstaddr, size_t n);
 
+/*
+ * Give vpmap its own copy of the page table mapping vaddr if it shares it with
+ * another vpmap since vpmap_cow_copy, so that page reference counts tell how
+ * many vpmaps map the pages under it again.
+ * Return ERR_NOMEM if out of memory.
+ */
+err_t vpmap_unshare(struct vpmap *vpmap, vaddr_t vaddr);
+
 
 /*
  * Putting x into pte entry of vaddr entry.
@@ -121,7 +155,42 @@ err_t vpmap_get_dirty(struct vpmap *vpmap, vaddr_t vaddr, int *dirty);
 err_t vpmap_get_accessed(struct vpmap *vpmap, vaddr_t vaddr, int *accessed);
 
 /*
- *  Flush tlb
+ * Clear the accessed bit of the page, so a later vpmap_get_accessed tells
+ * whether it was used since.
+ */
+void vpmap_clear_accessed(struct vpmap *vpmap, vaddr_t vaddr);
+
+/*
+ * Drop the TLB entries for n pages starting at vaddr in vpmap, after changing
+ * or removing their mappings, on every cpu that has vpmap loaded (every cpu for
+ * kvpmap). Other cpus are sent an IPI, and the call returns once they are done.
+ * Pages past a threshold flush the whole address space instead. Entries of a
+ * vpmap that isn't loaded are dropped when it next is.
+ */
+void vpmap_invalidate(struct vpmap *vpmap, vaddr_t vaddr, size_t n);
+
+/*
+ * Queue the invalidation of n pages starting at vaddr in vpmap without
+ * flushing anything yet. Stale entries may be used until the next
+ * vpmap_invalidate_sync of vpmap.
+ */
+void vpmap_invalidate_defer(struct vpmap *vpmap, vaddr_t vaddr, size_t n);
+
+/*
+ * Drop the TLB entries queued for vpmap like vpmap_invalidate does, with at
+ * most one IPI per cpu for the whole batch.
+ */
+void vpmap_invalidate_sync(struct vpmap *vpmap);
+
+/*
+ * Serve TLB shootdown requests from other cpus. Must be called with interrupts
+ * off by loops waiting for another cpu, since that cpu may be waiting for this
+ * one to flush its TLB.
+ */
+void vpmap_shootdown_poll(void);
+
+/*
+ *  Flush tlb of the address space loaded on the current cpu
  */
 void vpmap_flush_tlb();
 
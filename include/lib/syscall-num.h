@@ -27,4 +27,11 @@
 #define SYS_map         26
 #define SYS_unmap       27
 #define SYS_lockSharedRegion       28
-#define SYS_unlockSharedRegion     29
\ No newline at end of file
+#define SYS_unlockSharedRegion     29
+#define SYS_waitSharedRegion       30
+#define SYS_wakeSharedRegion       31
+#define SYS_resizeSharedRegion     32
+#define SYS_mmap                   33
+#define SYS_munmap                 34
+#define SYS_slabinfo               35
+#define SYS_spawnfa                36
\ No newline at end of file
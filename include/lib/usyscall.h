@@ -17,6 +17,19 @@
 // Region-specific flags
 #define RS_DEFAULT 0x0
 #define RS_PERSIST 0x100
+#define RS_HUGE 0x200
+#define RS_FAULT_AROUND(order) ((order) + 1)
+#define RS_FAULT_AROUND_MASK 0xf
+
+// Mapping-specific flags
+#define MAP_DEFAULT 0x0
+#define MAP_POPULATE 0x1
+
+// mmap protection and flags
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define MAP_SHARED 0x10
+#define MAP_PRIVATE 0x20
 
 struct stat {
     int ftype;
@@ -44,8 +57,46 @@ struct dirent {
 #define KMAP_BASE           0xFFFFFFFF80000000
 #define USTACK_UPPERBOUND   0xFFFFFF7FFFFFF000
 
+// Physical memory is handed out in blocks of 2^0 to 2^PMEM_MAX_ORDER pages
+#define PMEM_MAX_ORDER 10
+
 struct sys_info {
     size_t num_pgfault;
+    size_t free_pages;                      // free physical pages
+    size_t free_blocks[PMEM_MAX_ORDER + 1]; // free blocks of each order
+    int largest_free_order;                 // -1 if no block is free
+};
+
+// File actions for spawnfa
+#define SPAWN_MAX_ACTIONS 16
+#define SPAWN_DUP2 1    // child's newfd refers to the caller's fd
+#define SPAWN_CLOSE 2   // child's fd is closed
+
+struct spawn_action {
+    int op;
+    int fd;
+    int newfd;
+};
+
+// Kernel object allocator statistics, see slabinfo
+#define SLAB_NAME_LEN 24
+
+struct slab_info {
+    char name[SLAB_NAME_LEN];
+    size_t obj_size;
+    size_t allocs;
+    size_t frees;
+    size_t in_use;          // objects allocated and not freed
+    size_t peak;            // most objects out of the slabs at once
+    size_t total;           // object slots in all slabs
+    size_t slabs_full;
+    size_t slabs_partial;
+    size_t slabs_free;
+    size_t pages;           // pages held by slabs
+    size_t alloc_hits;      // per-CPU magazine hits and misses
+    size_t alloc_misses;
+    size_t free_hits;
+    size_t free_misses;
 };
 
 /*
@@ -72,6 +123,21 @@ int fork(void);
  * ERR_NOMEM - Failed to allocate memory.
  */
 int spawn(const char *args);
+/*
+ * Same as spawn, and apply n file actions, in order, to the new process's file
+ * table before it runs. It starts with standard I/O only: SPAWN_DUP2 makes its
+ * newfd refer to the caller's open file fd, SPAWN_CLOSE closes its fd. The
+ * caller's address space is not copied, unlike fork.
+ *
+ * Return:
+ * PID of child - Process creation and program execution is successful.
+ * ERR_INVAL - n is negative or more than SPAWN_MAX_ACTIONS, or an action has
+ *             an unknown op, an fd out of range, or names an fd the caller
+ *             hasn't opened.
+ * ERR_FAULT - Address of args or actions is invalid.
+ * ERR_NOMEM - Failed to allocate memory.
+ */
+int spawnfa(const char *args, const struct spawn_action *actions, int n);
 /*
  * Wait for a process to change state. If pid is -1, wait for any child process.
  * If wstatus is not NULL, store the the exit status of the child in wstatus.
@@ -264,7 +330,7 @@ int dup(int fd);
  */
 int pipe(int* fds);
 /*
- * Fill in sysinfo struct
+ * Fill in sysinfo struct: page fault count and physical memory fragmentation
  */
 void info(struct sys_info *info);
 /*
@@ -277,6 +343,11 @@ void halt();
     Param:
         name - unique identifier of the region
         size - can be any size
+        flag - RS_PERSIST keeps the region after its last unmap, RS_HUGE backs
+               it with 2 MiB pages when the size is a multiple of them,
+               RS_FAULT_AROUND(order) makes a fault map the already cached
+               pages of its aligned 2^order page window (order 0 turns
+               that off, the default window is 16 pages)
     Returns:
         ERR_OK on success
         ERR_EXIST on name conflict
@@ -285,11 +356,86 @@ int createSharedRegion(char* name, int size, int flag);
 
 int destroySharedRegion(char* name);
 
-int map(char* name, void** region_beg);
+/*
+    Map a shared region into the address space
+    Param:
+        flag - MAP_POPULATE to map every page now rather than on first touch
+    Returns:
+        ERR_OK on success
+        ERR_NOTEXIST if no region has the given name
+        ERR_INVAL on unknown flags
+*/
+int map(char* name, void** region_beg, int flag);
 
 int unmap(char* name, void* valid_addr);
 
 int lockSharedRegion(char* name);
 
 int unlockSharedRegion(char* name);
+
+/*
+    Sleep while the int at addr, inside a mapped shared region, equals val.
+    Waiters are keyed by region and offset, so processes mapping the region at
+    different addresses still meet. Returns early if resizeSharedRegion shrinks
+    the region so that addr is no longer inside it.
+    Returns:
+        ERR_OK when woken up by wakeSharedRegion or by such a shrink
+        ERR_INCOMP if *addr != val on entry
+        ERR_INVAL if addr is misaligned or not inside a mapped shared region
+        ERR_FAULT if addr is not a valid user address
+*/
+int waitSharedRegion(int* addr, int val);
+
+/*
+    Wake up to n processes sleeping in waitSharedRegion on addr.
+    Returns:
+        Number of processes woken up
+        ERR_INVAL if addr is misaligned or not inside a mapped shared region
+        ERR_FAULT if addr is not a valid user address
+*/
+int wakeSharedRegion(int* addr, int n);
+
+/*
+    Grow or shrink a shared region to size bytes, rounded up to whole pages.
+    Mappings in every process are resized in place. If region_beg is not NULL
+    and points to the start of one of the caller's mappings, that mapping may
+    be moved when it can't grow in place; region_beg is updated to the new start.
+    Returns:
+        ERR_OK on success
+        ERR_NOTEXIST if no region has the given name
+        ERR_INVAL if size is not positive, or not a multiple of 2 MiB for RS_HUGE regions
+        ERR_NOMEM if some mapping has no room to grow, nothing is resized then
+*/
+int resizeSharedRegion(char* name, int size, void** region_beg);
+
+/*
+    Map len bytes of the file open at fd, starting at page aligned offset, into
+    the address space. prot must include PROT_READ. flags is exactly one of
+    MAP_SHARED, whose writes reach the file when the mapping is unmapped, or
+    MAP_PRIVATE, whose writes are only seen by this process. Bytes past the end
+    of the file read as zero and are never written back.
+    Returns:
+        Start of the mapping on success
+        ERR_INVAL on a bad fd, offset, len, prot or flags, or a non-file fd
+        ERR_NOMEM if there is no room for the mapping
+*/
+void *mmap(int fd, int offset, int len, int prot, int flags);
+
+/*
+    Unmap the mmap mapping containing addr.
+    Returns:
+        ERR_OK on success
+        ERR_INVAL if addr is not inside a mapping created by mmap
+*/
+int munmap(void *addr);
+
+/*
+    Fill in up to n entries of info with the statistics of the kernel object
+    allocators. Names longer than SLAB_NAME_LEN - 1 are truncated.
+    Returns:
+        Number of allocators, which may be more than n
+        ERR_INVAL if n is negative
+        ERR_FAULT if info is not a valid buffer of n entries
+*/
+int slabinfo(struct slab_info *info, int n);
 #endif /* _USYSCALL_H_ */
@@ -0,0 +1,257 @@
+#include <kernel/avl_tree.h>
+#include <kernel/console.h>
+
+/*
+ * Height of a subtree, 0 if empty.
+ */
+static int avl_height(struct avl_node *node);
+
+/*
+ * Recompute the height and augmented data of node from its children.
+ */
+static void avl_fix(struct avl_root *root, struct avl_node *node);
+
+/*
+ * Make new take old's place as a child of parent, or as the root.
+ */
+static void avl_replace_child(struct avl_root *root, struct avl_node *parent,
+                              struct avl_node *old, struct avl_node *new);
+
+/*
+ * Rotate the subtree at node, return its new root.
+ */
+static struct avl_node *avl_rotate_left(struct avl_root *root, struct avl_node *node);
+static struct avl_node *avl_rotate_right(struct avl_root *root, struct avl_node *node);
+
+/*
+ * Restore the balance of the subtree at node, whose children are balanced,
+ * and return its new root.
+ */
+static struct avl_node *avl_balance(struct avl_root *root, struct avl_node *node);
+
+/*
+ * Balance and fix every node from node up to the root.
+ */
+static void avl_retrace(struct avl_root *root, struct avl_node *node);
+
+static int
+avl_height(struct avl_node *node)
+{
+    return node == NULL ? 0 : node->height;
+}
+
+static void
+avl_fix(struct avl_root *root, struct avl_node *node)
+{
+    int l = avl_height(node->left), r = avl_height(node->right);
+
+    node->height = 1 + (l > r ? l : r);
+    if (root->augment != NULL) {
+        root->augment(node);
+    }
+}
+
+static void
+avl_replace_child(struct avl_root *root, struct avl_node *parent, struct avl_node *old,
+                  struct avl_node *new)
+{
+    if (parent == NULL) {
+        root->node = new;
+    } else if (parent->left == old) {
+        parent->left = new;
+    } else {
+        parent->right = new;
+    }
+    if (new != NULL) {
+        new->parent = parent;
+    }
+}
+
+static struct avl_node*
+avl_rotate_left(struct avl_root *root, struct avl_node *node)
+{
+    struct avl_node *r = node->right;
+
+    node->right = r->left;
+    if (r->left != NULL) {
+        r->left->parent = node;
+    }
+    avl_replace_child(root, node->parent, node, r);
+    r->left = node;
+    node->parent = r;
+    avl_fix(root, node);
+    avl_fix(root, r);
+    return r;
+}
+
+static struct avl_node*
+avl_rotate_right(struct avl_root *root, struct avl_node *node)
+{
+    struct avl_node *l = node->left;
+
+    node->left = l->right;
+    if (l->right != NULL) {
+        l->right->parent = node;
+    }
+    avl_replace_child(root, node->parent, node, l);
+    l->right = node;
+    node->parent = l;
+    avl_fix(root, node);
+    avl_fix(root, l);
+    return l;
+}
+
+static struct avl_node*
+avl_balance(struct avl_root *root, struct avl_node *node)
+{
+    int balance = avl_height(node->left) - avl_height(node->right);
+
+    if (balance > 1) {
+        if (avl_height(node->left->left) < avl_height(node->left->right)) {
+            avl_rotate_left(root, node->left);
+        }
+        return avl_rotate_right(root, node);
+    }
+    if (balance < -1) {
+        if (avl_height(node->right->right) < avl_height(node->right->left)) {
+            avl_rotate_right(root, node->right);
+        }
+        return avl_rotate_left(root, node);
+    }
+    avl_fix(root, node);
+    return node;
+}
+
+static void
+avl_retrace(struct avl_root *root, struct avl_node *node)
+{
+    // the augmented data of every ancestor may change, so go all the way up
+    while (node != NULL) {
+        node = avl_balance(root, node)->parent;
+    }
+}
+
+void
+avl_init(struct avl_root *root, void (*augment)(struct avl_node *node))
+{
+    kassert(root);
+    root->node = NULL;
+    root->augment = augment;
+}
+
+void
+avl_insert(struct avl_root *root, struct avl_node *node, avl_comparator *compare)
+{
+    struct avl_node **link, *parent = NULL;
+
+    kassert(root && node && compare);
+    link = &root->node;
+    while (*link != NULL) {
+        parent = *link;
+        link = compare(node, parent) < 0 ? &parent->left : &parent->right;
+    }
+    node->left = node->right = NULL;
+    node->parent = parent;
+    node->height = 1;
+    *link = node;
+    avl_retrace(root, node);
+}
+
+void
+avl_remove(struct avl_root *root, struct avl_node *node)
+{
+    struct avl_node *succ, *child, *start;
+
+    kassert(root && node);
+    if (node->left != NULL && node->right != NULL) {
+        // the successor has no left child, it takes node's place
+        for (succ = node->right; succ->left != NULL; succ = succ->left) {}
+        if (succ->parent == node) {
+            start = succ;
+        } else {
+            start = succ->parent;
+            start->left = succ->right;
+            if (succ->right != NULL) {
+                succ->right->parent = start;
+            }
+            succ->right = node->right;
+            node->right->parent = succ;
+        }
+        succ->left = node->left;
+        node->left->parent = succ;
+        avl_replace_child(root, node->parent, node, succ);
+    } else {
+        child = node->left != NULL ? node->left : node->right;
+        start = node->parent;
+        avl_replace_child(root, node->parent, node, child);
+    }
+    node->left = node->right = node->parent = NULL;
+    avl_retrace(root, start);
+}
+
+void
+avl_update(struct avl_root *root, struct avl_node *node)
+{
+    kassert(root && node);
+    for (; node != NULL; node = node->parent) {
+        avl_fix(root, node);
+    }
+}
+
+struct avl_node*
+avl_first(struct avl_root *root)
+{
+    struct avl_node *node;
+
+    kassert(root);
+    if ((node = root->node) == NULL) {
+        return NULL;
+    }
+    while (node->left != NULL) {
+        node = node->left;
+    }
+    return node;
+}
+
+struct avl_node*
+avl_last(struct avl_root *root)
+{
+    struct avl_node *node;
+
+    kassert(root);
+    if ((node = root->node) == NULL) {
+        return NULL;
+    }
+    while (node->right != NULL) {
+        node = node->right;
+    }
+    return node;
+}
+
+struct avl_node*
+avl_next(struct avl_node *node)
+{
+    kassert(node);
+    if (node->right != NULL) {
+        for (node = node->right; node->left != NULL; node = node->left) {}
+        return node;
+    }
+    while (node->parent != NULL && node->parent->right == node) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+struct avl_node*
+avl_prev(struct avl_node *node)
+{
+    kassert(node);
+    if (node->left != NULL) {
+        for (node = node->left; node->right != NULL; node = node->right) {}
+        return node;
+    }
+    while (node->parent != NULL && node->parent->left == node) {
+        node = node->parent;
+    }
+    return node->parent;
+}
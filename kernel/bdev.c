@@ -127,13 +127,13 @@ void
 bdev_init(void)
 {
     // Create object allocators
-    if ((bdev_allocator = kmem_cache_create(sizeof(struct bdev))) == NULL) {
+    if ((bdev_allocator = kmem_cache_create("bdev", sizeof(struct bdev))) == NULL) {
         panic("Failed to create bdev_allocator");
     }
-    if ((bio_allocator = kmem_cache_create(sizeof(struct bio))) == NULL) {
+    if ((bio_allocator = kmem_cache_create("bio", sizeof(struct bio))) == NULL) {
         panic("Failed to create bio_allocator");
     }
-    if ((blk_header_allocator = kmem_cache_create(sizeof(struct blk_header))) == NULL) {
+    if ((blk_header_allocator = kmem_cache_create("blk_header", sizeof(struct blk_header))) == NULL) {
         panic("Failed to create blk_header_allocator");
     }
     // Initialize root block device: currently using IDE
@@ -210,7 +210,7 @@ bdev_make_request(struct bio *bio)
     bio->bdev->request_handler(bio->bdev);
     // Wait for block operation to complete
     spinlock_acquire(&bio->lock);
-    while (bio->status != BIO_COMPLETE) {
+    while (bio->status == BIO_PENDING) {
         condvar_wait(&bio->cv, &bio->lock);
     }
     spinlock_release(&bio->lock);
@@ -261,16 +261,21 @@ bdev_get_blk_unlocked(struct bdev *bdev, blk_t blk)
     Node *n;
     struct blk_header *bh;
 
-    sleeplock_acquire(&bdev->store->pgcache_lock);
-    if ((page = pgcache_get_page(bdev->store, blk * BDEV_BLK_SIZE)) == NULL) {
+    // cache hits don't need pgcache_lock
+    if ((page = pgcache_find_page(bdev->store, blk * BDEV_BLK_SIZE)) == NULL) {
+        sleeplock_acquire(&bdev->store->pgcache_lock);
+        if ((page = pgcache_get_page(bdev->store, blk * BDEV_BLK_SIZE)) == NULL) {
+            sleeplock_release(&bdev->store->pgcache_lock);
+            return NULL;
+        }
+        // pin and lock the page as pgcache_find_page does, before reclaim can see it
+        pmem_inc_refcnt(page_to_paddr(page), 1);
+        sleeplock_acquire(&page->lock);
         sleeplock_release(&bdev->store->pgcache_lock);
-        return NULL;
     }
-    sleeplock_release(&bdev->store->pgcache_lock);
 
-    sleeplock_acquire(&page->lock);
     if (init_blk_headers(page, bdev, FIRST_BLK_IN_PAGE(blk)) != ERR_OK) {
-        sleeplock_release(&page->lock);
+        pgcache_put_page(page);
         // XXX dec reference count on the page
         return NULL;
     }
@@ -283,7 +288,8 @@ bdev_get_blk_unlocked(struct bdev *bdev, blk_t blk)
         kassert(bh);
         if (bh->blk == blk) {
             bh->ref++;
-            sleeplock_release(&page->lock);
+            // the block reference keeps the page cached from here on
+            pgcache_put_page(page);
             return bh;
         }
     }
@@ -26,6 +26,7 @@ fillpage(struct memstore *store, offset_t ofs, struct page *page)
 {
     struct bdevms_info *info;
     struct bio *bio;
+    err_t err;
 
     kassert(store);
     kassert(store->info);
@@ -41,15 +42,33 @@ fillpage(struct memstore *store, offset_t ofs, struct page *page)
     bio->buffer = (void*)kmap_p2v(page_to_paddr(page));
     bio->op = BIO_READ;
     bdev_make_request(bio);
+    err = bio->status == BIO_COMPLETE ? ERR_OK : ERR_MEMSTORE_IO;
     bio_free(bio);
-    return ERR_OK;
+    return err;
 }
 
 static err_t
 write(struct memstore *store, paddr_t paddr, offset_t ofs)
 {
-    // TODO
-    return ERR_OK;
+    struct bdevms_info *info;
+    struct bio *bio;
+    err_t err;
+
+    kassert(store);
+    kassert(store->info);
+    info = (struct bdevms_info*)store->info;
+    if ((bio = bio_alloc()) == NULL) {
+        return ERR_MEMSTORE_NOMEM;
+    }
+    bio->bdev = info->bdev;
+    bio->blk = pg_round_down(ofs) / BDEV_BLK_SIZE;
+    bio->size = pg_size / BDEV_BLK_SIZE;
+    bio->buffer = (void*)kmap_p2v(paddr);
+    bio->op = BIO_WRITE;
+    bdev_make_request(bio);
+    err = bio->status == BIO_COMPLETE ? ERR_OK : ERR_MEMSTORE_IO;
+    bio_free(bio);
+    return err;
 }
 
 struct memstore*
@@ -60,7 +79,7 @@ bdevms_alloc(struct bdev *bdev)
 
     kassert(bdev);
     if (bdevms_allocator == NULL) {
-        if ((bdevms_allocator = kmem_cache_create(sizeof(struct bdevms_info))) == NULL) {
+        if ((bdevms_allocator = kmem_cache_create("bdevms_info", sizeof(struct bdevms_info))) == NULL) {
             return NULL;
         }
     }
@@ -4,6 +4,7 @@
 #include <kernel/filems.h>
 #include <kernel/pgcache.h>
 #include <kernel/console.h>
+#include <kernel/radix_tree.h>
 #include <lib/errcode.h>
 #include <lib/stddef.h>
 #include <lib/string.h>
@@ -25,11 +26,18 @@ fillpage(struct memstore *store, offset_t ofs, struct page *page)
 {
     struct filems_info *info;
 
+    err_t err;
+
     kassert(store);
     kassert(store->info);
     kassert(page);
     info = (struct filems_info*)store->info;
-    if (info->inode->i_ops->fillpage(info->inode, pg_round_down(ofs), page) != ERR_OK) {
+    // the part of the page past the end of file reads as zeros
+    memset((void*)kmap_p2v(page_to_paddr(page)), 0, pg_size);
+    sleeplock_acquire(&info->inode->i_lock);
+    err = info->inode->i_ops->fillpage(info->inode, pg_round_down(ofs), page);
+    sleeplock_release(&info->inode->i_lock);
+    if (err != ERR_OK && err != ERR_INCOMP) {
         return ERR_MEMSTORE_IO;
     }
     return ERR_OK;
@@ -38,7 +46,18 @@ fillpage(struct memstore *store, offset_t ofs, struct page *page)
 static err_t
 write(struct memstore *store, paddr_t paddr, offset_t ofs)
 {
-    // TODO
+    struct filems_info *info;
+    err_t err;
+
+    kassert(store);
+    kassert(store->info);
+    info = (struct filems_info*)store->info;
+    sleeplock_acquire(&info->inode->i_lock);
+    err = info->inode->i_ops->writepage(info->inode, pg_round_down(ofs), paddr_to_page(paddr));
+    sleeplock_release(&info->inode->i_lock);
+    if (err != ERR_OK) {
+        return ERR_MEMSTORE_IO;
+    }
     return ERR_OK;
 }
 
@@ -51,7 +70,7 @@ filems_alloc(struct inode *inode)
     // must be an inode and has no filems stored
     kassert(inode && inode->store == NULL);
     if (filems_allocator == NULL) {
-        if ((filems_allocator = kmem_cache_create(sizeof(struct filems_info))) == NULL) {
+        if ((filems_allocator = kmem_cache_create("filems_info", sizeof(struct filems_info))) == NULL) {
             return NULL;
         }
     }
@@ -69,6 +88,56 @@ filems_alloc(struct inode *inode)
     return store;
 }
 
+err_t
+filems_mmap(struct file *file, offset_t ofs, size_t len, memperm_t perm, int shared,
+            struct addrspace *as, vaddr_t *addr)
+{
+    struct memregion *mr;
+
+    kassert(file && file->f_inode);
+    if ((mr = as_map_memregion(as, ADDR_ANYWHERE, len, perm, file->f_inode->store, ofs, shared)) == NULL) {
+        return ERR_NOMEM;
+    }
+    if (rmap_add(&mr->store->rmap, mr) != ERR_OK) {
+        memregion_unmap(mr);
+        return ERR_NOMEM;
+    }
+    // the region keeps the file, and with it the inode and its store, alive
+    fs_reopen_file(file);
+    mr->file = file;
+    *addr = mr->start;
+    return ERR_OK;
+}
+
+void
+filems_writeback(struct memstore *store, offset_t ofs, size_t len)
+{
+    struct radix_tree_iter iter;
+    struct page *page;
+
+    kassert(store);
+    sleeplock_acquire(&store->pgcache_lock);
+    // only pages mapped writable at some point can be dirty
+    radix_tree_iter_init(&iter, pg_round_down(ofs) / pg_size, pg_round_up(ofs + len) / pg_size,
+                         PGCACHE_TAG_DIRTY);
+    while ((page = radix_tree_iter_next(&store->cached_pages, &iter)) != NULL) {
+        sleeplock_acquire(&page->lock);
+        if (pmem_is_page_dirty(page)) {
+            pmem_set_page_dirty(page, False);
+            if (store->write(store, page_to_paddr(page), page->ofs) != ERR_OK) {
+                // keep it dirty for the next write-back
+                pmem_set_page_dirty(page, True);
+            }
+        }
+        // a page still mapped may be dirtied again
+        if (!pmem_is_page_dirty(page) && page->refcnt == 1) {
+            radix_tree_tag_clear(&store->cached_pages, iter.index, PGCACHE_TAG_DIRTY);
+        }
+        sleeplock_release(&page->lock);
+    }
+    sleeplock_release(&store->pgcache_lock);
+}
+
 void
 filems_free(struct memstore *store)
 {
@@ -191,13 +191,13 @@ fs_init(void)
     spinlock_init(&fs_type_lock, False);
 
     // Create object allocators
-    if ((fs_sb_allocator = kmem_cache_create(sizeof(struct super_block))) == NULL) {
+    if ((fs_sb_allocator = kmem_cache_create("super_block", sizeof(struct super_block))) == NULL) {
         panic("Failed to create fs_sb_allocator");
     }
-    if ((fs_inode_allocator = kmem_cache_create(sizeof(struct inode))) == NULL) {
+    if ((fs_inode_allocator = kmem_cache_create("inode", sizeof(struct inode))) == NULL) {
         panic("Failed to create fs_inode_allocator");
     }
-    if ((fs_file_allocator = kmem_cache_create(sizeof(struct file))) == NULL) {
+    if ((fs_file_allocator = kmem_cache_create("file", sizeof(struct file))) == NULL) {
         panic("Failed to create fs_file_allocator");
     }
 
@@ -174,7 +174,7 @@ erase_journal(struct journal *journal)
 void
 jbd_init(void)
 {
-    if ((journal_allocator = kmem_cache_create(sizeof(struct kmem_cache))) == NULL) {
+    if ((journal_allocator = kmem_cache_create("journal", sizeof(struct kmem_cache))) == NULL) {
         panic("Failed to create journal_allocator");
     }
 }
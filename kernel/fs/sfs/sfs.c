@@ -74,6 +74,7 @@ static err_t sfs_mkdir(struct inode *dir, const char *name, fmode_t mode);
 static err_t sfs_rmdir(struct inode *dir, const char *name);
 static err_t sfs_lookup(struct inode *dir, const char *name, struct inode **inode);
 static err_t sfs_fillpage(struct inode *inode, offset_t ofs, struct page *page);
+static err_t sfs_writepage(struct inode *inode, offset_t ofs, struct page *page);
 static err_t sfs_link(struct inode *dir, struct inode *src, const char *name);
 static err_t sfs_unlink(struct inode *dir, const char *name);
 static struct inode_operations sfs_inode_operations = {
@@ -82,6 +83,7 @@ static struct inode_operations sfs_inode_operations = {
     .rmdir = sfs_rmdir,
     .lookup = sfs_lookup,
     .fillpage = sfs_fillpage,
+    .writepage = sfs_writepage,
     .link = sfs_link,
     .unlink = sfs_unlink
 };
@@ -1150,6 +1152,24 @@ sfs_fillpage(struct inode *inode, offset_t ofs, struct page *page)
     return ERR_OK;
 }
 
+static err_t
+sfs_writepage(struct inode *inode, offset_t ofs, struct page *page)
+{
+    void *buf;
+    size_t count;
+
+    kassert(inode);
+    if (ofs >= inode->i_size) {
+        return ERR_OK;
+    }
+    count = min(pg_size, inode->i_size - ofs);
+    buf = (void*)kmap_p2v(page_to_paddr(page));
+    if (write_data(inode, buf, count, ofs) < count) {
+        return ERR_INCOMP;
+    }
+    return ERR_OK;
+}
+
 static err_t
 sfs_link(struct inode *dir, struct inode *src, const char *name)
 {
@@ -1239,10 +1259,10 @@ sfs_readdir(struct file *dir, struct dirent *dirent)
 err_t
 sfs_init(void)
 {
-    if ((sfs_sb_allocator = kmem_cache_create(sizeof(struct sfs_sb_info))) == NULL) {
+    if ((sfs_sb_allocator = kmem_cache_create("sfs_sb_info", sizeof(struct sfs_sb_info))) == NULL) {
         return ERR_INIT;
     }
-    if ((sfs_inode_allocator = kmem_cache_create(sizeof(struct sfs_inode_info))) == NULL) {
+    if ((sfs_inode_allocator = kmem_cache_create("sfs_inode_info", sizeof(struct sfs_inode_info))) == NULL) {
         return ERR_INIT;
     }
     fs_register_fs(&sfs_fs_type);
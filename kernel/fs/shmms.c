@@ -10,14 +10,43 @@
 #include <lib/string.h>
 #include <kernel/thread.h>
 #include <arch/mmu.h>
-// Get context from ctable by given name
-// Pre: hold ctable_lock
-static err_t getContextByHandle(char* name, int mapped, struct smemcontext** context, struct addrspace *as);
+/*
+ * ctable is a hash table of active shared regions keyed by name. Each bucket
+ * has its own lock, which protects the bucket chain as well as every context
+ * (and its rmap list) hashed into that bucket.
+ */
+struct ctable_bucket {
+    List chain;                 // Contexts whose name hash selects this bucket
+    struct spinlock lock;       // Protects chain and the contexts in it
+};
+
+/*
+ * A thread sleeping in waitRegion. Lives on the waiter's kernel stack and is
+ * linked into the region's futex_waiters list under the bucket lock.
+ */
+struct futex_waiter {
+    Node node;                  // List node for futex_waiters
+    offset_t ofs;               // Offset into the region being waited on
+    int woken;                  // Set by wakeRegion before signaling
+    struct condvar cv;          // Condvar the waiter sleeps on
+};
+
+#define CTABLE_BUCKET(hash) (&ctable[(hash) & (CTABLE_N_BUCKETS - 1)])
+
+// Hash a region name (FNV-1a)
+static uint32_t ctable_hash(char* name);
+
+// Get context from ctable by given name and hash
+// Pre: hold lock of the bucket selected by hash
+static err_t getContextByHandle(char* name, uint32_t hash, int mapped, struct smemcontext** context, struct addrspace *as);
+
+// Get context and region offset of a user address inside a mapped region
+static err_t getContextByAddr(vaddr_t addr, struct addrspace *as, struct smemcontext** context, offset_t *ofs);
 
 /*  Initialize context based on given name and size
     Return ERR_OK when success
 */
-static err_t contextInit(struct smemcontext* context, char* name, int size, rs_flag flag);
+static err_t contextInit(struct smemcontext* context, char* name, uint32_t hash, int size, rs_flag flag);
 
 /*
     Helper method to destroy mapping by context
@@ -25,48 +54,83 @@ static err_t contextInit(struct smemcontext* context, char* name, int size, rs_f
 static err_t destroyMapping_Internal(struct smemcontext* ctx, struct memregion *mr, int forceDestroy);
 
 /*
-    Destroys context itself iff refcnt == 0
-    requires: caller holds ctable_lock
+    Unlinks context from the table iff refcnt == 0 and it isn't pinned, the
+    caller then frees it with contextFree
+    requires: caller holds the context's bucket lock
 */
 static err_t destroySharedRegion_Internal(struct smemcontext *context, int forceDestroy);
 
 /*
-  Searches context->store->rmap for a region associated with this as
+    Keep context in the table while the caller drops its bucket lock
+    Pre:
+        Caller holds the context's bucket lock
+*/
+static void contextPin(struct smemcontext *context);
+
+/*
+    Drop a pin. If the last mapping was force unmapped meanwhile, finish the
+    destroy it left to the pin: unlink the context and return True, the caller
+    then frees it with contextFree once it dropped its locks
+    Pre:
+        Caller holds the context's bucket lock
+*/
+static bool contextUnpin(struct smemcontext *context);
+
+/*
+    Free an unlinked context and its memstore
+    Pre:
+        Caller doesn't hold a bucket lock, dropping the page cache may sleep
 */
-static struct pid2mem* find_remove_rmapping(struct smemcontext *context, struct addrspace *as, vaddr_t vaddr);
+static void contextFree(struct smemcontext *context);
 
 /*
    Sets up mappings, handles errors
  */
 static err_t createMapping_Internal(char *name, vaddr_t* start, struct addrspace* as, struct smemcontext *context, struct memregion* mr); 
 
-// Print useful info about current regions
-static void printSharedRegions();
-
 /*
-    Allocates nodes for reverse mapping's
+    Map every page of as's fresh mapping at start in one pass, coalescing
+    physically contiguous cache pages into a single vpmap_map call, or one
+    huge page at a time for huge page backed regions. Holds pgcache_lock
+    throughout so resizeRegion can't change the mapping underneath, and
+    drops the context pin taken by the caller.
+    Pre:
+        Caller doesn't hold a bucket lock, pgcache_lock is a sleeplock
 */
-static struct pid2mem* pid2mem_alloc(void);
+static void populateMapping(struct smemcontext *ctx, struct addrspace *as, vaddr_t start);
 
 /*
-   Free node's for reverse mapping's
+    Drop the page cache's pages in [from, to) before the region shrinks,
+    each under its page lock
+    Pre:
+        caller holds store->pgcache_lock but not a bucket lock
 */
-static void pid2mem_free(struct pid2mem *node); 
+static void trimCache(struct memstore *store, size_t from, size_t to);
+
+// Print useful info about current regions
+static void printSharedRegions();
 
-// used for nodes within rmap
-static struct kmem_cache *rmap_node_allocator = NULL;
 
-List ctable;    // Context table for active shared regions
-struct spinlock ctable_lock;
-struct condvar wait_cv;
+static struct ctable_bucket ctable[CTABLE_N_BUCKETS];    // Context table for active shared regions
 struct kmem_cache *ctx_allocator;
 
-static err_t getContextByHandle(char* name, int mapped, struct smemcontext** context, struct addrspace *as) {
+static uint32_t ctable_hash(char* name) {
+    uint32_t hash = 2166136261u;
+    for (; *name != 0; name++) {
+        hash ^= (uint8_t)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static err_t getContextByHandle(char* name, uint32_t hash, int mapped, struct smemcontext** context, struct addrspace *as) {
     struct smemcontext *c = NULL;
-    for (Node *n = list_begin(&ctable); n != list_end(&ctable); n = list_next(n)) {
+    List *chain = &CTABLE_BUCKET(hash)->chain;
+    for (Node *n = list_begin(chain); n != list_end(chain); n = list_next(n)) {
         c = list_entry(n, struct smemcontext, ctable_node);
         kassert(c);
-        if (strcmp((char*)name, (char*)c->name) == 0) {
+        // compare full hash first, only fall back to strcmp on a hit
+        if (c->hash == hash && strcmp((char*)name, (char*)c->name) == 0) {
             break;
         }
         c = NULL;
@@ -95,10 +159,27 @@ static err_t getContextByHandle(char* name, int mapped, struct smemcontext** con
     return ERR_NOTEXIST;
 }
 
-static err_t contextInit(struct smemcontext* context, char* name, int size, rs_flag flag) {
+static err_t getContextByAddr(vaddr_t addr, struct addrspace *as, struct smemcontext** context, offset_t *ofs) {
+    struct memregion *mr;
+
+    // an aligned int never straddles a page
+    if (addr % sizeof(int) != 0) {
+        return ERR_INVAL;
+    }
+    if ((mr = as_find_memregion(as, addr, sizeof(int))) == NULL || !mr->shared || mr->file) {
+        return ERR_INVAL;
+    }
+    kassert(mr->store && mr->store->info);
+    *context = mr->store->info;
+    *ofs = mr->ofs + (addr - mr->start);
+    return ERR_OK;
+}
+
+static err_t contextInit(struct smemcontext* context, char* name, uint32_t hash, int size, rs_flag flag) {
     kassert(context);
     memset(context, 0, sizeof(struct smemcontext));
     strcpy((char*)context->name, (char*)name);
+    context->hash = hash;
     context->store = shmms_alloc(context);
     if (context->store == NULL) {
         return ERR_NOMEM;
@@ -107,115 +188,275 @@ static err_t contextInit(struct smemcontext* context, char* name, int size, rs_f
     context->size = size;
     context->refcnt = 0;
     context->lock_by = -1;
+    condvar_init(&context->lock_cv);
+    list_init(&context->futex_waiters);
+    // huge pages only when the region is a whole number of them
+    if ((flag & RS_HUGE) && ((size_t)size * pg_size) % huge_pg_size == 0) {
+        context->store->page_order = huge_pg_order;
+    } else {
+        flag &= ~RS_HUGE;
+    }
+    if (flag & RS_FAULT_AROUND_MASK) {
+        memstore_set_fault_around(context->store, (size_t)1 << ((flag & RS_FAULT_AROUND_MASK) - 1));
+    }
     context->flag = flag;
     return ERR_OK;
 }
 
 #pragma GCC diagnostic ignored "-Wunused-function"
 static void printSharedRegions() {
-    for (Node *n = list_begin(&ctable); n != list_end(&ctable); n = list_next(n)) {
-        struct smemcontext *c = list_entry(n, struct smemcontext, ctable_node);
-        kassert(c);
-        kprintf("name = %s | sz = %d | refcnt = %d\n", c->name, c->size, c->refcnt);
+    for (struct ctable_bucket *b = ctable; b < &ctable[CTABLE_N_BUCKETS]; b++) {
+        spinlock_acquire(&b->lock);
+        for (Node *n = list_begin(&b->chain); n != list_end(&b->chain); n = list_next(n)) {
+            struct smemcontext *c = list_entry(n, struct smemcontext, ctable_node);
+            kassert(c);
+            kprintf("name = %s | sz = %d | refcnt = %d\n", c->name, c->size, c->refcnt);
+        }
+        spinlock_release(&b->lock);
     }
 }
 
 void smem_sys_init(void) {
-    list_init(&ctable);
-    spinlock_init(&ctable_lock, False);
-    condvar_init(&wait_cv);
-    ctx_allocator = kmem_cache_create(sizeof(struct smemcontext));
+    for (struct ctable_bucket *b = ctable; b < &ctable[CTABLE_N_BUCKETS]; b++) {
+        list_init(&b->chain);
+        spinlock_init(&b->lock, False);
+    }
+    ctx_allocator = kmem_cache_create("smemcontext", sizeof(struct smemcontext));
     kassert(ctx_allocator);
     kprintf("shared memory initialized\n");
 }
 
 err_t createSharedRegion(char* name, int n, rs_flag flag) {
+    uint32_t hash = ctable_hash(name);
+    struct ctable_bucket *b = CTABLE_BUCKET(hash);
+
     // Does there exist a region with this name?
-    spinlock_acquire(&ctable_lock);
+    spinlock_acquire(&b->lock);
     
-    if (getContextByHandle(name, REG_ANY, NULL, NULL) == ERR_OK) {
+    if (getContextByHandle(name, hash, REG_ANY, NULL, NULL) == ERR_OK) {
       // can we include return context here?
-        spinlock_release(&ctable_lock);
+        spinlock_release(&b->lock);
         return ERR_EXIST;
     }
     
     // Nope, create the region context then
     struct smemcontext* context = (struct smemcontext*) kmem_cache_alloc(ctx_allocator);
     if (context == NULL) {
-        spinlock_release(&ctable_lock);
+        spinlock_release(&b->lock);
         return ERR_NOMEM;
     }
 
     // Initialize the context
-    if (contextInit(context, name, n, flag) != ERR_OK) {
+    if (contextInit(context, name, hash, n, flag) != ERR_OK) {
         kmem_cache_free(ctx_allocator, context);
-        spinlock_release(&ctable_lock);
+        spinlock_release(&b->lock);
         return ERR_NOMEM;
     }
-    list_append(&ctable, &context->ctable_node);
+    list_append(&b->chain, &context->ctable_node);
     //printSharedRegions();
-    spinlock_release(&ctable_lock);
+    spinlock_release(&b->lock);
     return ERR_OK;
 }
 
 err_t destroySharedRegion(char* name) {
-    spinlock_acquire(&ctable_lock);
+    uint32_t hash = ctable_hash(name);
+    struct ctable_bucket *b = CTABLE_BUCKET(hash);
     struct smemcontext* ctx;
     err_t err;
+
+    spinlock_acquire(&b->lock);
     //printSharedRegions();
-    if (getContextByHandle(name, REG_ANY, &ctx, NULL) != ERR_OK) {
-        spinlock_release(&ctable_lock);
+    if (getContextByHandle(name, hash, REG_ANY, &ctx, NULL) != ERR_OK) {
+        spinlock_release(&b->lock);
         return ERR_NOTEXIST;
     }
     err = destroySharedRegion_Internal(ctx, ctx->flag & RS_PERSIST);
-    spinlock_release(&ctable_lock);
+    spinlock_release(&b->lock);
+    if (err == ERR_OK) {
+        contextFree(ctx);
+    }
     return err;
 }
 
-static err_t destroySharedRegion_Internal(struct smemcontext *ctx, int forceDestroy) {
+static void trimCache(struct memstore *store, size_t from, size_t to) {
+    struct radix_tree_iter iter;
+    struct page *pg;
+
+    radix_tree_iter_init(&iter, from / pg_size, to / pg_size, RADIX_TREE_ANY);
+    while ((pg = radix_tree_iter_next(&store->cached_pages, &iter)) != NULL) {
+        // pgcache_find_page rechecks the tree under page->lock
+        sleeplock_acquire(&pg->lock);
+        pgcache_remove_page(store, pg->ofs);
+        sleeplock_release(&pg->lock);
+        // the cache's reference, mappings drop theirs when unmapped
+        pmem_dec_refcnt(page_to_paddr(pg));
+    }
+}
 
-    // check if other regions are still mapped or persist
-    if (ctx->refcnt != 0) {
-        return ERR_MAPPED;
-    } else if (((ctx->flag & RS_PERSIST) & ~forceDestroy)) {
-        return ERR_PERSIST;
+err_t resizeRegion(char* name, int n, vaddr_t* region_beg, struct addrspace *as) {
+    struct smemcontext *ctx;
+    uint32_t hash = ctable_hash(name);
+    struct ctable_bucket *b = CTABLE_BUCKET(hash);
+    struct pid2mem *moving = NULL;
+    struct memstore *store;
+    size_t old_bytes, new_bytes;
+    vaddr_t old_bound;
+    ssize_t delta_pages, delta;
+    bool dead = False;
+
+    if (n <= 0) {
+        return ERR_INVAL;
     }
-    
-    // remove smemcontext, free its memstore and context
-    list_remove((Node*)&ctx->ctable_node);
-    shmms_free(ctx->store);
-    kmem_cache_free(ctx_allocator, ctx);
 
-    return ERR_OK;
-}
+    spinlock_acquire(&b->lock);
+    if (getContextByHandle(name, hash, REG_ANY, &ctx, NULL) != ERR_OK) {
+        spinlock_release(&b->lock);
+        return ERR_NOTEXIST;
+    }
+    // pin the context while pgcache_lock is taken without the bucket lock
+    contextPin(ctx);
+    spinlock_release(&b->lock);
+    store = ctx->store;
+    // holding pgcache_lock keeps populateMapping from mapping under us
+    sleeplock_acquire(&store->pgcache_lock);
+    spinlock_acquire(&b->lock);
+    if (contextUnpin(ctx)) {
+        // its last mapping exited meanwhile
+        spinlock_release(&b->lock);
+        sleeplock_release(&store->pgcache_lock);
+        contextFree(ctx);
+        return ERR_NOTEXIST;
+    }
 
-static void pid2mem_free(struct pid2mem *node) {
+    old_bytes = (size_t)ctx->size * pg_size;
+    new_bytes = (size_t)n * pg_size;
+    delta_pages = (ssize_t)n - ctx->size;
+    delta = delta_pages * (ssize_t)pg_size;
+    if (new_bytes % (pg_size << store->page_order) != 0) {
+        spinlock_release(&b->lock);
+        sleeplock_release(&store->pgcache_lock);
+        return ERR_INVAL;
+    }
 
-  kassert(node);
-  kmem_cache_free(rmap_node_allocator, node);
+    List *mappings = &store->rmap.regions;
+    if (delta > 0) {
+        Node *failed = NULL;
+        for (Node *node = list_begin(mappings); node != list_end(mappings); node = list_next(node)) {
+            struct pid2mem *p = list_entry(node, struct pid2mem, node);
+            if (moving == NULL && region_beg != NULL && p->as == as && p->mr->start == *region_beg) {
+                moving = p;
+                continue;
+            }
+            if (memregion_extend(p->mr, delta, &old_bound) != ERR_OK) {
+                failed = node;
+                break;
+            }
+        }
+        if (failed == NULL && moving != NULL &&
+            memregion_extend(moving->mr, delta, &old_bound) != ERR_OK) {
+            // the caller's mapping is boxed in, move it, pages refault from the cache
+            struct memregion *mr = as_map_memregion(as, ADDR_ANYWHERE, new_bytes,
+                                    moving->mr->perm, store, moving->mr->ofs, 1);
+            if (mr == NULL) {
+                failed = list_end(mappings);
+            } else {
+                // reclaim walks the rmap under its lock only
+                spinlock_acquire(&store->rmap.lock);
+                struct memregion *old = moving->mr;
+                moving->mr = mr;
+                spinlock_release(&store->rmap.lock);
+                memregion_unmap(old);
+                *region_beg = mr->start;
+            }
+        }
+        if (failed != NULL) {
+            // undo the mappings grown before the failure
+            for (Node *node = list_begin(mappings); node != failed; node = list_next(node)) {
+                struct pid2mem *p = list_entry(node, struct pid2mem, node);
+                if (p != moving) {
+                    memregion_extend(p->mr, -delta, &old_bound);
+                }
+            }
+            spinlock_release(&b->lock);
+            sleeplock_release(&store->pgcache_lock);
+            return ERR_NOMEM;
+        }
+    } else if (delta < 0) {
+        // drop the tail from the cache before unmapping it: a fault that
+        // locked a tail page first has mapped it by the time trimCache gets
+        // the page lock, and the unmap below removes that, a later one no
+        // longer finds the page and waits for pgcache_lock
+        // pin the context while the cache is trimmed without the bucket lock
+        contextPin(ctx);
+        spinlock_release(&b->lock);
+        trimCache(store, new_bytes, old_bytes);
+        spinlock_acquire(&b->lock);
+        dead = contextUnpin(ctx);
+        for (Node *node = list_begin(mappings); node != list_end(mappings); node = list_next(node)) {
+            struct pid2mem *p = list_entry(node, struct pid2mem, node);
+            vpmap_unmap(p->as->vpmap, p->mr->start + new_bytes, -delta_pages, 0);
+            vpmap_invalidate(p->as->vpmap, p->mr->start + new_bytes, -delta_pages);
+            memregion_extend(p->mr, delta, &old_bound);
+        }
+        // no address can reach waiters in the cut-off tail with wakeRegion now
+        for (Node *node = list_begin(&ctx->futex_waiters); node != list_end(&ctx->futex_waiters);) {
+            struct futex_waiter *w = list_entry(node, struct futex_waiter, node);
+            if (w->ofs < new_bytes) {
+                node = list_next(node);
+                continue;
+            }
+            node = list_remove(node);
+            w->woken = True;
+            condvar_signal(&w->cv);
+        }
+    }
+    ctx->size = n;
+    spinlock_release(&b->lock);
+    sleeplock_release(&store->pgcache_lock);
+    if (dead) {
+        contextFree(ctx);
+    }
+    return ERR_OK;
+}
 
+static void contextPin(struct smemcontext *ctx) {
+    ctx->pins++;
 }
 
-static struct pid2mem* pid2mem_alloc(void) {
+static bool contextUnpin(struct smemcontext *ctx) {
+    kassert(ctx->pins > 0);
+    if (--ctx->pins > 0 || !ctx->destroy_unpinned) {
+        return False;
+    }
+    ctx->destroy_unpinned = 0;
+    return ctx->refcnt == 0 && destroySharedRegion_Internal(ctx, 0) == ERR_OK;
+}
 
-  struct pid2mem *n = NULL;
+static err_t destroySharedRegion_Internal(struct smemcontext *ctx, int forceDestroy) {
 
-  if (rmap_node_allocator == NULL) {
-    if ((rmap_node_allocator = kmem_cache_create(sizeof(struct pid2mem))) == NULL) {
-      return NULL;
+    // check if other regions are still mapped or persist
+    if (ctx->refcnt != 0 || ctx->pins != 0) {
+        return ERR_MAPPED;
+    } else if (((ctx->flag & RS_PERSIST) & ~forceDestroy)) {
+        return ERR_PERSIST;
     }
-  }
-
-  n = kmem_cache_alloc(rmap_node_allocator);
+    
+    // remove smemcontext, nobody can find it from here on
+    list_remove((Node*)&ctx->ctable_node);
 
-  return n;
+    return ERR_OK;
+}
 
+static void contextFree(struct smemcontext *ctx) {
+    shmms_free(ctx->store);
+    kmem_cache_free(ctx_allocator, ctx);
 }
 
 void addContextRef(struct smemcontext* ctx, vaddr_t start, struct addrspace* as, struct memregion* mr) {
     kassert(ctx);
     kassert(as);
-    spinlock_acquire(&ctable_lock);
+    struct ctable_bucket *b = CTABLE_BUCKET(ctx->hash);
+    spinlock_acquire(&b->lock);
 
     err_t err = createMapping_Internal(ctx->name, &start, as, ctx, mr); 
 
@@ -225,7 +466,7 @@ void addContextRef(struct smemcontext* ctx, vaddr_t start, struct addrspace* as,
       kprintf("error copying shared region: %s", ctx->name);
     }
   
-    spinlock_release(&ctable_lock);
+    spinlock_release(&b->lock);
 }
 
 static err_t createMapping_Internal(char *name, vaddr_t* start, struct addrspace* as, struct smemcontext *context, struct memregion* mr) {  // 3/6 remove pid arg at end
@@ -253,18 +494,15 @@ static err_t createMapping_Internal(char *name, vaddr_t* start, struct addrspace
     err = ERR_NOMEM;
   } else {
     // reverse mapping from pid->mr
-    struct pid2mem *node = pid2mem_alloc();
-    if (node == NULL){
+    if (rmap_add(&context->store->rmap, mr) != ERR_OK) {
       err = ERR_NOMEM;
       // mr freed in this call
       memregion_unmap(mr);
     } else {
-     // set up context node
-     node->as = as;
-     node->mr = mr;
-     list_append(&context->store->rmap.regions, (Node*)node);
      // memory region fields already assigned
      context->refcnt++;
+     // a new mapping keeps the region past the pending destroy
+     context->destroy_unpinned = 0;
      // return vaddr to user
      *start = mr->start;
  
@@ -275,90 +513,189 @@ static err_t createMapping_Internal(char *name, vaddr_t* start, struct addrspace
     return err;   
 }
 
-err_t createMapping(char* name, vaddr_t* region_beg, struct addrspace *as) {
+// Map a run of physically contiguous cache pages, each pte holds a page reference
+static err_t populateRun(struct vpmap *vpmap, vaddr_t va, paddr_t paddr, size_t n, memperm_t perm) {
+    err_t err;
+
+    if ((err = vpmap_map(vpmap, va, paddr, n, perm)) != ERR_OK) {
+        return err;
+    }
+    for (size_t i = 0; i < n; i++) {
+        struct page *pg = paddr_to_page(paddr + i * pg_size);
+        sleeplock_acquire(&pg->lock);
+        pmem_inc_refcnt(paddr + i * pg_size, 1);
+        sleeplock_release(&pg->lock);
+    }
+    return ERR_OK;
+}
+
+static void populateMapping(struct smemcontext *ctx, struct addrspace *as, vaddr_t start) {
+    struct memstore *store = ctx->store;
+    struct ctable_bucket *b = CTABLE_BUCKET(ctx->hash);
+    struct vpmap *vpmap = as->vpmap;
+    vaddr_t end = 0, run_start = start;
+    offset_t ofs = 0;
+    memperm_t perm = 0;
+    paddr_t run_paddr = PADDR_NONE;
+    size_t run_len = 0;
+    int found = 0;
+    bool dead;
+
+    // resizeRegion takes pgcache_lock before the bucket lock, so the range
+    // snapshot below stays valid until pgcache_lock is released
+    sleeplock_acquire(&store->pgcache_lock);
+    spinlock_acquire(&b->lock);
+    List *mappings = &store->rmap.regions;
+    for (Node *node = list_begin(mappings); node != list_end(mappings); node = list_next(node)) {
+        struct pid2mem *p = list_entry(node, struct pid2mem, node);
+        if (p->as == as && p->mr->start == start) {
+            end = p->mr->end;
+            ofs = p->mr->ofs;
+            perm = p->mr->perm;
+            found = 1;
+            break;
+        }
+    }
+    // drop the pin from createMapping, the mapping's reference keeps ctx
+    dead = contextUnpin(ctx);
+    spinlock_release(&b->lock);
+    if (!found) {
+        // unmapped before we got here
+        sleeplock_release(&store->pgcache_lock);
+        if (dead) {
+            contextFree(ctx);
+        }
+        return;
+    }
+
+    if (store->page_order > 0) {
+        for (vaddr_t va = start; va < end; va += huge_pg_size) {
+            struct page *pg = pgcache_get_page(store, ofs + (va - start));
+            if (pg == NULL) {
+                break;
+            }
+            paddr_t paddr = page_to_paddr(pg);
+            sleeplock_acquire(&pg->lock);
+            if (vpmap_map_huge(vpmap, va, paddr, 1, perm) == ERR_OK) {
+                pmem_inc_refcnt(paddr, 1);
+            }
+            sleeplock_release(&pg->lock);
+        }
+        sleeplock_release(&store->pgcache_lock);
+        return;
+    }
+    for (vaddr_t va = start; va < pg_round_up(end); va += pg_size) {
+        struct page *pg = pgcache_get_page(store, ofs + (va - start));
+        if (pg == NULL) {
+            // out of memory, leave the rest to handleSharedRegion
+            break;
+        }
+        paddr_t paddr = page_to_paddr(pg);
+        if (run_len > 0 && paddr != run_paddr + run_len * pg_size) {
+            if (populateRun(vpmap, run_start, run_paddr, run_len, perm) != ERR_OK) {
+                run_len = 0;
+                break;
+            }
+            run_len = 0;
+        }
+        if (run_len == 0) {
+            run_start = va;
+            run_paddr = paddr;
+        }
+        run_len++;
+    }
+    if (run_len > 0) {
+        populateRun(vpmap, run_start, run_paddr, run_len, perm);
+    }
+    sleeplock_release(&store->pgcache_lock);
+}
+
+err_t createMapping(char* name, vaddr_t* region_beg, map_flag flag, struct addrspace *as) {
 
     struct smemcontext *context;
+    uint32_t hash = ctable_hash(name);
+    struct ctable_bucket *b = CTABLE_BUCKET(hash);
+    int populate = 0;
     err_t err = ERR_OK;
 
-    spinlock_acquire(&ctable_lock);
+    spinlock_acquire(&b->lock);
 
     // context exists?
-    if (getContextByHandle(name, REG_ANY, &context, NULL) != ERR_OK) {
-      spinlock_release(&ctable_lock);
+    if (getContextByHandle(name, hash, REG_ANY, &context, NULL) != ERR_OK) {
+      spinlock_release(&b->lock);
       return ERR_NOTEXIST;
     }
 
     err = createMapping_Internal(name, region_beg, as, context, NULL);
+    if (err == ERR_OK && (flag & MAP_POPULATE)) {
+        // pin the context, another thread may unmap the new mapping meanwhile
+        contextPin(context);
+        populate = 1;
+    }
 
-    spinlock_release(&ctable_lock);
+    spinlock_release(&b->lock);
 
+    if (populate) {
+        populateMapping(context, as, *region_beg);
+    }
     return err;
 }
 
 err_t destroyMapping(char* name, vaddr_t vaddr, struct addrspace *as) {
 
     struct smemcontext *context;
+    uint32_t hash = ctable_hash(name);
+    struct ctable_bucket *b = CTABLE_BUCKET(hash);
 
-    spinlock_acquire(&ctable_lock);
+    spinlock_acquire(&b->lock);
 
-    if (getContextByHandle(name, REG_MAPPED, &context, as) != ERR_OK) {
-      spinlock_release(&ctable_lock);
+    if (getContextByHandle(name, hash, REG_MAPPED, &context, as) != ERR_OK) {
+      spinlock_release(&b->lock);
       return ERR_NOTEXIST;
     }
 
-    struct pid2mem *node;
+    struct memregion *mr;
 
-    if ((node = find_remove_rmapping(context, as, vaddr)) != NULL) {
-	struct memregion *mr = node->mr;
-	pid2mem_free(node);
-	spinlock_release(&ctable_lock);
+    if ((mr = rmap_remove(&context->store->rmap, as, vaddr)) != NULL) {
+	spinlock_release(&b->lock);
 	// handles biz
 	return destroyMapping_Internal(context, mr, 0);
     }
     // no region found
-    spinlock_release(&ctable_lock);
+    spinlock_release(&b->lock);
 
     return ERR_NOTEXIST;
 }
 
-static struct pid2mem* find_remove_rmapping(struct smemcontext *context, struct addrspace *as, vaddr_t vaddr) {
-
-   // loop inv: for every node, n, seen, n->pid != proc_current.pid
-   for (Node *n = list_begin(&context->store->rmap.regions);
-               n != list_end(&context->store->rmap.regions);
-               n = list_next(n)) {
-
-      struct pid2mem *node = list_entry(n, struct pid2mem, node);
-
-      if (node->as == as) {
-        if (vaddr >= node->mr->start && vaddr < node->mr->end) {
-          list_remove(n);
-	      return node;
-        }
-      }
-   }
-
-   // not found
-   return NULL;
-}
-
 static err_t destroyMapping_Internal(struct smemcontext* ctx, struct memregion *mr, int forceDestroy) {
     err_t err = ERR_OK;
+    int dead = 0;
 
     kassert(ctx);
 
+    struct ctable_bucket *b = CTABLE_BUCKET(ctx->hash);
+
     // call frees mr struct 
     memregion_unmap(mr);
 
-    spinlock_acquire(&ctable_lock);
+    spinlock_acquire(&b->lock);
     ctx->refcnt--;
 
     // if no other references and !persist
     if (ctx->refcnt == 0 && !(ctx->flag & RS_PERSIST) && forceDestroy) {
-      err = destroySharedRegion_Internal(ctx, 0);
+      if (ctx->pins > 0) {
+        // the last unpin destroys it
+        ctx->destroy_unpinned = 1;
+      } else {
+        err = destroySharedRegion_Internal(ctx, 0);
+        dead = err == ERR_OK;
+      }
     }
 
-    spinlock_release(&ctable_lock);
+    spinlock_release(&b->lock);
+    if (dead) {
+      contextFree(ctx);
+    }
     return err;
 }
 
@@ -367,57 +704,134 @@ void unmapAll(struct memregion *r) {
 
     kassert(r->store);
     kassert(r->store->info);
-    struct pid2mem *node;
-
-    if ((node = find_remove_rmapping(r->store->info, r->as, r->start)) != NULL) {
-      // have ref to region, can destroy node
-      pid2mem_free(node);
-  
-      // calls method which needs lock, silly
-      struct addrspace *as = r->as;
-      spinlock_release(&as->as_lock);
-      destroyMapping_Internal(r->store->info, r, 1);
-      spinlock_acquire(&as->as_lock);
+    struct smemcontext *ctx = r->store->info;
+    struct ctable_bucket *b = CTABLE_BUCKET(ctx->hash);
+    struct addrspace *as = r->as;
+    struct memregion *mr;
+
+    // bucket lock is taken before as_lock everywhere else, drop as_lock first
+    spinlock_release(&as->as_lock);
+    spinlock_acquire(&b->lock);
+    mr = rmap_remove(&ctx->store->rmap, as, r->start);
+    spinlock_release(&b->lock);
+
+    if (mr != NULL) {
+      destroyMapping_Internal(ctx, r, 1);
     }
+    spinlock_acquire(&as->as_lock);
 }
 
 
 err_t lockRegion(char* name, struct addrspace *as) { 
     struct smemcontext* ctx;
-    spinlock_acquire(&ctable_lock);
+    uint32_t hash = ctable_hash(name);
+    struct ctable_bucket *b = CTABLE_BUCKET(hash);
+    spinlock_acquire(&b->lock);
 
-    if (getContextByHandle(name, REG_MAPPED, &ctx, as) != ERR_OK) {
-        spinlock_release(&ctable_lock);
+    if (getContextByHandle(name, hash, REG_MAPPED, &ctx, as) != ERR_OK) {
+        spinlock_release(&b->lock);
         return ERR_NOTEXIST;
     }
     tid_t t = thread_current()->tid;
     while (ctx->lock_by != t && ctx->lock_by != -1) {
-        condvar_wait(&wait_cv, &ctable_lock);
+        condvar_wait(&ctx->lock_cv, &b->lock);
     }
     ctx->lock_by = t;
-    spinlock_release(&ctable_lock);
+    spinlock_release(&b->lock);
     return ERR_OK;
 }
 
 err_t unlockRegion(char* name, struct addrspace *as) {
     struct smemcontext* ctx;
-    spinlock_acquire(&ctable_lock);
+    uint32_t hash = ctable_hash(name);
+    struct ctable_bucket *b = CTABLE_BUCKET(hash);
+    spinlock_acquire(&b->lock);
 
-    if (getContextByHandle(name, REG_MAPPED, &ctx, as) != ERR_OK) {
-        spinlock_release(&ctable_lock);
+    if (getContextByHandle(name, hash, REG_MAPPED, &ctx, as) != ERR_OK) {
+        spinlock_release(&b->lock);
         return ERR_NOTEXIST;
     }
     tid_t t = thread_current()->tid;
     if (ctx->lock_by != t) {
-        spinlock_release(&ctable_lock);
+        spinlock_release(&b->lock);
         return ERR_INVAL;
     }
     ctx->lock_by = -1;
-    condvar_signal(&wait_cv);
-    spinlock_release(&ctable_lock);
+    // every waiter on lock_cv wants this region, handing it to one is enough
+    condvar_signal(&ctx->lock_cv);
+    spinlock_release(&b->lock);
     return ERR_OK;
 }
 
+err_t waitRegion(vaddr_t addr, int val, struct addrspace *as) {
+    struct smemcontext* ctx;
+    struct ctable_bucket *b;
+    struct futex_waiter w;
+    offset_t ofs;
+    paddr_t paddr;
+    err_t err;
+
+    if ((err = getContextByAddr(addr, as, &ctx, &ofs)) != ERR_OK) {
+        return err;
+    }
+    b = CTABLE_BUCKET(ctx->hash);
+
+    // Can't take a page fault holding the bucket lock: fault the word in first,
+    // then read it through kmap so the compare and enqueue are atomic with
+    // respect to wakeRegion.
+    for (;;) {
+        (void)*(volatile int*)addr;
+        spinlock_acquire(&b->lock);
+        if (vpmap_lookup_vaddr(as->vpmap, addr, &paddr, NULL) == ERR_OK) {
+            break;
+        }
+        spinlock_release(&b->lock);
+    }
+    if (*(volatile int*)kmap_p2v(paddr) != val) {
+        spinlock_release(&b->lock);
+        return ERR_INCOMP;
+    }
+
+    w.ofs = ofs;
+    w.woken = False;
+    condvar_init(&w.cv);
+    list_append(&ctx->futex_waiters, &w.node);
+    while (!w.woken) {
+        condvar_wait(&w.cv, &b->lock);
+    }
+    spinlock_release(&b->lock);
+    return ERR_OK;
+}
+
+int wakeRegion(vaddr_t addr, int n, struct addrspace *as) {
+    struct smemcontext* ctx;
+    struct ctable_bucket *b;
+    offset_t ofs;
+    err_t err;
+    int woken = 0;
+
+    if ((err = getContextByAddr(addr, as, &ctx, &ofs)) != ERR_OK) {
+        return err;
+    }
+    b = CTABLE_BUCKET(ctx->hash);
+
+    spinlock_acquire(&b->lock);
+    for (Node *node = list_begin(&ctx->futex_waiters);
+                node != list_end(&ctx->futex_waiters) && woken < n;) {
+        struct futex_waiter *w = list_entry(node, struct futex_waiter, node);
+        if (w->ofs != ofs) {
+            node = list_next(node);
+            continue;
+        }
+        node = list_remove(node);
+        w->woken = True;
+        condvar_signal(&w->cv);
+        woken++;
+    }
+    spinlock_release(&b->lock);
+    return woken;
+}
+
 /*
  * shared memory memstore fillpage function.
  */
@@ -436,15 +850,15 @@ fillpage(struct memstore *store, offset_t ofs, struct page *page)
     kassert(store);
     kassert(page);
 
-    memset((void*)kmap_p2v(page_to_paddr(page)), 0, pg_size);
+    memset((void*)kmap_p2v(page_to_paddr(page)), 0, pg_size << store->page_order);
     return ERR_OK;
 }
 
 static err_t
 write(struct memstore *store, paddr_t paddr, offset_t ofs)
 {
-    // TODO - do we still want this?
-    return ERR_OK;
+    // nowhere to put anonymous memory without swap, keep dirty pages cached
+    return ERR_MEMSTORE_NORES;
 }
 
 struct memstore*
@@ -13,12 +13,14 @@
 #include <kernel/pmem.h>
 #include <lib/errcode.h>
 #include <kernel/shmms.h>
+#include <kernel/pgcache.h>
 
 int kernel_init(void *args);
 
 int
 kernel_init(void *args)
 {
+    pgcache_init();
     bdev_init();
     fs_init();
     mp_start_ap();
@@ -35,6 +37,8 @@ main(void)
 {
     vm_init();
     arch_init();
+    pmem_pcp_init();
+    kmalloc_cpu_init();
 
     // thread needs to be initialized before other sub systems can use locks
     thread_sys_init();
@@ -3,6 +3,7 @@
 #include <kernel/vpmap.h>
 #include <kernel/console.h>
 #include <kernel/util.h>
+#include <kernel/trap.h>
 #include <lib/string.h>
 #include <lib/errcode.h>
 #include <lib/stddef.h>
@@ -12,6 +13,15 @@
  * allocator dynamically allocates slabs to store fixed-size objects.
  * Each slab is divided into object-sized slots, and a linked list is used to
  * track free slots. The linked list is stored in the beginning of the slab.
+ *
+ * In front of the slabs, each CPU keeps two magazines of free objects per
+ * object allocator. kmem_cache_alloc and kmem_cache_free only go to the slabs
+ * when both are empty (full) and the depot has no full (empty) magazine to
+ * exchange them with.
+ *
+ * Slabs with no object out are kept on their own list and only used once the
+ * partially allocated ones are full. kmem_cache_reclaim, run by kswapd when
+ * memory is low and periodically, gives all but a few of them back to pmem.
  */
 
 /*
@@ -19,25 +29,58 @@
  */
 static struct kmem_cache allocator_cache;
 
+/*
+ * Allocator for magazines, it doesn't use magazines itself
+ */
+static struct kmem_cache magazine_cache;
+
+// Set once kmem_cache_alloc and kmem_cache_free go through magazines
+static bool mags_enabled;
+
+/*
+ * All object allocators, for statistics
+ */
+static List caches;
+static struct spinlock caches_lock;
+
 /*
  * kmalloc allocators
  */
 struct kmalloc_allocator {
     struct kmem_cache *kmem_cache;
     size_t size;
+    const char *name;
 };
 static struct kmalloc_allocator kmalloc_allocators[] =
 {
-    { NULL, 32 },
-    { NULL, 64 },
-    { NULL, 128 },
-    { NULL, 256 },
-    { NULL, 512 },
-    { NULL, 1024 },
-    { NULL, 2048 },
-    { NULL, 4096 }
+    { NULL, 32, "kmalloc-32" },
+    { NULL, 48, "kmalloc-48" },
+    { NULL, 64, "kmalloc-64" },
+    { NULL, 96, "kmalloc-96" },
+    { NULL, 128, "kmalloc-128" },
+    { NULL, 192, "kmalloc-192" },
+    { NULL, 256, "kmalloc-256" },
+    { NULL, 384, "kmalloc-384" },
+    { NULL, 512, "kmalloc-512" },
+    { NULL, 768, "kmalloc-768" },
+    { NULL, 1024, "kmalloc-1024" },
+    { NULL, 1536, "kmalloc-1536" },
+    { NULL, 2048, "kmalloc-2048" },
+    { NULL, 3072, "kmalloc-3072" },
+    { NULL, 4096, "kmalloc-4096" }
 };
 
+/*
+ * Allocations larger than the largest kmalloc allocator take a page aligned
+ * block of 2^order pages straight from pmem. The buddy allocator records the
+ * block's order in the first page's struct page, which is all kfree needs.
+ */
+/*
+ * Allocate / free memory on the large allocation path.
+ */
+static void *kmalloc_large_alloc(size_t size);
+static void kmalloc_large_free(void *ptr);
+
 /*
  * Create a new slab for an object allocator. The slab should fit at least
  * MIN_OBJS_PER_SLAB objects.
@@ -60,6 +103,37 @@ static void slab_destroy(struct slab *slab);
  */
 static void slab_list_destroy(List *list);
 
+/*
+ * Initialize an object allocator.
+ */
+static void kmem_cache_init(struct kmem_cache *kmem_cache, const char *name, size_t size, bool use_mags);
+
+/*
+ * Allocate an object from / free an object to the slabs of an allocator.
+ */
+static void *slab_alloc_obj(struct kmem_cache *kmem_cache);
+static void slab_free_obj(struct kmem_cache *kmem_cache, void *obj);
+
+/*
+ * Put an object back in its slab.
+ *
+ * Precondition:
+ * Caller must hold kmem_cache->lock.
+ */
+static void slab_put_obj(struct kmem_cache *kmem_cache, void *obj);
+
+/*
+ * Allocate an object from / free an object to the current CPU's magazines.
+ * Return NULL (False) if that takes a trip to the slabs.
+ */
+static void *mag_alloc(struct kmem_cache *kmem_cache);
+static bool mag_free(struct kmem_cache *kmem_cache, void *obj);
+
+/*
+ * Free every magazine in the list.
+ */
+static void mag_list_destroy(List *list);
+
 static struct slab*
 slab_create(struct kmem_cache *kmem_cache)
 {
@@ -88,6 +162,8 @@ slab_create(struct kmem_cache *kmem_cache)
     slab->objs = &SLAB_FREEARR(slab)[n_objs]; // objects placed after free index array
     slab->free = 0;
     slab->n_pages = n_pages;
+    slab->n_objs = n_objs;
+    slab->in_use = 0;
 
     // Link allocator and slab into each allocated page's page structure. The
     // purpose is for easy lookup during free.
@@ -105,7 +181,8 @@ slab_create(struct kmem_cache *kmem_cache)
     SLAB_FREEARR(slab)[n_objs - 1] = -1; // end marker
 
     // Add slab to the allocator
-    list_append(&kmem_cache->free, &slab->node);
+    list_append(&kmem_cache->empty, &slab->node);
+    kmem_cache->n_empty++;
 
     return slab;
 }
@@ -131,27 +208,56 @@ slab_list_destroy(List *list)
     }
 }
 
+static void
+kmem_cache_init(struct kmem_cache *kmem_cache, const char *name, size_t size, bool use_mags)
+{
+    list_init(&kmem_cache->full);
+    list_init(&kmem_cache->free);
+    list_init(&kmem_cache->empty);
+    kmem_cache->n_empty = 0;
+    spinlock_init(&kmem_cache->lock, False);
+    kmem_cache->obj_size = size;
+    kmem_cache->name = name;
+    kmem_cache->slab_allocs = kmem_cache->slab_frees = 0;
+    kmem_cache->out = kmem_cache->peak = 0;
+    list_init(&kmem_cache->full_mags);
+    list_init(&kmem_cache->empty_mags);
+    kmem_cache->use_mags = use_mags;
+    memset(kmem_cache->cpu, 0, sizeof(kmem_cache->cpu));
+
+    spinlock_acquire(&caches_lock);
+    list_append(&caches, &kmem_cache->cache_node);
+    spinlock_release(&caches_lock);
+}
+
 void
 kmalloc_init(void)
 {
     struct kmalloc_allocator *ka;
 
+    list_init(&caches);
+    spinlock_init(&caches_lock, False);
+
     // Initialize allocator cache
-    list_init(&allocator_cache.full);
-    list_init(&allocator_cache.free);
-    spinlock_init(&allocator_cache.lock, False);
-    allocator_cache.obj_size = sizeof(struct kmem_cache);
+    kmem_cache_init(&allocator_cache, "kmem_cache", sizeof(struct kmem_cache), True);
+    kmem_cache_init(&magazine_cache, "magazine", sizeof(struct magazine), False);
 
     // Initialize kmalloc allocators
     for (ka = kmalloc_allocators; ka < &kmalloc_allocators[N_ELEM(kmalloc_allocators)]; ka++) {
-        if ((ka->kmem_cache = kmem_cache_create(ka->size)) == NULL) {
+        if ((ka->kmem_cache = kmem_cache_create(ka->name, ka->size)) == NULL) {
             panic("Failed to allocate kmalloc allocator");
         }
     }
 }
 
+void
+kmalloc_cpu_init(void)
+{
+    mags_enabled = True;
+}
+
 struct kmem_cache*
-kmem_cache_create(size_t size)
+kmem_cache_create(const char *name, size_t size)
 {
     struct kmem_cache *kmem_cache;
 
@@ -159,10 +265,7 @@ kmem_cache_create(size_t size)
         return NULL;
     }
 
-    list_init(&kmem_cache->full);
-    list_init(&kmem_cache->free);
-    spinlock_init(&kmem_cache->lock, False);
-    kmem_cache->obj_size = size;
+    kmem_cache_init(kmem_cache, name, size, True);
 
     return kmem_cache;
 }
@@ -172,9 +275,26 @@ kmem_cache_destroy(struct kmem_cache *kmem_cache)
 {
     kassert(kmem_cache);
 
+    spinlock_acquire(&caches_lock);
+    list_remove(&kmem_cache->cache_node);
+    spinlock_release(&caches_lock);
+
+    // Objects in magazines live in the slabs, only the magazines need freeing
+    for (int i = 0; i < MAX_NCPU; i++) {
+        if (kmem_cache->cpu[i].loaded != NULL) {
+            kmem_cache_free(&magazine_cache, kmem_cache->cpu[i].loaded);
+        }
+        if (kmem_cache->cpu[i].prev != NULL) {
+            kmem_cache_free(&magazine_cache, kmem_cache->cpu[i].prev);
+        }
+    }
+    mag_list_destroy(&kmem_cache->full_mags);
+    mag_list_destroy(&kmem_cache->empty_mags);
+
     // Destroy all slabs
     slab_list_destroy(&kmem_cache->free);
     slab_list_destroy(&kmem_cache->full);
+    slab_list_destroy(&kmem_cache->empty);
 
     // Free the object allocator
     kmem_cache_free(&allocator_cache, kmem_cache);
@@ -183,18 +303,213 @@ kmem_cache_destroy(struct kmem_cache *kmem_cache)
 void*
 kmem_cache_alloc(struct kmem_cache *kmem_cache)
 {
-    struct slab *slab;
     void *obj;
 
     kassert(kmem_cache);
 
+    if ((obj = mag_alloc(kmem_cache)) == NULL && (obj = slab_alloc_obj(kmem_cache)) == NULL) {
+        return NULL;
+    }
+    memset(obj, 0x2b, kmem_cache->obj_size);
+    return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kmem_cache, void *obj)
+{
+    kassert(kmem_cache);
+
+    // memset freed object to 0x2b to detect uses of freed memory
+    memset(obj, 0x2b, kmem_cache->obj_size);
+    if (!mag_free(kmem_cache, obj)) {
+        slab_free_obj(kmem_cache, obj);
+    }
+}
+
+void
+kmem_cache_get_stats(struct kmem_cache *kmem_cache, struct kmem_cache_stats *stats)
+{
+    struct kmem_cpu_cache *cc;
+    struct slab *slab;
+    Node *n;
+
+    kassert(kmem_cache);
+    kassert(stats);
+    memset(stats, 0, sizeof(*stats));
+    stats->name = kmem_cache->name;
+    stats->obj_size = kmem_cache->obj_size;
+    // racy reads of the other CPUs' counters are fine for statistics
+    for (cc = kmem_cache->cpu; cc < &kmem_cache->cpu[MAX_NCPU]; cc++) {
+        stats->alloc_hits += cc->alloc_hits;
+        stats->alloc_misses += cc->alloc_misses;
+        stats->free_hits += cc->free_hits;
+        stats->free_misses += cc->free_misses;
+    }
+
+    spinlock_acquire(&kmem_cache->lock);
+    stats->allocs = stats->alloc_hits + kmem_cache->slab_allocs;
+    stats->frees = stats->free_hits + kmem_cache->slab_frees;
+    stats->peak = kmem_cache->peak;
+    for (n = list_begin(&kmem_cache->full); n != list_end(&kmem_cache->full); n = list_next(n)) {
+        slab = list_entry(n, struct slab, node);
+        stats->slabs_full++;
+        stats->total += slab->n_objs;
+        stats->pages += slab->n_pages;
+    }
+    for (n = list_begin(&kmem_cache->free); n != list_end(&kmem_cache->free); n = list_next(n)) {
+        slab = list_entry(n, struct slab, node);
+        stats->slabs_partial++;
+        stats->total += slab->n_objs;
+        stats->pages += slab->n_pages;
+    }
+    for (n = list_begin(&kmem_cache->empty); n != list_end(&kmem_cache->empty); n = list_next(n)) {
+        slab = list_entry(n, struct slab, node);
+        stats->slabs_free++;
+        stats->total += slab->n_objs;
+        stats->pages += slab->n_pages;
+    }
+    spinlock_release(&kmem_cache->lock);
+    // counters of other CPUs may lag behind
+    stats->in_use = stats->allocs > stats->frees ? stats->allocs - stats->frees : 0;
+}
+
+size_t
+kmem_cache_get_all_stats(struct kmem_cache_stats *stats, size_t n)
+{
+    Node *node;
+    size_t i = 0;
+
+    spinlock_acquire(&caches_lock);
+    for (node = list_begin(&caches); node != list_end(&caches); node = list_next(node), i++) {
+        if (i < n) {
+            kmem_cache_get_stats(list_entry(node, struct kmem_cache, cache_node), &stats[i]);
+        }
+    }
+    spinlock_release(&caches_lock);
+    return i;
+}
+
+static void*
+mag_alloc(struct kmem_cache *kmem_cache)
+{
+    struct kmem_cpu_cache *cc;
+    struct magazine *mag;
+    void *obj = NULL;
+
+    if (!mags_enabled || !kmem_cache->use_mags) {
+        return NULL;
+    }
+    intr_set_level(INTR_OFF);
+    cc = &kmem_cache->cpu[mycpu() - x86_64_cpus];
+    if (cc->loaded == NULL || cc->loaded->rounds == 0) {
+        if (cc->prev != NULL && cc->prev->rounds > 0) {
+            mag = cc->loaded;
+            cc->loaded = cc->prev;
+            cc->prev = mag;
+        } else {
+            // trade the empty previous magazine for a full one from the depot
+            spinlock_acquire(&kmem_cache->lock);
+            if (!list_empty(&kmem_cache->full_mags)) {
+                mag = list_entry(list_begin(&kmem_cache->full_mags), struct magazine, node);
+                list_remove(&mag->node);
+                if (cc->prev != NULL) {
+                    list_append(&kmem_cache->empty_mags, &cc->prev->node);
+                }
+                cc->prev = cc->loaded;
+                cc->loaded = mag;
+            }
+            spinlock_release(&kmem_cache->lock);
+        }
+    }
+    if (cc->loaded != NULL && cc->loaded->rounds > 0) {
+        obj = cc->loaded->objs[--cc->loaded->rounds];
+        cc->alloc_hits++;
+    } else {
+        cc->alloc_misses++;
+    }
+    intr_set_level(INTR_ON);
+    return obj;
+}
+
+static bool
+mag_free(struct kmem_cache *kmem_cache, void *obj)
+{
+    struct kmem_cpu_cache *cc;
+    struct magazine *mag;
+    bool ret = False;
+
+    if (!mags_enabled || !kmem_cache->use_mags) {
+        return False;
+    }
+    intr_set_level(INTR_OFF);
+    cc = &kmem_cache->cpu[mycpu() - x86_64_cpus];
+    if (cc->loaded == NULL || cc->loaded->rounds == MAGAZINE_SIZE) {
+        if (cc->prev != NULL && cc->prev->rounds < MAGAZINE_SIZE) {
+            mag = cc->loaded;
+            cc->loaded = cc->prev;
+            cc->prev = mag;
+        } else {
+            // trade the full previous magazine for an empty one from the depot
+            spinlock_acquire(&kmem_cache->lock);
+            if (!list_empty(&kmem_cache->empty_mags)) {
+                mag = list_entry(list_begin(&kmem_cache->empty_mags), struct magazine, node);
+                list_remove(&mag->node);
+            } else if ((mag = kmem_cache_alloc(&magazine_cache)) != NULL) {
+                mag->rounds = 0;
+            }
+            if (mag != NULL) {
+                if (cc->prev != NULL) {
+                    list_append(&kmem_cache->full_mags, &cc->prev->node);
+                }
+                cc->prev = cc->loaded;
+                cc->loaded = mag;
+            }
+            spinlock_release(&kmem_cache->lock);
+        }
+    }
+    if (cc->loaded != NULL && cc->loaded->rounds < MAGAZINE_SIZE) {
+        cc->loaded->objs[cc->loaded->rounds++] = obj;
+        cc->free_hits++;
+        ret = True;
+    } else {
+        cc->free_misses++;
+    }
+    intr_set_level(INTR_ON);
+    return ret;
+}
+
+static void
+mag_list_destroy(List *list)
+{
+    Node *curr, *next;
+
+    kassert(list);
+    curr = list_begin(list);
+    while (curr != list_end(list)) {
+        next = list_remove(curr);
+        kmem_cache_free(&magazine_cache, list_entry(curr, struct magazine, node));
+        curr = next;
+    }
+}
+
+static void*
+slab_alloc_obj(struct kmem_cache *kmem_cache)
+{
+    struct slab *slab;
+    void *obj;
+
     spinlock_acquire(&kmem_cache->lock);
-    // Find a slab that still have free slots. Allocate a new slab if no free
+    // Find a slab that still have free slots, preferring partially allocated
+    // ones so that empty slabs stay empty. Allocate a new slab if no free
     // slab is found.
     if (list_empty(&kmem_cache->free)) {
-        if ((slab = slab_create(kmem_cache)) == NULL) {
+        if (list_empty(&kmem_cache->empty) && slab_create(kmem_cache) == NULL) {
             goto fail;
         }
+        slab = list_entry(list_begin(&kmem_cache->empty), struct slab, node);
+        list_remove(&slab->node);
+        list_append(&kmem_cache->free, &slab->node);
+        kmem_cache->n_empty--;
     } else {
         slab = list_entry(list_begin(&kmem_cache->free), struct slab, node);
     }
@@ -204,6 +519,11 @@ kmem_cache_alloc(struct kmem_cache *kmem_cache)
     kassert(slab->free != -1);
     obj = (void*)((vaddr_t)slab->objs + kmem_cache->obj_size * slab->free);
     slab->free = SLAB_FREEARR(slab)[slab->free];
+    slab->in_use++;
+    kmem_cache->slab_allocs++;
+    if (++kmem_cache->out > kmem_cache->peak) {
+        kmem_cache->peak = kmem_cache->out;
+    }
 
     if (slab->free == -1) {
         // slab is full
@@ -211,7 +531,6 @@ kmem_cache_alloc(struct kmem_cache *kmem_cache)
         list_append(&kmem_cache->full, &slab->node);
     }
     spinlock_release(&kmem_cache->lock);
-    memset(obj, 0x2b, kmem_cache->obj_size);
     return obj;
 
 fail:
@@ -219,19 +538,23 @@ fail:
     return NULL;
 }
 
-void
-kmem_cache_free(struct kmem_cache *kmem_cache, void *obj)
+static void
+slab_free_obj(struct kmem_cache *kmem_cache, void *obj)
+{
+    spinlock_acquire(&kmem_cache->lock);
+    slab_put_obj(kmem_cache, obj);
+    kmem_cache->slab_frees++;
+    spinlock_release(&kmem_cache->lock);
+}
+
+static void
+slab_put_obj(struct kmem_cache *kmem_cache, void *obj)
 {
     struct slab *slab;
     struct page *page;
     paddr_t paddr;
     int index, full;
 
-    kassert(kmem_cache);
-
-    spinlock_acquire(&kmem_cache->lock);
-    // memset freed object to 0x2b to detect uses of freed memory
-    memset(obj, 0x2b, kmem_cache->obj_size);
     // Find the slab the object belongs to
     paddr = kmap_v2p((vaddr_t)obj);
     page = paddr_to_page(paddr);
@@ -244,13 +567,78 @@ kmem_cache_free(struct kmem_cache *kmem_cache, void *obj)
     index = ((vaddr_t)obj - (vaddr_t)slab->objs) / kmem_cache->obj_size;
     SLAB_FREEARR(slab)[index] = slab->free;
     slab->free = index;
+    slab->in_use--;
+    kmem_cache->out--;
 
-    // If slab was full, move it to the free slabs list
-    if (full) {
+    // If slab was full, move it to the free slabs list, if it has no object
+    // out anymore, to the empty slabs list
+    if (slab->in_use == 0) {
+        list_remove(&slab->node);
+        list_append(&kmem_cache->empty, &slab->node);
+        kmem_cache->n_empty++;
+    } else if (full) {
         list_remove(&slab->node);
         list_append(&kmem_cache->free, &slab->node);
     }
+}
+
+size_t
+kmem_cache_reclaim(struct kmem_cache *kmem_cache)
+{
+    List mags, slabs;
+    struct magazine *mag;
+    struct slab *slab;
+    size_t pages = 0;
+    int i;
+
+    kassert(kmem_cache);
+    list_init(&mags);
+    list_init(&slabs);
+
+    spinlock_acquire(&kmem_cache->lock);
+    // Flush the depot: objects in full magazines go back to their slabs, and
+    // the magazines are freed once the lock is dropped
+    while (!list_empty(&kmem_cache->full_mags)) {
+        mag = list_entry(list_begin(&kmem_cache->full_mags), struct magazine, node);
+        list_remove(&mag->node);
+        for (i = 0; i < mag->rounds; i++) {
+            slab_put_obj(kmem_cache, mag->objs[i]);
+        }
+        list_append(&mags, &mag->node);
+    }
+    while (!list_empty(&kmem_cache->empty_mags)) {
+        mag = list_entry(list_begin(&kmem_cache->empty_mags), struct magazine, node);
+        list_remove(&mag->node);
+        list_append(&mags, &mag->node);
+    }
+
+    // Keep the most recently emptied slabs
+    while (kmem_cache->n_empty > SLAB_EMPTY_KEEP) {
+        slab = list_entry(list_begin(&kmem_cache->empty), struct slab, node);
+        list_remove(&slab->node);
+        list_append(&slabs, &slab->node);
+        kmem_cache->n_empty--;
+        pages += slab->n_pages;
+    }
     spinlock_release(&kmem_cache->lock);
+
+    mag_list_destroy(&mags);
+    slab_list_destroy(&slabs);
+    return pages;
+}
+
+size_t
+kmem_reclaim(void)
+{
+    Node *n;
+    size_t pages = 0;
+
+    spinlock_acquire(&caches_lock);
+    for (n = list_begin(&caches); n != list_end(&caches); n = list_next(n)) {
+        pages += kmem_cache_reclaim(list_entry(n, struct kmem_cache, cache_node));
+    }
+    spinlock_release(&caches_lock);
+    return pages;
 }
 
 void*
@@ -263,8 +651,8 @@ kmalloc(size_t size)
     }
 
     if (size > kmalloc_allocators[N_ELEM(kmalloc_allocators) - 1].size) {
-        // We don't have an allocator capable of allocating ``size`` bytes
-        return NULL;
+        // No object allocator is big enough, go to pmem
+        return kmalloc_large_alloc(size);
     }
 
     // Find kmalloc allocator with a big enough size
@@ -288,8 +676,42 @@ kfree(void *ptr)
     paddr = kmap_v2p((vaddr_t)ptr);
     page = paddr_to_page(paddr);
     kassert(page);
-    kmem_cache = page->kmem_cache;
-    kassert(kmem_cache);
+    // pages of large allocations belong to no allocator
+    if ((kmem_cache = page->kmem_cache) == NULL) {
+        kmalloc_large_free(ptr);
+        return;
+    }
 
     kmem_cache_free(kmem_cache, ptr);
 }
+
+static void*
+kmalloc_large_alloc(size_t size)
+{
+    paddr_t paddr;
+    size_t n_pages, order;
+
+    n_pages = pg_round_up(size) / pg_size;
+    for (order = 0; ((size_t)1 << order) < n_pages; order++) {
+        if (order == PMEM_MAX_ORDER) {
+            return NULL;
+        }
+    }
+    if (pmem_nalloc(&paddr, (size_t)1 << order) != ERR_OK) {
+        return NULL;
+    }
+    return (void*)kmap_p2v(paddr);
+}
+
+static void
+kmalloc_large_free(void *ptr)
+{
+    paddr_t paddr;
+    struct page *page;
+
+    kassert(pg_ofs((vaddr_t)ptr) == 0);
+    paddr = kmap_v2p((vaddr_t)ptr);
+    page = paddr_to_page(paddr);
+    kassert(page->order > 0 && page->order <= PMEM_MAX_ORDER);
+    pmem_nfree(paddr, (size_t)1 << page->order);
+}
@@ -1,4 +1,5 @@
 #include <kernel/memstore.h>
+#include <kernel/pgcache.h>
 #include <kernel/kmalloc.h>
 #include <kernel/console.h>
 #include <lib/string.h>
@@ -12,7 +13,7 @@ memstore_alloc(void)
     struct memstore *store;
 
     if (memstore_allocator == NULL) {
-        if ((memstore_allocator = kmem_cache_create(sizeof(struct memstore))) == NULL) {
+        if ((memstore_allocator = kmem_cache_create("memstore", sizeof(struct memstore))) == NULL) {
             return NULL;
         }
     }
@@ -20,6 +21,8 @@ memstore_alloc(void)
         rmap_construct(&store->rmap);
         sleeplock_init(&store->pgcache_lock);
         radix_tree_construct(&store->cached_pages);
+        store->fault_around = MEMSTORE_FAULT_AROUND;
+        store->page_order = 0;
     }
     return store;
 }
@@ -30,6 +33,15 @@ void
 memstore_free(struct memstore *store)
 {
     kassert(store);
+    pgcache_remove_all(store);
     rmap_destroy(&store->rmap);
     kmem_cache_free(memstore_allocator, store);
 }
+
+void
+memstore_set_fault_around(struct memstore *store, size_t n)
+{
+    kassert(store);
+    kassert(n > 0 && (n & (n - 1)) == 0);
+    store->fault_around = n;
+}
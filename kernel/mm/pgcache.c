@@ -5,43 +5,560 @@
 #include <kernel/radix_tree.h>
 #include <kernel/memstore.h>
 #include <kernel/pmem.h>
+#include <kernel/rmap.h>
+#include <kernel/thread.h>
+#include <kernel/vpmap.h>
+#include <kernel/timer.h>
 #include <lib/errcode.h>
+#include <lib/bits.h>
+#include <lib/string.h>
+
+/*
+ * Cached pages of every memstore sit on one of two global LRU lists, oldest
+ * first. New pages start on the inactive list. A page referenced again once
+ * cached, either by a cache lookup or through the accessed bit of one of its
+ * mappings, is promoted to the active list when reclaim reaches it. Reclaim
+ * first ages the active list down to the size of the inactive one, then
+ * evicts from the inactive list: dirty pages are written through store->write
+ * before being dropped.
+ *
+ * kswapd also compacts physical memory when a multi-page allocation fails:
+ * cached pages are movable, a page is copied to a new page that replaces it
+ * in its store's radix tree and on the LRU, after its mappings are removed.
+ *
+ * Empty slabs of the object allocators are cheaper to give back than cached
+ * pages: kswapd reclaims them first when memory is low, and periodically.
+ */
+struct lru_list {
+    List pages;
+    size_t len;
+};
+static struct lru_list active, inactive;
+// protects both lists and page->lru_state, taken after store->pgcache_lock
+static struct spinlock lru_lock;
+
+// pages taken out of a store's radix tree at a time
+#define PGCACHE_BATCH 16
+
+// page->lru_state bits
+#define LRU_ACTIVE 0        // on the active list, inactive list otherwise
+#define LRU_REFERENCED 1    // looked up once since it was last aged
+
+// kswapd sleeps on kswapd_cv until pmem reports free memory low
+static struct spinlock kswapd_lock;
+static struct condvar kswapd_cv;
+static struct thread *kswapd_thread;
+// set by the timer every PGCACHE_SLAB_TICKS, protected by kswapd_lock
+static bool kswapd_slab_tick;
+
+// Result of trying to evict one inactive page
+typedef enum {
+    EVICT_FREED,
+    EVICT_KEPT,
+    EVICT_ACTIVATE
+} evict_t;
+
+/*
+ * Move page to the tail of list, updating its active bit.
+ *
+ * Precondition:
+ * Caller must hold lru_lock.
+ */
+static void lru_move(struct page *page, struct lru_list *list);
+
+/*
+ * Note a cache lookup of page.
+ */
+static void lru_mark_accessed(struct page *page);
+
+/*
+ * Move up to n of the oldest active pages to the inactive list.
+ *
+ * Precondition:
+ * Caller must hold lru_lock.
+ */
+static void lru_age_active(size_t n);
+
+/*
+ * Try to drop an inactive page from the cache, writing it back first if dirty.
+ *
+ * Precondition:
+ * Caller must hold store->pgcache_lock.
+ */
+static evict_t pgcache_evict(struct memstore *store, struct page *page);
+
+/*
+ * Move a cached page to the page at to, which the cache then owns. to is
+ * left untouched on failure. page may not be cached anymore, or not even
+ * allocated.
+ *
+ * Return:
+ * ERR_OK - page is no longer cached, and will be freed once unpinned.
+ * ERR_LOCK_BUSY - page is in use and couldn't be moved.
+ */
+static err_t pgcache_migrate(struct page *page, paddr_t to);
+
+/*
+ * Wake kswapd, pmem calls this when free memory drops below PGCACHE_FREE_LOW
+ * or a multi-page allocation fails.
+ */
+static void kswapd_wake(void);
+
+/*
+ * Wake kswapd to reclaim slabs, the timer calls this every PGCACHE_SLAB_TICKS.
+ */
+static void kswapd_tick(void);
+
+/*
+ * Kernel thread reclaiming page cache pages once free memory drops below
+ * PGCACHE_FREE_LOW, until it is back to PGCACHE_FREE_HIGH, and compacting
+ * memory for failed multi-page allocations.
+ */
+static int kswapd(void *args);
+
+void
+pgcache_init(void)
+{
+    list_init(&active.pages);
+    list_init(&inactive.pages);
+    active.len = inactive.len = 0;
+    spinlock_init(&lru_lock, False);
+    spinlock_init(&kswapd_lock, False);
+    condvar_init(&kswapd_cv);
+    kswapd_thread = thread_create("kswapd", NULL, DEFAULT_PRI);
+    kassert(kswapd_thread);
+    thread_start_context(kswapd_thread, kswapd, NULL);
+    pmem_register_shrinker(PGCACHE_FREE_LOW, kswapd_wake);
+    timer_register_periodic(PGCACHE_SLAB_TICKS, kswapd_tick);
+}
 
 struct page*
 pgcache_get_page(struct memstore *store, offset_t ofs)
 {
     struct page *page;
     paddr_t paddr;
+    size_t npages;
+    offset_t index;
 
     kassert(store);
     paddr = PADDR_NONE;
+    npages = 1 << store->page_order;
+    // blocks are cached under the index of their first page
+    index = (ofs / pg_size) & ~(npages - 1);
 
-    if ((page = radix_tree_lookup(&store->cached_pages, ofs / pg_size)) == NULL) {
+    if ((page = radix_tree_lookup(&store->cached_pages, index)) == NULL) {
         // Page not found in cache -- allocate a new page, and update the page
-        // with data read from the backing store
-        if (pmem_alloc(&paddr) != ERR_OK) {
+        // with data read from the backing store. Reclaim directly once before
+        // giving up, kswapd may be behind, and compact for blocks.
+        if (pmem_nalloc(&paddr, npages) != ERR_OK &&
+            (pgcache_reclaim(npages) == 0 || pmem_nalloc(&paddr, npages) != ERR_OK) &&
+            (npages == 1 || !pgcache_compact(store->page_order) || pmem_nalloc(&paddr, npages) != ERR_OK)) {
             return NULL;
         }
         page = paddr_to_page(paddr);
-        if (store->fillpage(store, ofs, page) != ERR_OK) {
+        if (store->fillpage(store, (offset_t)index * pg_size, page) != ERR_OK) {
             pmem_free(paddr);
             return NULL;
         }
-        switch (radix_tree_insert(&store->cached_pages, ofs / pg_size, page)) {
+        switch (radix_tree_insert(&store->cached_pages, index, page)) {
             case ERR_RADIX_TREE_ALLOC:
                 pmem_free(paddr);
                 return NULL;
             case ERR_RADIX_TREE_NODE_EXIST:
                 panic("node should not exist");
         }
+        page->rmap = &store->rmap;
+        page->ofs = (offset_t)index * pg_size;
+        page->lru_state = 0;
+        spinlock_acquire(&lru_lock);
+        list_append(&inactive.pages, &page->lru_node);
+        inactive.len++;
+        spinlock_release(&lru_lock);
+    } else {
+        lru_mark_accessed(page);
     }
 
     return page;
 }
 
+struct page*
+pgcache_find_page(struct memstore *store, offset_t ofs)
+{
+    struct page *page;
+    offset_t index = ofs / pg_size;
+
+    kassert(store);
+    if (store->page_order != 0 || (page = radix_tree_lookup(&store->cached_pages, index)) == NULL) {
+        return NULL;
+    }
+    // the page may have been evicted and reused since the lookup, pin it
+    // before its lock can be trusted, then check it is still the cached one
+    if (!pmem_try_inc_refcnt(page_to_paddr(page))) {
+        return NULL;
+    }
+    sleeplock_acquire(&page->lock);
+    // eviction drops the page from the tree under page->lock
+    if (radix_tree_lookup(&store->cached_pages, index) != page) {
+        pgcache_put_page(page);
+        return NULL;
+    }
+    lru_mark_accessed(page);
+    return page;
+}
+
+void
+pgcache_put_page(struct page *page)
+{
+    sleeplock_release(&page->lock);
+    pmem_dec_refcnt(page_to_paddr(page));
+}
+
+void
+pgcache_tag_dirty(struct memstore *store, offset_t ofs)
+{
+    offset_t index;
+
+    kassert(store);
+    index = (ofs / pg_size) & ~(((offset_t)1 << store->page_order) - 1);
+    // already tagged pages, the common case, don't need pgcache_lock
+    if (radix_tree_tag_get(&store->cached_pages, index, PGCACHE_TAG_DIRTY)) {
+        return;
+    }
+    sleeplock_acquire(&store->pgcache_lock);
+    radix_tree_tag_set(&store->cached_pages, index, PGCACHE_TAG_DIRTY);
+    sleeplock_release(&store->pgcache_lock);
+}
+
 void
 pgcache_remove_page(struct memstore *store, offset_t ofs)
 {
+    struct page *page;
+
+    kassert(store);
+    page = radix_tree_remove(&store->cached_pages, (ofs / pg_size) & ~(((offset_t)1 << store->page_order) - 1));
+    if (page != NULL) {
+        spinlock_acquire(&lru_lock);
+        // compaction only trusts the store of a page with an rmap
+        page->rmap = NULL;
+        list_remove(&page->lru_node);
+        if (get_state_bit(page->lru_state, LRU_ACTIVE)) {
+            active.len--;
+        } else {
+            inactive.len--;
+        }
+        spinlock_release(&lru_lock);
+    }
+}
+
+void
+pgcache_remove_all(struct memstore *store)
+{
+    struct page *pages[PGCACHE_BATCH];
+    size_t n;
+
     kassert(store);
-    radix_tree_remove(&store->cached_pages, ofs / pg_size);
+    kassert(list_empty(&store->rmap.regions));
+    if (radix_tree_empty(&store->cached_pages)) {
+        return;
+    }
+    // reclaim holds pgcache_lock while it works on one of our pages
+    sleeplock_acquire(&store->pgcache_lock);
+    while ((n = radix_tree_gang_lookup(&store->cached_pages, (void**)pages, 0, PGCACHE_BATCH)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            pgcache_remove_page(store, pages[i]->ofs);
+            // nothing maps the store anymore, this is the cache's reference
+            pmem_dec_refcnt(page_to_paddr(pages[i]));
+        }
+    }
+    sleeplock_release(&store->pgcache_lock);
+}
+
+size_t
+pgcache_reclaim(size_t target)
+{
+    struct page *page;
+    struct memstore *store;
+    size_t freed = 0, scan;
+
+    spinlock_acquire(&lru_lock);
+    if (active.len > inactive.len) {
+        lru_age_active(active.len - inactive.len);
+    }
+    // each inactive page is looked at once per call
+    scan = inactive.len;
+    while (freed < target && scan-- > 0 && !list_empty(&inactive.pages)) {
+        page = list_entry(list_begin(&inactive.pages), struct page, lru_node);
+        lru_move(page, &inactive);
+        store = list_entry(page->rmap, struct memstore, rmap);
+        // don't wait on a store in use, and keep blocks larger than a page
+        if (store->page_order != 0 || sleeplock_try_acquire(&store->pgcache_lock) != ERR_OK) {
+            continue;
+        }
+        spinlock_release(&lru_lock);
+        switch (pgcache_evict(store, page)) {
+            case EVICT_FREED:
+                freed++;
+                break;
+            case EVICT_ACTIVATE:
+                spinlock_acquire(&lru_lock);
+                lru_move(page, &active);
+                spinlock_release(&lru_lock);
+                break;
+            case EVICT_KEPT:
+                break;
+        }
+        sleeplock_release(&store->pgcache_lock);
+        spinlock_acquire(&lru_lock);
+    }
+    spinlock_release(&lru_lock);
+    return freed;
+}
+
+bool
+pgcache_compact(int order)
+{
+    struct page *page;
+    paddr_t start, end, to = PADDR_NONE;
+    List stash;
+    bool moved = True;
+
+    if (order == 0) {
+        return False;
+    }
+    // only pages in this cpu's cache can be merged back from here
+    pmem_drain_pcp();
+    if (!pmem_compact_candidate(order, &start)) {
+        return False;
+    }
+    end = start + ((paddr_t)pg_size << order);
+    // free pages the block gives out as targets are kept until the end
+    list_init(&stash);
+    for (paddr_t pa = start; pa < end && moved; pa += pg_size) {
+        page = paddr_to_page(pa);
+        if (page->rmap == NULL) {
+            continue;
+        }
+        while (to == PADDR_NONE) {
+            if (pmem_alloc(&to) != ERR_OK) {
+                moved = False;
+                break;
+            }
+            if (to >= start && to < end) {
+                list_append(&stash, &paddr_to_page(to)->node);
+                to = PADDR_NONE;
+            }
+        }
+        if (moved && pgcache_migrate(page, to) == ERR_OK) {
+            to = PADDR_NONE;
+        } else {
+            moved = False;
+        }
+    }
+    if (to != PADDR_NONE) {
+        pmem_free(to);
+    }
+    while (!list_empty(&stash)) {
+        page = list_entry(list_begin(&stash), struct page, node);
+        list_remove(&page->node);
+        pmem_free(page_to_paddr(page));
+    }
+    // freed pages wait in this cpu's cache, let them merge
+    pmem_drain_pcp();
+    // a page skipped as freed may have been reused, or freed into another
+    // cpu's cache, since the block was chosen
+    return moved && pmem_has_free_block(order);
+}
+
+static err_t
+pgcache_migrate(struct page *page, paddr_t to)
+{
+    struct page *new = paddr_to_page(to);
+    struct memstore *store;
+    paddr_t paddr = page_to_paddr(page);
+    err_t err = ERR_LOCK_BUSY;
+
+    if (!pmem_try_inc_refcnt(paddr)) {
+        // freed already
+        return ERR_OK;
+    }
+    // the store outlives its pages on the LRU, as in pgcache_reclaim
+    spinlock_acquire(&lru_lock);
+    if (page->rmap == NULL) {
+        spinlock_release(&lru_lock);
+        pmem_dec_refcnt(paddr);
+        return ERR_OK;
+    }
+    store = list_entry(page->rmap, struct memstore, rmap);
+    if (store->page_order != 0 || sleeplock_try_acquire(&store->pgcache_lock) != ERR_OK) {
+        spinlock_release(&lru_lock);
+        pmem_dec_refcnt(paddr);
+        return ERR_LOCK_BUSY;
+    }
+    spinlock_release(&lru_lock);
+
+    sleeplock_acquire(&page->lock);
+    if (radix_tree_lookup(&store->cached_pages, page->ofs / pg_size) != page ||
+        !list_empty(&page->blk_headers)) {
+        goto done;
+    }
+    rmap_unmap(&store->rmap, paddr);
+    // the cache's reference and ours, anything else is a private copy or a pin
+    if (page->refcnt != 2) {
+        goto done;
+    }
+    memcpy((void*)kmap_p2v(to), (void*)kmap_p2v(paddr), pg_size);
+    new->rmap = page->rmap;
+    new->ofs = page->ofs;
+    pmem_set_page_dirty(new, pmem_is_page_dirty(page));
+    // lookups that find the old page see it was replaced under its lock
+    radix_tree_replace(&store->cached_pages, page->ofs / pg_size, new);
+    spinlock_acquire(&lru_lock);
+    new->lru_state = page->lru_state;
+    new->lru_node = page->lru_node;
+    new->lru_node.prev->next = &new->lru_node;
+    new->lru_node.next->prev = &new->lru_node;
+    page->rmap = NULL;
+    spinlock_release(&lru_lock);
+    err = ERR_OK;
+done:
+    sleeplock_release(&page->lock);
+    sleeplock_release(&store->pgcache_lock);
+    if (err == ERR_OK) {
+        // the cache's reference
+        pmem_dec_refcnt(paddr);
+    }
+    pmem_dec_refcnt(paddr);
+    return err;
+}
+
+static void
+lru_move(struct page *page, struct lru_list *list)
+{
+    struct lru_list *from = get_state_bit(page->lru_state, LRU_ACTIVE) ? &active : &inactive;
+
+    list_remove(&page->lru_node);
+    from->len--;
+    list_append(&list->pages, &page->lru_node);
+    list->len++;
+    page->lru_state = set_state_bit(page->lru_state, LRU_ACTIVE, list == &active);
+}
+
+static void
+lru_mark_accessed(struct page *page)
+{
+    // lock free so cache hits stay lock free, reclaim promotes referenced
+    // inactive pages. Racing an update under lru_lock at worst loses the bit.
+    if (!get_state_bit(page->lru_state, LRU_REFERENCED)) {
+        __sync_fetch_and_or(&page->lru_state, 1 << LRU_REFERENCED);
+    }
+}
+
+static void
+lru_age_active(size_t n)
+{
+    struct page *page;
+
+    while (n-- > 0 && !list_empty(&active.pages)) {
+        page = list_entry(list_begin(&active.pages), struct page, lru_node);
+        // it has to be looked up twice again to come back
+        page->lru_state = set_state_bit(page->lru_state, LRU_REFERENCED, False);
+        lru_move(page, &inactive);
+    }
+}
+
+static evict_t
+pgcache_evict(struct memstore *store, struct page *page)
+{
+    paddr_t paddr = page_to_paddr(page);
+    evict_t ret = EVICT_KEPT;
+
+    sleeplock_acquire(&page->lock);
+    // bdev block buffers live in the page
+    if (!list_empty(&page->blk_headers)) {
+        goto done;
+    }
+    if (rmap_referenced(&store->rmap, paddr) > 0 || get_state_bit(page->lru_state, LRU_REFERENCED)) {
+        // second use since it went inactive
+        ret = EVICT_ACTIVATE;
+        goto done;
+    }
+    rmap_unmap(&store->rmap, paddr);
+    // the page is still mapped by a forked private copy if it has other references
+    if (page->refcnt != 1) {
+        goto done;
+    }
+    if (pmem_is_page_dirty(page)) {
+        // nothing can redirty it now that it is unmapped and we hold pgcache_lock
+        pmem_set_page_dirty(page, False);
+        if (store->write(store, paddr, page->ofs) != ERR_OK) {
+            pmem_set_page_dirty(page, True);
+            goto done;
+        }
+    }
+    ret = EVICT_FREED;
+    // pgcache_find_page rechecks the tree under page->lock
+    pgcache_remove_page(store, page->ofs);
+done:
+    sleeplock_release(&page->lock);
+    if (ret == EVICT_FREED) {
+        pmem_dec_refcnt(paddr);
+    }
+    return ret;
+}
+
+static void
+kswapd_wake(void)
+{
+    if (kswapd_thread == NULL) {
+        return;
+    }
+    spinlock_acquire(&kswapd_lock);
+    condvar_signal(&kswapd_cv);
+    spinlock_release(&kswapd_lock);
+}
+
+static void
+kswapd_tick(void)
+{
+    spinlock_acquire(&kswapd_lock);
+    kswapd_slab_tick = True;
+    condvar_signal(&kswapd_cv);
+    spinlock_release(&kswapd_lock);
+}
+
+static int
+kswapd(void *args)
+{
+    size_t free;
+    int order;
+    bool tick;
+
+    for (;;) {
+        spinlock_acquire(&kswapd_lock);
+        while ((order = pmem_compact_request()) < 0 && pmem_free_count() >= PGCACHE_FREE_LOW &&
+               !kswapd_slab_tick) {
+            condvar_wait(&kswapd_cv, &kswapd_lock);
+        }
+        tick = kswapd_slab_tick;
+        kswapd_slab_tick = False;
+        spinlock_release(&kswapd_lock);
+
+        if (tick || pmem_free_count() < PGCACHE_FREE_LOW) {
+            kmem_reclaim();
+        }
+
+        if (order > 0) {
+            pgcache_compact(order);
+        }
+
+        while ((free = pmem_free_count()) < PGCACHE_FREE_HIGH) {
+            if (pgcache_reclaim(PGCACHE_FREE_HIGH - free) == 0) {
+                // nothing left to evict, wait for the next allocation below the mark
+                spinlock_acquire(&kswapd_lock);
+                condvar_wait(&kswapd_cv, &kswapd_lock);
+                spinlock_release(&kswapd_lock);
+            }
+        }
+    }
+    return 0;
 }
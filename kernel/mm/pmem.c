@@ -2,6 +2,8 @@
 #include <kernel/vm.h>
 #include <kernel/console.h>
 #include <kernel/vpmap.h>
+#include <kernel/trap.h>
+#include <arch/cpu.h>
 #include <lib/errcode.h>
 #include <lib/string.h>
 #include <lib/stddef.h>
@@ -23,12 +25,21 @@
  * them in the current free list and returns the other one. The two blocks are
  * called "buddies". When two buddy blocks are both freed, they merge into a
  * bigger block and is moved to the next free list.
+ *
+ * Single free pages are cached per CPU (x86_64_cpu pcp) in front of the buddy
+ * allocator, so that allocating and freeing one page only needs interrupts
+ * off. A CPU's cache is refilled from and drained to the free lists
+ * PCP_BATCH pages at a time under pmem_lock. Reference counts are atomic.
  */
 
 struct pmemconfig pmemconfig;
 
 // Page state bits
 #define PAGE_DIRTY_BIT 0
+#define PAGE_BUDDY_BIT 1    // on a free list, so free to merge with
+
+// Pages moved between a cpu's cache and the free lists at a time
+#define PCP_BATCH (PCP_HIGH / 4)
 
 // Lock protecting page allocation and deallocation
 static struct spinlock pmem_lock;
@@ -51,10 +62,31 @@ static bool pagemap_initialized;
 
 /*
  * freeblocks keeps a linked list of free blocks for each order n, up to
- * MAX_ORDER.
+ * MAX_ORDER. free_blocks counts the blocks on each list and bit n of
+ * free_orders is set while freeblocks[n] is not empty, so an allocation finds
+ * the smallest order that fits with one bit scan.
  */
-#define MAX_ORDER 10
+#define MAX_ORDER PMEM_MAX_ORDER
 static List freeblocks[MAX_ORDER+1];
+static size_t free_blocks[MAX_ORDER+1];
+static uint32_t free_orders;
+
+/*
+ * Number of pages on the free lists, protected by pmem_lock.
+ */
+static size_t free_pgcnt;
+
+// Set once single pages go through the per-CPU caches
+static bool pcp_enabled;
+
+/*
+ * Called when an allocation leaves fewer than shrinker_low pages free.
+ */
+static void (*shrinker)(void);
+static size_t shrinker_low;
+
+// Largest order a multi-page allocation failed at, -1 if none
+static int compact_order = -1;
 
 /*
  * Initialize bitmap for the boot memory allocator.
@@ -145,10 +177,9 @@ static int get_max_page_order(paddr_t start, paddr_t end);
 static int get_min_page_order(size_t n);
 
 /*
- * Find a free block with the specified order. If split is true, split the
- * block into two, return one of them, and inserts the other one into the free
- * list of order - 1. If no free block is found, recursively search
- * the next order.
+ * Find a free block with the specified order. If there is none, take a block
+ * of the smallest larger order that is free and split it down, inserting the
+ * upper halves into the free lists.
  *
  * Precondition:
  * Caller must hold pmem_lock.
@@ -156,7 +187,7 @@ static int get_min_page_order(size_t n);
  * Return:
  * NULL - Failed to find a free block.
  */
-static struct page *find_freeblock(int order, bool split);
+static struct page *find_freeblock(int order);
 
 /*
  * Find page's buddy block.
@@ -210,6 +241,35 @@ static err_t pmem_nalloc_internal(paddr_t *paddr, size_t n, bool lock);
  */
 static void pmem_nfree_internal(paddr_t paddr, size_t n, bool lock);
 
+/*
+ * Prepare a newly allocated block for its owner.
+ */
+static void page_alloc_init(struct page *page);
+
+/*
+ * Allocate or free one page through the current CPU's cache.
+ */
+static err_t pcp_alloc(paddr_t *paddr);
+static void pcp_free(paddr_t paddr);
+
+/*
+ * Move up to PCP_BATCH pages from the free lists to cpu's cache, or the n
+ * oldest pages of cpu's cache back to the free lists.
+ *
+ * Precondition:
+ * Interrupts are off, so cpu is the current CPU.
+ */
+static void pcp_refill(struct x86_64_cpu *cpu);
+static void pcp_drain(struct x86_64_cpu *cpu, int n);
+
+/*
+ * Return True if the allocated page can be migrated by compaction.
+ *
+ * Precondition:
+ * Caller must hold pmem_lock.
+ */
+static bool page_movable(struct page *page);
+
 static void
 bitmap_init(void)
 {
@@ -415,30 +475,31 @@ get_min_page_order(size_t n)
 }
 
 static struct page*
-find_freeblock(int order, bool split)
+find_freeblock(int order)
 {
     struct page *page, *buddy;
+    uint32_t orders;
+    int n;
 
     if (order < 0 || order > MAX_ORDER) {
         return NULL;
     }
 
-    if (!list_empty(&freeblocks[order])) {
-        page = list_entry(list_begin(&freeblocks[order]), struct page, node);
-        freeblocks_remove(page);
-    } else {
-        // Recursively splitting higher order blocks
-        if ((page = find_freeblock(order + 1, True)) == NULL) {
-            return NULL;
-        }
+    if ((orders = free_orders & ~((1u << order) - 1)) == 0) {
+        return NULL;
     }
-
-    if (split) {
-        page->order = order - 1;
+    n = __builtin_ctz(orders);
+    page = list_entry(list_begin(&freeblocks[n]), struct page, node);
+    freeblocks_remove(page);
+
+    // Split higher order blocks, keeping the lower half
+    while (n > order) {
+        n--;
+        page->order = n;
         if ((buddy = find_buddy(page)) == NULL) {
             panic("Failed find buddy block");
         }
-        buddy->order = order - 1;
+        buddy->order = n;
         freeblocks_insert(buddy);
     }
 
@@ -481,13 +542,13 @@ merge_block(struct page *page)
 
     buddy = find_buddy(page);
     // We can only merge the two blocks if:
-    // 1. The buddy block is also free
+    // 1. The buddy block is also free, and not in a cpu's cache
     // 2. The two blocks have the same order. If the buddy block has a different
     // order (should be smaller), the buddy block has been splitted and there
     // exist smaller allocated block within the buddy block.
     //
     // Once we merge the two blocks, recursively merge the next level blocks
-    if (buddy && buddy->refcnt == 0 && buddy->order == page->order) {
+    if (buddy && get_state_bit(buddy->state, PAGE_BUDDY_BIT) && buddy->order == page->order) {
         freeblocks_remove(buddy);
         if (page < buddy) {
             page->order += 1;
@@ -509,7 +570,10 @@ freeblocks_insert(struct page *page)
     kassert(page->order >= 0 && page->order <= MAX_ORDER);
 
     page->refcnt = 0;
+    page->state = set_state_bit(page->state, PAGE_BUDDY_BIT, True);
     list_append(&freeblocks[page->order], &page->node);
+    free_blocks[page->order]++;
+    free_orders |= 1u << page->order;
 }
 
 static void
@@ -525,6 +589,7 @@ freeblocks_insert_range(paddr_t start, paddr_t end)
 
         page->order = order;
         freeblocks_insert(page);
+        free_pgcnt += 1 << order;
         start += (1 << order) * pg_size;
     }
 }
@@ -536,7 +601,11 @@ freeblocks_remove(struct page *page)
     kassert(page->refcnt == 0);
     kassert(page->order >= 0 && page->order <= MAX_ORDER);
 
+    page->state = set_state_bit(page->state, PAGE_BUDDY_BIT, False);
     list_remove(&page->node);
+    if (--free_blocks[page->order] == 0) {
+        free_orders &= ~(1u << page->order);
+    }
 }
 
 static err_t
@@ -546,6 +615,9 @@ pmem_nalloc_internal(paddr_t *paddr, size_t n, bool lock)
     struct page *page;
 
     kassert(n > 0);
+    if (lock && n == 1 && pcp_enabled) {
+        return pcp_alloc(paddr);
+    }
     if (lock) {
         spinlock_acquire(&pmem_lock);
     }
@@ -559,17 +631,11 @@ pmem_nalloc_internal(paddr_t *paddr, size_t n, bool lock)
     } else {
         // Buddy allocator
         order = get_min_page_order(n);
-        if ((page = find_freeblock(order, False)) == NULL) {
+        if ((page = find_freeblock(order)) == NULL) {
             goto fail;
         }
-        sleeplock_init(&page->lock);
-        page->kmem_cache = NULL;
-        page->slab = NULL;
-        page->rmap = NULL;
-        pmem_set_page_dirty(page, False);
-        kassert(page->refcnt == 0);
-        page->refcnt = 1;
-        list_init(&page->blk_headers);
+        free_pgcnt -= 1 << page->order;
+        page_alloc_init(page);
         *paddr = page_to_paddr(page);
         kassert(*paddr != NULL);
     }
@@ -591,6 +657,10 @@ pmem_nfree_internal(paddr_t paddr, size_t n, bool lock)
     struct page *page;
 
     kassert(n > 0);
+    if (lock && pcp_enabled && paddr_to_page(paddr)->order == 0) {
+        pcp_free(paddr);
+        return;
+    }
     if (lock) {
         spinlock_acquire(&pmem_lock);
     }
@@ -607,6 +677,7 @@ pmem_nfree_internal(paddr_t paddr, size_t n, bool lock)
             // allocated pages
         }
         page->refcnt = 0;
+        free_pgcnt += 1 << page->order;
         page = merge_block(page);
         kassert(page != NULL);
         freeblocks_insert(page);
@@ -616,6 +687,90 @@ pmem_nfree_internal(paddr_t paddr, size_t n, bool lock)
     }
 }
 
+static void
+page_alloc_init(struct page *page)
+{
+    sleeplock_init(&page->lock);
+    page->kmem_cache = NULL;
+    page->slab = NULL;
+    page->rmap = NULL;
+    pmem_set_page_dirty(page, False);
+    kassert(page->refcnt == 0);
+    page->refcnt = 1;
+    list_init(&page->blk_headers);
+}
+
+static err_t
+pcp_alloc(paddr_t *paddr)
+{
+    struct x86_64_cpu *cpu;
+    err_t err = ERR_OK;
+
+    intr_set_level(INTR_OFF);
+    cpu = mycpu();
+    if (cpu->pcp_count == 0) {
+        pcp_refill(cpu);
+    }
+    if (cpu->pcp_count == 0) {
+        err = ERR_NOMEM;
+    } else {
+        *paddr = cpu->pcp[--cpu->pcp_count];
+    }
+    intr_set_level(INTR_ON);
+    if (err == ERR_OK) {
+        page_alloc_init(paddr_to_page(*paddr));
+    }
+    return err;
+}
+
+static void
+pcp_free(paddr_t paddr)
+{
+    struct x86_64_cpu *cpu;
+
+    paddr_to_page(paddr)->refcnt = 0;
+    intr_set_level(INTR_OFF);
+    cpu = mycpu();
+    if (cpu->pcp_count == PCP_HIGH) {
+        pcp_drain(cpu, PCP_BATCH);
+    }
+    cpu->pcp[cpu->pcp_count++] = paddr;
+    intr_set_level(INTR_ON);
+}
+
+static void
+pcp_refill(struct x86_64_cpu *cpu)
+{
+    struct page *page;
+
+    spinlock_acquire(&pmem_lock);
+    while (cpu->pcp_count < PCP_BATCH && (page = find_freeblock(0)) != NULL) {
+        free_pgcnt--;
+        cpu->pcp[cpu->pcp_count++] = page_to_paddr(page);
+    }
+    spinlock_release(&pmem_lock);
+}
+
+static void
+pcp_drain(struct x86_64_cpu *cpu, int n)
+{
+    struct page *page;
+
+    kassert(n <= cpu->pcp_count);
+    spinlock_acquire(&pmem_lock);
+    // the oldest pages go back, they are the least likely to be cache hot
+    for (int i = 0; i < n; i++) {
+        page = paddr_to_page(cpu->pcp[i]);
+        kassert(page->refcnt == 0 && page->order == 0);
+        free_pgcnt++;
+        page = merge_block(page);
+        freeblocks_insert(page);
+    }
+    cpu->pcp_count -= n;
+    memmove(cpu->pcp, cpu->pcp + n, cpu->pcp_count * sizeof(paddr_t));
+    spinlock_release(&pmem_lock);
+}
+
 struct page*
 paddr_to_page(paddr_t paddr)
 {
@@ -647,6 +802,19 @@ pmem_init(void)
     spinlock_release(&pmem_lock);
 }
 
+static bool
+page_movable(struct page *page)
+{
+    return page->order == 0 && page->rmap != NULL && page->slab == NULL &&
+        list_empty(&page->blk_headers);
+}
+
+void
+pmem_pcp_init(void)
+{
+    pcp_enabled = True;
+}
+
 err_t
 pmem_alloc(paddr_t *paddr)
 {
@@ -656,7 +824,19 @@ pmem_alloc(paddr_t *paddr)
 err_t
 pmem_nalloc(paddr_t *paddr, size_t n)
 {
-    return pmem_nalloc_internal(paddr, n, True);
+    err_t err = pmem_nalloc_internal(paddr, n, True);
+    int order;
+
+    if (err != ERR_OK && n > 1) {
+        // ask kswapd to compact until a free block of this order exists
+        if ((order = get_min_page_order(n)) > compact_order) {
+            compact_order = order;
+        }
+    }
+    if (shrinker != NULL && (pmem_free_count() < shrinker_low || (err != ERR_OK && n > 1))) {
+        shrinker();
+    }
+    return err;
 }
 
 void
@@ -683,6 +863,116 @@ pmem_set_page_dirty(struct page *page, int dirty)
     page->state = set_state_bit(page->state, PAGE_DIRTY_BIT, dirty);
 }
 
+size_t
+pmem_free_count(void)
+{
+    size_t n = free_pgcnt;
+
+    // a racy read is fine, callers only use it as a hint
+    for (int i = 0; i < ncpu; i++) {
+        n += x86_64_cpus[i].pcp_count;
+    }
+    return n;
+}
+
+void
+pmem_get_stats(struct pmem_stats *stats)
+{
+    kassert(stats);
+    stats->free_pages = pmem_free_count();
+    spinlock_acquire(&pmem_lock);
+    memcpy(stats->free_blocks, free_blocks, sizeof(free_blocks));
+    stats->largest_order = free_orders == 0 ? -1 : 31 - __builtin_clz(free_orders);
+    spinlock_release(&pmem_lock);
+}
+
+bool
+pmem_compact_candidate(int order, paddr_t *start)
+{
+    struct page *page, *end;
+    size_t window = 1 << order, best_movable = 0, movable;
+    bool ok;
+
+    kassert(order > 0 && order <= MAX_ORDER);
+    spinlock_acquire(&pmem_lock);
+    if ((free_orders >> order) != 0) {
+        spinlock_release(&pmem_lock);
+        return False;
+    }
+    // Every aligned window starts with the head of a block: smaller blocks are
+    // aligned to their size and larger ones start at a window. Walk block
+    // heads, a block can be skipped as a whole.
+    page = pagemap + (paddr_to_page(pmemconfig.pmem_start) - pagemap) / window * window;
+    for (; page + window <= pagemap_end; page = end) {
+        end = page + window;
+        if (page->order >= order) {
+            // free would have been found, allocated is unmovable
+            end = page + (1 << page->order);
+            continue;
+        }
+        movable = 0;
+        ok = True;
+        for (struct page *p = page; ok && p < end; p += 1 << p->order) {
+            if (get_state_bit(p->state, PAGE_BUDDY_BIT)) {
+                continue;
+            }
+            if (p->refcnt == 0) {
+                // in another cpu's cache, it would never merge
+                kassert(p->order == 0);
+                ok = False;
+                continue;
+            }
+            if (page_movable(p)) {
+                movable++;
+            } else {
+                ok = False;
+            }
+        }
+        if (ok && movable > 0 && (best_movable == 0 || movable < best_movable)) {
+            best_movable = movable;
+            *start = page_to_paddr(page);
+        }
+    }
+    spinlock_release(&pmem_lock);
+    return best_movable > 0;
+}
+
+bool
+pmem_has_free_block(int order)
+{
+    kassert(order >= 0 && order <= MAX_ORDER);
+    return (free_orders >> order) != 0;
+}
+
+int
+pmem_compact_request(void)
+{
+    return __sync_lock_test_and_set(&compact_order, -1);
+}
+
+void
+pmem_drain_pcp(void)
+{
+    struct x86_64_cpu *cpu;
+
+    if (!pcp_enabled) {
+        return;
+    }
+    intr_set_level(INTR_OFF);
+    cpu = mycpu();
+    pcp_drain(cpu, cpu->pcp_count);
+    intr_set_level(INTR_ON);
+}
+
+void
+pmem_register_shrinker(size_t low, void (*shrink)(void))
+{
+    spinlock_acquire(&pmem_lock);
+    shrinker_low = low;
+    shrinker = shrink;
+    spinlock_release(&pmem_lock);
+}
+
 void
 pmem_inc_refcnt(paddr_t paddr, size_t n)
 {
@@ -691,12 +981,25 @@ pmem_inc_refcnt(paddr_t paddr, size_t n)
     page = paddr_to_page(paddr);
     kassert(page);
 
-    spinlock_acquire(&pmem_lock);
-    kassert(page->refcnt > 0);
-    kassert(page->order == 0);
+    int old = __sync_fetch_and_add(&page->refcnt, n);
+    kassert(old > 0);
+}
 
-    page->refcnt += n;
-    spinlock_release(&pmem_lock);
+bool
+pmem_try_inc_refcnt(paddr_t paddr)
+{
+    struct page *page;
+    int ref;
+
+    page = paddr_to_page(paddr);
+    kassert(page);
+
+    do {
+        if ((ref = page->refcnt) <= 0) {
+            return False;
+        }
+    } while (!__sync_bool_compare_and_swap(&page->refcnt, ref, ref + 1));
+    return True;
 }
 
 void
@@ -707,13 +1010,9 @@ pmem_dec_refcnt(paddr_t paddr)
     page = paddr_to_page(paddr);
     kassert(page);
 
-    spinlock_acquire(&pmem_lock);
-    kassert(page->refcnt > 0);
-    kassert(page->order == 0);
-
-    page->refcnt--;
-    if (page->refcnt == 0) {
-        pmem_nfree_internal(paddr, 1, False);
+    int ref = __sync_sub_and_fetch(&page->refcnt, 1);
+    kassert(ref >= 0);
+    if (ref == 0) {
+        pmem_nfree_internal(paddr, 1 << page->order, True);
     }
-    spinlock_release(&pmem_lock);
 }
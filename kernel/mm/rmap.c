@@ -1,17 +1,29 @@
 #include <kernel/rmap.h>
 #include <kernel/kmalloc.h>
 #include <kernel/console.h>
+#include <kernel/pmem.h>
+#include <kernel/vm.h>
+#include <kernel/vpmap.h>
 #include <lib/errcode.h>
 #include <lib/stddef.h>
 
 struct kmem_cache *rmap_allocator = NULL;
 
+// used for nodes within rmap->regions
+static struct kmem_cache *rmap_node_allocator = NULL;
+
+/*
+ * Store the address at which mr maps the page cached at ofs in vaddr. Return
+ * False if mr doesn't cover ofs.
+ */
+static bool rmap_vaddr(struct memregion *mr, offset_t ofs, vaddr_t *vaddr);
+
 struct rmap*
 rmap_alloc(void)
 {
     struct rmap *rmap;
     if (rmap_allocator == NULL) {
-        if ((rmap_allocator = kmem_cache_create(sizeof(struct rmap))) == NULL) {
+        if ((rmap_allocator = kmem_cache_create("rmap", sizeof(struct rmap))) == NULL) {
             return NULL;
         }
     }
@@ -33,6 +45,7 @@ void
 rmap_construct(struct rmap *rmap)
 {
     kassert(rmap);
+    spinlock_init(&rmap->lock, False);
     list_init(&rmap->regions);
 }
 
@@ -44,9 +57,114 @@ rmap_destroy(struct rmap *rmap)
     // nothing to do
 }
 
+err_t
+rmap_add(struct rmap *rmap, struct memregion *mr)
+{
+    struct pid2mem *node;
+
+    kassert(rmap && mr);
+    if (rmap_node_allocator == NULL) {
+        if ((rmap_node_allocator = kmem_cache_create("pid2mem", sizeof(struct pid2mem))) == NULL) {
+            return ERR_NOMEM;
+        }
+    }
+    if ((node = kmem_cache_alloc(rmap_node_allocator)) == NULL) {
+        return ERR_NOMEM;
+    }
+    node->as = mr->as;
+    node->mr = mr;
+    spinlock_acquire(&rmap->lock);
+    list_append(&rmap->regions, &node->node);
+    spinlock_release(&rmap->lock);
+    return ERR_OK;
+}
+
+struct memregion*
+rmap_remove(struct rmap *rmap, struct addrspace *as, vaddr_t vaddr)
+{
+    struct memregion *mr = NULL;
+
+    kassert(rmap);
+    spinlock_acquire(&rmap->lock);
+    for (Node *n = list_begin(&rmap->regions); n != list_end(&rmap->regions); n = list_next(n)) {
+        struct pid2mem *node = list_entry(n, struct pid2mem, node);
+        if (node->as == as && vaddr >= node->mr->start && vaddr < node->mr->end) {
+            list_remove(n);
+            mr = node->mr;
+            kmem_cache_free(rmap_node_allocator, node);
+            break;
+        }
+    }
+    spinlock_release(&rmap->lock);
+    return mr;
+}
+
+static bool
+rmap_vaddr(struct memregion *mr, offset_t ofs, vaddr_t *vaddr)
+{
+    if (ofs < mr->ofs || ofs - mr->ofs >= mr->end - mr->start) {
+        return False;
+    }
+    *vaddr = mr->start + (ofs - mr->ofs);
+    return True;
+}
+
 err_t
 rmap_unmap(struct rmap *rmap, paddr_t paddr)
 {
-    // TODO
+    struct page *page;
+    vaddr_t vaddr;
+
+    kassert(rmap);
+    page = paddr_to_page(paddr);
+    kassert(page && page->rmap == rmap);
+    spinlock_acquire(&rmap->lock);
+    for (Node *n = list_begin(&rmap->regions); n != list_end(&rmap->regions); n = list_next(n)) {
+        struct memregion *mr = list_entry(n, struct pid2mem, node)->mr;
+        if (!rmap_vaddr(mr, page->ofs, &vaddr)) {
+            continue;
+        }
+        // a private mapping may hold its own copy of the page here, which
+        // stays; an entry in a page table shared since fork goes for all of
+        // its vpmaps at once, so each one is invalidated whether or not its
+        // own call found the page
+        vpmap_unmap_page(mr->as->vpmap, vaddr, paddr);
+        vpmap_invalidate_defer(mr->as->vpmap, vaddr, 1);
+    }
+    // one shootdown per address space for all of its mappings of the page
+    for (Node *n = list_begin(&rmap->regions); n != list_end(&rmap->regions); n = list_next(n)) {
+        struct memregion *mr = list_entry(n, struct pid2mem, node)->mr;
+        if (rmap_vaddr(mr, page->ofs, &vaddr)) {
+            vpmap_invalidate_sync(mr->as->vpmap);
+        }
+    }
+    spinlock_release(&rmap->lock);
     return ERR_OK;
 }
+
+int
+rmap_referenced(struct rmap *rmap, paddr_t paddr)
+{
+    struct page *page;
+    paddr_t mapped;
+    vaddr_t vaddr;
+    int accessed, referenced = 0;
+
+    kassert(rmap);
+    page = paddr_to_page(paddr);
+    kassert(page && page->rmap == rmap);
+    spinlock_acquire(&rmap->lock);
+    for (Node *n = list_begin(&rmap->regions); n != list_end(&rmap->regions); n = list_next(n)) {
+        struct memregion *mr = list_entry(n, struct pid2mem, node)->mr;
+        if (!rmap_vaddr(mr, page->ofs, &vaddr)) {
+            continue;
+        }
+        if (vpmap_lookup_vaddr(mr->as->vpmap, vaddr, &mapped, NULL) == ERR_OK && mapped == paddr &&
+            vpmap_get_accessed(mr->as->vpmap, vaddr, &accessed) == ERR_OK && accessed) {
+            vpmap_clear_accessed(mr->as->vpmap, vaddr);
+            referenced++;
+        }
+    }
+    spinlock_release(&rmap->lock);
+    return referenced;
+}
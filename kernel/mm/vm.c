@@ -13,11 +13,15 @@
 #include <lib/string.h>
 #include <lib/stddef.h>
 #include <kernel/shmms.h>
+#include <kernel/filems.h>
 
 
 /* Memory allocator for memregions */
 static struct kmem_cache *memregion_allocator;
 
+/* Last generation handed out to an address space */
+static uint64_t as_gen;
+
 /*
  * Allocate kas and kvpmap in the data section of the kernel image, so that we
  * can use them before kernel vm is initialized.
@@ -30,6 +34,16 @@ struct vpmap *kvpmap = &_kvpmap;
 /* Initialize the kernel address space, only called once */
 static void kas_init(void);
 
+/* Give as a new generation, before one of its regions changes. as lock must be held */
+static void as_bump_gen(struct addrspace *as);
+
+/*
+ * Look up / remember a region found by as_find_memregion in the current
+ * thread's cache. Lookups take no lock, inserts need the as lock.
+ */
+static struct memregion *mr_cache_lookup(struct addrspace *as, vaddr_t addr, size_t size);
+static void mr_cache_insert(struct addrspace *as, struct memregion *region);
+
 /* Invalidate a memregion due to changes in permission */
 static void memregion_invalidate(struct memregion *region);
 
@@ -37,18 +51,39 @@ static void memregion_invalidate(struct memregion *region);
 static bool memregion_allocated(struct addrspace *as, vaddr_t start, vaddr_t end);
 
 /* memregion comparator used to keep memregion in order by their addresses */
-static int64_t  memregion_comparator(const Node *a, const Node *b, void *aux);
+static int64_t memregion_comparator(const struct avl_node *a, const struct avl_node *b);
+
+/* Recompute the subtree fields of a memregion in an address space's tree */
+static void memregion_augment(struct avl_node *node);
+
+/* Return the region with the highest start below end, NULL if none */
+static struct memregion *memregion_below(struct addrspace *as, vaddr_t end);
+
+/*
+ * Find the lowest address in a gap of the subtree at node where find_free_vaddr
+ * can place size bytes. lo is the end of the region before the subtree.
+ */
+static bool find_free_gap(struct avl_node *node, vaddr_t lo, size_t size, size_t align,
+        vaddr_t *ret_addr);
 
 static void memregion_unmap_internal(struct memregion *region);
 
+/*
+ * Write back a shared file mapping's dirty pages and drop the region's file
+ * reference. Called after the region is unmapped, without as_lock held since
+ * both may sleep.
+ */
+static void memregion_release_file(struct file *file, struct memstore *store,
+        offset_t ofs, size_t size, int shared);
+
 static struct memregion* memregion_map_internal(struct addrspace *as, vaddr_t addr, size_t size, 
         memperm_t perm, struct memstore *store, offset_t ofs, int shared);
 
 static struct memregion* memregion_copy_internal(struct addrspace *as, 
 		struct memregion *src, vaddr_t addr);
 
-/* find free memory addresses of size ``size`` starting at *ret_addr */
-static err_t find_free_vaddr(struct addrspace *as, size_t size, vaddr_t *ret_addr);
+/* find free memory addresses of size ``size``, aligned to ``align``, starting at *ret_addr */
+static err_t find_free_vaddr(struct addrspace *as, size_t size, size_t align, vaddr_t *ret_addr);
 
 static char *perm_strings[] = {
     [MEMPERM_R] = "Kernel Read-only",
@@ -61,7 +96,8 @@ static void
 kas_init(void)
 {
     spinlock_init(&kas->as_lock, False);
-    list_init(&kas->regions);
+    avl_init(&kas->regions, memregion_augment);
+    kas->gen = __sync_add_and_fetch(&as_gen, 1);
     kas->vpmap = kvpmap;
 }
 
@@ -73,7 +109,7 @@ vm_init(void)
     pmem_init(); 
     kmalloc_init();
 
-    if ((memregion_allocator = kmem_cache_create(sizeof(struct memregion))) == NULL) {
+    if ((memregion_allocator = kmem_cache_create("memregion", sizeof(struct memregion))) == NULL) {
         panic("vm init: failed to create memregion allocator");
     }
 
@@ -86,7 +122,8 @@ as_init(struct addrspace* as)
 {
     kassert(as);
     spinlock_init(&as->as_lock, False);
-    list_init(&as->regions);
+    avl_init(&as->regions, memregion_augment);
+    as->gen = __sync_add_and_fetch(&as_gen, 1);
     if ((as->vpmap = vpmap_create()) == NULL) {
         return ERR_VM_RESOURCE_UNAVAIL;
     }
@@ -103,21 +140,35 @@ as_destroy(struct addrspace *as)
     kassert(as != kas); // Cannot destroy kernel address space
 
     spinlock_acquire(&as->as_lock);
-    vpmap_destroy(as->vpmap);
-    as->vpmap = NULL;
-
-    for (Node *n = list_begin(&as->regions); n != list_end(&as->regions);) {
-        struct memregion *region = (struct memregion*) list_entry(n, struct memregion, as_node);
+    // regions reachable through a memstore's rmap go first, reclaim may walk
+    // their page tables until they are out of it
+    for (struct avl_node *n = avl_first(&as->regions); n != NULL;) {
+        struct memregion *region = avl_entry(n, struct memregion, as_node);
         // We are going to destroy the region, so advance node pointer now
-        n = list_next(n);
-
-	if (region->shared) {
+        n = avl_next(n);
+
+	if (region->file) {
+	  struct file *file = region->file;
+	  struct memstore *store = region->store;
+	  offset_t ofs = region->ofs;
+	  size_t size = region->end - region->start;
+	  int shared = region->shared;
+	  rmap_remove(&store->rmap, as, region->start);
+	  memregion_unmap_internal(region);
+	  spinlock_release(&as->as_lock);
+	  memregion_release_file(file, store, ofs, size, shared);
+	  spinlock_acquire(&as->as_lock);
+	} else if (region->shared) {
 	  // eventually calls memregion_unmap
 	  unmapAll(region);
-	} else {
-          memregion_unmap_internal(region);
 	}
+    }
 
+    vpmap_destroy(as->vpmap);
+    as->vpmap = NULL;
+
+    while (as->regions.node != NULL) {
+        memregion_unmap_internal(avl_entry(as->regions.node, struct memregion, as_node));
     }
 
     spinlock_release(&as->as_lock);
@@ -138,8 +189,8 @@ as_copy_as(struct addrspace *src_as, struct addrspace *dst_as)
     }
 
     // go through all src regions and copy them
-    for (Node *n = list_begin(&src_as->regions); n != list_end(&src_as->regions); n = list_next(n)) {
-        struct memregion *r = list_entry(n, struct memregion, as_node);
+    for (struct avl_node *n = avl_first(&src_as->regions); n != NULL; n = avl_next(n)) {
+        struct memregion *r = avl_entry(n, struct memregion, as_node);
         struct memregion *dst_r = memregion_copy_internal((struct addrspace*) dst_as, r, r->start);
         if (dst_r == NULL) {
             err = ERR_NOMEM;
@@ -170,18 +221,23 @@ as_map_memregion(struct addrspace *as, vaddr_t addr, size_t size, memperm_t perm
 struct memregion*
 as_find_memregion(struct addrspace *as, vaddr_t addr, size_t size)
 {
+    struct memregion *r;
+
     kassert(as);
+    if ((r = mr_cache_lookup(as, addr, size)) != NULL) {
+        return r;
+    }
     spinlock_acquire(&as->as_lock);
-    List *list = &as->regions;
-    for (Node *n = list_begin(list); n != list_end(list); n = list_next(n)) {
-        struct memregion *r = (struct memregion*) list_entry(n, struct memregion, as_node);
-        if (addr >= r->start && addr+size <= pg_round_up(r->end)) {
-            spinlock_release(&as->as_lock);
-            return r;
-        }
+    // regions don't overlap, only the last one starting at or before addr can hold it
+    if ((r = memregion_below(as, addr + 1)) != NULL &&
+        (addr < r->start || addr+size > pg_round_up(r->end))) {
+        r = NULL;
+    }
+    if (r != NULL) {
+        mr_cache_insert(as, r);
     }
     spinlock_release(&as->as_lock);
-    return NULL;
+    return r;
 }
 
 struct memregion*
@@ -215,9 +271,8 @@ void
 as_meminfo(struct addrspace *as)
 {    
     spinlock_acquire(&as->as_lock);
-    List *list = &as->regions;
-    for (Node *n = list_begin(list); n != list_end(list); n = list_next(n)) {
-        struct memregion *r = (struct memregion*) list_entry(n, struct memregion, as_node);
+    for (struct avl_node *n = avl_first(&as->regions); n != NULL; n = avl_next(n)) {
+        struct memregion *r = avl_entry(n, struct memregion, as_node);
         kprintf("[%p - %p] %s | shared: %d \n", r->start, r->end, perm_strings[r->perm], r->shared);
     }
     spinlock_release(&as->as_lock);
@@ -233,12 +288,9 @@ as_dump(struct addrspace *as, vaddr_t vaddr)
     struct memregion *region;
 
     spinlock_acquire(&as->as_lock);
-    List *list = &as->regions;
-    for (Node *n = list_begin(list); n != list_end(list); n = list_next(n)) {
-        region = (struct memregion*) list_entry(n, struct memregion, as_node);
-        if (vaddr >= region->start && vaddr + sizeof(size_t) < pg_round_up(region->end)) {
-            goto found;
-        }
+    if ((region = memregion_below(as, vaddr + 1)) != NULL &&
+        vaddr >= region->start && vaddr + sizeof(size_t) < pg_round_up(region->end)) {
+        goto found;
     }
     spinlock_release(&as->as_lock);
     kprintf("memregion containing addr %p is not found\n", vaddr);
@@ -270,11 +322,9 @@ found:
 }
 
 err_t
-memregion_extend(struct memregion *region, int size, vaddr_t *old_bound)
+memregion_extend(struct memregion *region, ssize_t size, vaddr_t *old_bound)
 {
 
-  struct memregion *mr;
-
   if (region == NULL) {
     return ERR_VM_BOUND;  // this correct?
   }
@@ -284,34 +334,48 @@ memregion_extend(struct memregion *region, int size, vaddr_t *old_bound)
     return ERR_OK;
   }
 
-  // DONT lock region->as
+  // caller must not hold region->as->as_lock
   if (size > 0) {
 
-    mr = as_find_memregion(region->as, region->end, size);
-
-    if (mr != NULL && mr != region) {
-      // conflicting memory region found
+    spinlock_acquire(&region->as->as_lock);
+    // any overlap with the grown range conflicts, not just full containment
+    if (memregion_allocated(region->as, region->end, region->end + size)) {
+      spinlock_release(&region->as->as_lock);
       return ERR_VM_BOUND;
     }
     // update region
     *old_bound = region->end;
     region->end += size;
+    memregion_update(region);
+    spinlock_release(&region->as->as_lock);
 
   } else {
   
     // size < 0
+    spinlock_acquire(&region->as->as_lock);
     *old_bound = region->end;
-    int bytes = region->end - region->start;
+    ssize_t bytes = region->end - region->start;
   
     // not a fan of the negation -> conversion errors??
     if (bytes >= -size) {
       region->end += size;
+      memregion_update(region);
     }
+    spinlock_release(&region->as->as_lock);
 
   }
     return ERR_OK;
 }
 
+void
+memregion_update(struct memregion *region)
+{
+    kassert(region);
+    kassert(region->as->as_lock.holder == thread_current());
+    as_bump_gen(region->as);
+    avl_update(&region->as->regions, &region->as_node);
+}
+
 err_t
 memregion_set_perm(struct memregion *region, memperm_t perm)
 {
@@ -334,9 +398,84 @@ void
 memregion_unmap(struct memregion *region)
 {
     struct addrspace *as = region->as;
+    struct file *file = region->file;
+    struct memstore *store = region->store;
+    offset_t ofs = region->ofs;
+    size_t size = region->end - region->start;
+    int shared = region->shared;
+
+    if (file) {
+        rmap_remove(&store->rmap, as, region->start);
+    }
     spinlock_acquire(&as->as_lock);
     memregion_unmap_internal(region);
     spinlock_release(&as->as_lock);
+    if (file) {
+        memregion_release_file(file, store, ofs, size, shared);
+    }
+}
+
+static void
+memregion_release_file(struct file *file, struct memstore *store, offset_t ofs, size_t size, int shared)
+{
+    // vpmap_unmap has moved the pte dirty bits onto the cached pages
+    if (shared) {
+        filems_writeback(store, ofs, size);
+    }
+    fs_close_file(file);
+}
+
+static void
+as_bump_gen(struct addrspace *as)
+{
+    kassert(as->as_lock.holder == thread_current());
+    as->gen = __sync_add_and_fetch(&as_gen, 1);
+    // lockless lookups must see the new generation before the region changes
+    __sync_synchronize();
+}
+
+static struct memregion*
+mr_cache_lookup(struct addrspace *as, vaddr_t addr, size_t size)
+{
+    struct thread *t = thread_current();
+    struct mr_cache_entry *e, tmp;
+    struct memregion *r;
+    bool hit;
+
+    for (e = t->mr_cache; e < &t->mr_cache[THREAD_MR_CACHE]; e++) {
+        if (e->as != as || e->gen != as->gen) {
+            continue;
+        }
+        // the region may be changed or freed meanwhile, which bumps the
+        // generation first, so check it again once its bounds are read
+        r = e->mr;
+        hit = addr >= r->start && addr+size <= pg_round_up(r->end);
+        __sync_synchronize();
+        if (!hit || e->gen != as->gen) {
+            continue;
+        }
+        if (e != t->mr_cache) {
+            tmp = *e;
+            *e = t->mr_cache[0];
+            t->mr_cache[0] = tmp;
+        }
+        return r;
+    }
+    return NULL;
+}
+
+static void
+mr_cache_insert(struct addrspace *as, struct memregion *region)
+{
+    struct thread *t = thread_current();
+
+    kassert(as->as_lock.holder == t);
+    for (int i = THREAD_MR_CACHE - 1; i > 0; i--) {
+        t->mr_cache[i] = t->mr_cache[i - 1];
+    }
+    t->mr_cache[0].as = as;
+    t->mr_cache[0].gen = as->gen;
+    t->mr_cache[0].mr = region;
 }
 
 /*
@@ -348,48 +487,113 @@ memregion_allocated(struct addrspace *as, vaddr_t start, vaddr_t end)
     kassert(as);
     kassert(end >= start);
     kassert(as->as_lock.holder == thread_current());
-    List *list = &as->regions;
 
-    for (Node *n = list_begin(list); n != list_end(list); n = list_next(n)) {
-        struct memregion *r = list_entry(n, struct memregion, as_node);
-        if (start < r->end && end > r->start) {
-            return True;
+    // regions are ordered and disjoint, the last one starting before end has
+    // the highest end of those
+    struct memregion *r = memregion_below(as, end);
+    return r != NULL && start < r->end;
+}
+
+static int64_t
+memregion_comparator(const struct avl_node *a, const struct avl_node *b)
+{
+    struct memregion *mr_a = avl_entry(a, struct memregion, as_node);
+    struct memregion *mr_b = avl_entry(b, struct memregion, as_node);
+    return mr_a->start < mr_b->start ? -1 : mr_a->start > mr_b->start;
+}
+
+static void
+memregion_augment(struct avl_node *node)
+{
+    struct memregion *r = avl_entry(node, struct memregion, as_node);
+    struct memregion *child;
+    size_t gap;
+
+    r->subtree_start = r->start;
+    r->subtree_end = r->end;
+    r->max_gap = 0;
+    if (node->left != NULL) {
+        child = avl_entry(node->left, struct memregion, as_node);
+        r->subtree_start = child->subtree_start;
+        gap = r->start - child->subtree_end;
+        r->max_gap = child->max_gap > gap ? child->max_gap : gap;
+    }
+    if (node->right != NULL) {
+        child = avl_entry(node->right, struct memregion, as_node);
+        r->subtree_end = child->subtree_end;
+        gap = child->subtree_start - r->end;
+        gap = child->max_gap > gap ? child->max_gap : gap;
+        r->max_gap = r->max_gap > gap ? r->max_gap : gap;
+    }
+}
+
+static struct memregion*
+memregion_below(struct addrspace *as, vaddr_t end)
+{
+    struct avl_node *n = as->regions.node;
+    struct memregion *r, *below = NULL;
+
+    while (n != NULL) {
+        r = avl_entry(n, struct memregion, as_node);
+        if (r->start < end) {
+            below = r;
+            n = n->right;
+        } else {
+            n = n->left;
         }
     }
-    return False;
+    return below;
 }
 
-static int64_t
-memregion_comparator(const Node *a, const Node *b, void *aux)
+static bool
+find_free_gap(struct avl_node *node, vaddr_t lo, size_t size, size_t align, vaddr_t *ret_addr)
 {
-    struct memregion *mr_a = list_entry(a, struct memregion, as_node);
-    struct memregion *mr_b = list_entry(b, struct memregion, as_node);
-    // if a and b's memregion is consecutive, we want a after b in the list, +1 bumps 0 to postivie
-    //int64_t i = mr_a->start - mr_b->end + 1;
-    //kprintf("%d",0 - 0xFFFFFF7FFFFFF000);
-    //kprintf("mr_a->start: %p, mr_b->end: %p, i: %d\n", mr_a->start, mr_b->end, i);
-    //return i;
-    return mr_a->start >= mr_b->end;
+    struct memregion *r = avl_entry(node, struct memregion, as_node);
+    struct memregion *child;
+    vaddr_t addr;
+
+    // placing size bytes in [lo, start) requires start - lo > size, skip
+    // subtrees with no such gap
+    if (node->left != NULL) {
+        child = avl_entry(node->left, struct memregion, as_node);
+        if ((child->subtree_start - lo > size || child->max_gap > size) &&
+            find_free_gap(node->left, lo, size, align, ret_addr)) {
+            return True;
+        }
+        lo = child->subtree_end;
+    }
+    addr = (lo + align - 1) & ~((vaddr_t)align - 1);
+    if (addr >= lo && pg_round_up(addr + size) < r->start) {
+        *ret_addr = addr;
+        return True;
+    }
+    if (node->right != NULL) {
+        child = avl_entry(node->right, struct memregion, as_node);
+        if (child->subtree_start - r->end > size || child->max_gap > size) {
+            return find_free_gap(node->right, r->end, size, align, ret_addr);
+        }
+    }
+    return False;
 }
 
 static err_t
-find_free_vaddr(struct addrspace *as, size_t size, vaddr_t *ret_addr)
+find_free_vaddr(struct addrspace *as, size_t size, size_t align, vaddr_t *ret_addr)
 {
     kassert(as != kas); // should only be used finding user addresses
     kassert(ret_addr);
     kassert(as->as_lock.holder == thread_current());
+    kassert(align >= pg_size && (align & (align - 1)) == 0);
 
     vaddr_t addr = 0;   // TODO: maybe start at a different addr?
-    List *list = &as->regions;
+    struct avl_node *root = as->regions.node;
 
-    // memregion address goes up, only need to check if end is smaller than the start
-    for (Node *n = list_begin(list); n != list_end(list); n = list_next(n)) {
-        struct memregion *r = list_entry(n, struct memregion, as_node);
-        if (pg_round_up(addr + size) < r->start) {
-            *ret_addr = addr;
+    // lowest gap between regions, or before the first one, that fits
+    if (root != NULL) {
+        if (find_free_gap(root, addr, size, align, ret_addr)) {
             return ERR_OK;
         }
-        addr = pg_round_up(r->end);
+        addr = avl_entry(root, struct memregion, as_node)->subtree_end;
+        addr = (addr + align - 1) & ~((vaddr_t)align - 1);
     }
 
     // check address space after the last memregion allocated
@@ -407,12 +611,15 @@ memregion_unmap_internal(struct memregion *region)
     kassert(region);
     kassert(region->as->as_lock.holder == thread_current());
 
-    // Remove all memory mappings
+    as_bump_gen(region->as);
+    // Remove all memory mappings. Out of memory, a page table shared since
+    // fork that the region only partly covers keeps its read-only entries
+    // until the range is mapped again or the vpmap is destroyed
     vpmap_unmap(region->as->vpmap, region->start,
             pg_round_up(region->end - region->start) / pg_size, 1);
     // MYCODE
     // Detach from address space
-    list_remove(&region->as_node);
+    avl_remove(&region->as->regions, &region->as_node);
     memregion_invalidate(region);
     kmem_cache_free(memregion_allocator, region);
 }
@@ -425,9 +632,12 @@ memregion_map_internal(struct addrspace *as, vaddr_t addr, size_t size, memperm_
     kassert(as->as_lock.holder == thread_current());
 
     struct memregion *r;
-    if (addr == ADDR_ANYWHERE && find_free_vaddr(as, size, &addr) != ERR_OK) {
+    // stores backed by blocks larger than a page need block aligned regions
+    size_t align = store ? pg_size << store->page_order : pg_size;
+    if (addr == ADDR_ANYWHERE && find_free_vaddr(as, size, align, &addr) != ERR_OK) {
         return NULL;
     }
+    kassert(addr % align == 0);
 
     kassert(pg_aligned(addr));
     kassert((addr + pg_round_up(size)) >= addr);
@@ -454,10 +664,12 @@ memregion_map_internal(struct addrspace *as, vaddr_t addr, size_t size, memperm_
     r->shared = shared;
     r->store = store;
     r->ofs = ofs;
+    r->file = NULL;
 
 
-    // Link into address space's region list and memstore's reverse mapping
-    list_append_ordered(&as->regions, &r->as_node, memregion_comparator, NULL);
+    // Link into address space's region tree
+    as_bump_gen(as);
+    avl_insert(&as->regions, &r->as_node, memregion_comparator);
 
     return r;
 }
@@ -479,8 +691,18 @@ memregion_copy_internal(struct addrspace *as, struct memregion *src, vaddr_t add
         }
         */
 
+        if (src->file) {
+            if (rmap_add(&dst->store->rmap, dst) != ERR_OK) {
+                memregion_unmap_internal(dst);
+                return NULL;
+            }
+            dst->file = src->file;
+            fs_reopen_file(dst->file);
+        }
         // If the region is shared, ignore the pages because page mapping is done by memstore
-        if (src->shared) {
+        if (src->shared && src->file) {
+            // file pages are faulted back in from the page cache
+        } else if (src->shared) {
             kassert(src->store);
 	    // memstore set in map_internal
             // increase reference on shared memory
@@ -501,8 +723,9 @@ memregion_copy_internal(struct addrspace *as, struct memregion *src, vaddr_t add
 static void
 memregion_invalidate(struct memregion *region)
 {
-    struct proc *p = proc_current();
-    if ((p && region->as == &p->as) || region->as == kas) {
-        vpmap_flush_tlb();
+    // as_destroy drops the vpmap before the regions
+    if (region->as->vpmap != NULL) {
+        vpmap_invalidate(region->as->vpmap, region->start,
+                pg_round_up(region->end - region->start) / pg_size);
     }
 }
@@ -18,7 +18,29 @@ err_t handleCOW(struct proc* proc, struct vpmap* vpmap, vaddr_t fault_addr);
   Return:
     ERR_OK on success
 */
-err_t handleSharedRegion(struct proc* proc, struct memregion* mr, struct vpmap* vpmap, vaddr_t fault_addr);
+err_t handleSharedRegion(struct proc* proc, struct memregion* mr, struct vpmap* vpmap, vaddr_t fault_addr, int write);
+
+/*
+  Map a page of a private file mapping: read faults share the page cache page
+  read-only so a later write goes through handleCOW, write faults copy it now
+  Return:
+    ERR_OK on success
+*/
+err_t handlePrivateFile(struct proc* proc, struct memregion* mr, struct vpmap* vpmap, vaddr_t fault_addr, int write);
+
+/*
+  Map the pages around fault_addr that are already in the page cache, within
+  an aligned window of mr->store->fault_around pages clipped to the region
+*/
+static void faultAround(struct memregion* mr, struct vpmap* vpmap, vaddr_t fault_addr);
+
+/*
+  Return the page cache page at ofs locked and pinned, release it with
+  pgcache_put_page. Cached small pages are found without pgcache_lock
+  Return:
+    NULL if the page could not be filled
+*/
+static struct page* getPage(struct memstore* store, offset_t ofs);
 
 /*
   allocates and maps a page of memory
@@ -48,7 +70,11 @@ handle_page_fault(vaddr_t fault_addr, int present, int write, int user) {
         proc_exit(-1);
     }
     if (mr->shared) {
-      if (handleSharedRegion(proc, mr, mr->as->vpmap, fault_addr) == ERR_OK) {
+      if (handleSharedRegion(proc, mr, mr->as->vpmap, fault_addr, write) == ERR_OK) {
+        return;
+      }
+    } else if (mr->file && !present) {
+      if (handlePrivateFile(proc, mr, mr->as->vpmap, fault_addr, write) == ERR_OK) {
         return;
       }
     }
@@ -117,6 +143,10 @@ err_t
 handleCOW(struct proc* proc, struct vpmap* vpmap, vaddr_t fault_addr) {
     vaddr_t pageAddr = pg_round_down(fault_addr);
     paddr_t *paddr;
+    // the page reference count is only meaningful in a page table of our own
+    if (vpmap_unshare(vpmap, pageAddr) != ERR_OK) {
+        return ERR_FAULT;
+    }
     if (vpmap_lookup_vaddr(vpmap, pageAddr, (paddr_t*)&paddr, NULL) != ERR_OK) {
         return ERR_FAULT;
     }
@@ -146,34 +176,137 @@ handleCOW(struct proc* proc, struct vpmap* vpmap, vaddr_t fault_addr) {
         //kprintf("old page: %p -> new page: %p\n", paddr, cpPage);
     }
     sleeplock_release(&pg->lock);
-    vpmap_flush_tlb();
+    vpmap_invalidate(vpmap, pageAddr, 1);
     return ERR_OK;
 }
 
-err_t handleSharedRegion(struct proc* proc, struct memregion* mr, struct vpmap* vpmap, vaddr_t fault_addr) {
+err_t handleSharedRegion(struct proc* proc, struct memregion* mr, struct vpmap* vpmap, vaddr_t fault_addr, int write) {
   //kprintf("shared page fault\n");
-  sleeplock_acquire(&mr->store->pgcache_lock);
-  struct page* pg = pgcache_get_page(mr->store, (offset_t)(fault_addr - mr->start));
+  if (write && mr->perm != MEMPERM_URW) {
+    return ERR_FAULT;
+  }
+  struct page* pg = getPage(mr->store, mr->ofs + (offset_t)(pg_round_down(fault_addr) - mr->start));
   if (pg == NULL) {
-    sleeplock_release(&mr->store->pgcache_lock);
     return ERR_FAULT;
   }
-
-  paddr_t paddr = page_to_paddr(pg);
-  if (paddr == NULL) {
-    sleeplock_release(&mr->store->pgcache_lock);
+  // resizeRegion may have shrunk mr since the fault looked it up, it takes
+  // every tail page's lock before unmapping the tail
+  if (fault_addr >= mr->end) {
+    pgcache_put_page(pg);
     return ERR_FAULT;
   }
 
-  sleeplock_acquire(&pg->lock);
-  if (vpmap_map(vpmap, pg_round_down(fault_addr), paddr, 1, MEMPERM_URW) != ERR_OK) {
-    sleeplock_release(&mr->store->pgcache_lock);
-    sleeplock_release(&pg->lock);
+  paddr_t paddr = page_to_paddr(pg);
+  if (mr->store->page_order > 0) {
+    // the whole block goes in with a single page directory entry
+    kassert(mr->store->page_order == huge_pg_order);
+    err_t err = vpmap_map_huge(vpmap, fault_addr & ~((vaddr_t)huge_pg_size - 1), paddr, 1, mr->perm);
+    if (err != ERR_OK) {
+      pgcache_put_page(pg);
+      return ERR_FAULT;
+    }
+  } else if (vpmap_map(vpmap, pg_round_down(fault_addr), paddr, 1, mr->perm) != ERR_OK) {
+    pgcache_put_page(pg);
     return ERR_FAULT;
   }
   pmem_inc_refcnt(paddr, 1);
-  sleeplock_release(&pg->lock);
-  sleeplock_release(&mr->store->pgcache_lock);
+  pgcache_put_page(pg);
+  if (mr->perm == MEMPERM_URW) {
+    pgcache_tag_dirty(mr->store, mr->ofs + (offset_t)(pg_round_down(fault_addr) - mr->start));
+  }
+  if (mr->store->page_order == 0) {
+    faultAround(mr, vpmap, fault_addr);
+  }
   //kprintf("done\n");
   return ERR_OK;
+}
+
+err_t handlePrivateFile(struct proc* proc, struct memregion* mr, struct vpmap* vpmap, vaddr_t fault_addr, int write) {
+  vaddr_t va = pg_round_down(fault_addr);
+  paddr_t paddr, copy;
+  struct page* pg;
+  err_t err = ERR_OK;
+
+  if (write && mr->perm != MEMPERM_URW) {
+    return ERR_FAULT;
+  }
+  if ((pg = getPage(mr->store, mr->ofs + (offset_t)(va - mr->start))) == NULL) {
+    return ERR_FAULT;
+  }
+  paddr = page_to_paddr(pg);
+  if (write) {
+    // the cache page must never see private writes
+    if (pmem_alloc(&copy) != ERR_OK) {
+      err = ERR_NOMEM;
+    } else {
+      memcpy((void*)kmap_p2v(copy), (void*)kmap_p2v(paddr), pg_size);
+      if (vpmap_map(vpmap, va, copy, 1, MEMPERM_URW) != ERR_OK) {
+        pmem_free(copy);
+        err = ERR_FAULT;
+      }
+    }
+  } else if (vpmap_map(vpmap, va, paddr, 1, MEMPERM_UR) == ERR_OK) {
+    pmem_inc_refcnt(paddr, 1);
+  } else {
+    err = ERR_FAULT;
+  }
+  pgcache_put_page(pg);
+  return err;
+}
+
+static struct page*
+getPage(struct memstore* store, offset_t ofs) {
+  struct page* pg;
+
+  if (store->page_order == 0 && (pg = pgcache_find_page(store, ofs)) != NULL) {
+    return pg;
+  }
+  sleeplock_acquire(&store->pgcache_lock);
+  if ((pg = pgcache_get_page(store, ofs)) == NULL) {
+    sleeplock_release(&store->pgcache_lock);
+    return NULL;
+  }
+  // pin and lock it before reclaim can see it again
+  pmem_inc_refcnt(page_to_paddr(pg), 1);
+  sleeplock_acquire(&pg->lock);
+  sleeplock_release(&store->pgcache_lock);
+  return pg;
+}
+
+static void
+faultAround(struct memregion* mr, struct vpmap* vpmap, vaddr_t fault_addr) {
+  size_t window = mr->store->fault_around * pg_size;
+  vaddr_t start, end;
+
+  if (mr->store->fault_around <= 1) {
+    return;
+  }
+  kassert((mr->store->fault_around & (mr->store->fault_around - 1)) == 0);
+  start = fault_addr & ~(window - 1);
+  end = start + window;
+  if (start < mr->start) {
+    start = mr->start;
+  }
+  if (end > pg_round_up(mr->end)) {
+    end = pg_round_up(mr->end);
+  }
+
+  for (vaddr_t va = start; va < end; va += pg_size) {
+    if (va == pg_round_down(fault_addr) || vpmap_lookup_vaddr(vpmap, va, NULL, NULL) == ERR_OK) {
+      continue;
+    }
+    // only map what is cached, filling pages is left to their own fault
+    struct page* pg = pgcache_find_page(mr->store, mr->ofs + (offset_t)(va - mr->start));
+    if (pg == NULL) {
+      continue;
+    }
+    paddr_t paddr = page_to_paddr(pg);
+    if (vpmap_map(vpmap, va, paddr, 1, mr->perm) == ERR_OK) {
+      pmem_inc_refcnt(paddr, 1);
+    }
+    pgcache_put_page(pg);
+    if (mr->perm == MEMPERM_URW) {
+      pgcache_tag_dirty(mr->store, mr->ofs + (offset_t)(va - mr->start));
+    }
+  }
 }
\ No newline at end of file
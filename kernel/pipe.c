@@ -149,11 +149,12 @@ ssize_t kpipe_write(struct file *f, const void *buf, size_t count, offset_t *ofs
   return written;
 }
 /**/
-void kpipe_ref_decrease(struct file *f, int fd) {
+void kpipe_ref_decrease(struct file *f) {
   struct kpipe *p = f->kpipe;
   if (p != NULL) {
     spinlock_acquire(&p->pipe_lock);
-    if (fd == p->fd_reader) {
+    // the read end is the file opened read-only, whatever fd refers to it
+    if (f->oflag == FS_RDONLY) {
       int i = p->readers;
       p->readers = i -1;
     } else {
@@ -164,11 +165,12 @@ void kpipe_ref_decrease(struct file *f, int fd) {
   }
 }
 /**/
-void kpipe_ref_increase(struct file *f, int fd) {
+void kpipe_ref_increase(struct file *f) {
   struct kpipe *p = f->kpipe;
   if (p != NULL) {
     spinlock_acquire(&p->pipe_lock);
-    if (fd == p->fd_reader) {
+    // the read end is the file opened read-only, whatever fd refers to it
+    if (f->oflag == FS_RDONLY) {
       int i = p->readers;
       p->readers = i + 1;
     } else {
@@ -28,6 +28,10 @@ static err_t proc_load(struct proc *p, char *path, vaddr_t *entry_point);
 static err_t stack_setup(struct proc *p, char **argv, vaddr_t* ret_stackptr);
 /* helper function to get a process's proc struct by pid from ptable, must be called holding the ptable lock*/
 static err_t getProcByPID(int pid, struct proc** p);
+/* helper function to check spawn file actions against the current process's files */
+static err_t spawn_check_actions(struct spawn_action *actions, int n);
+/* helper function to apply checked spawn file actions to a new process's file table */
+static void spawn_apply_actions(struct proc *p, struct spawn_action *actions, int n);
 
 /* tranlsates a kernel vaddr to a user stack address, assumes stack is a single page */
 #define USTACK_ADDR(addr) (pg_ofs(addr) + USTACK_UPPERBOUND - pg_size);
@@ -70,7 +74,7 @@ proc_sys_init(void)
     list_init(&ptable);
     spinlock_init(&ptable_lock, False);
     spinlock_init(&pid_lock, False);
-    proc_allocator = kmem_cache_create(sizeof(struct proc));
+    proc_allocator = kmem_cache_create("proc", sizeof(struct proc));
     kassert(proc_allocator);
 }
 
@@ -129,6 +133,12 @@ proc_init(char* name)
 
 err_t
 proc_spawn(char* name, char** argv, struct proc **p)
+{
+    return proc_spawn_actions(name, argv, NULL, 0, p);
+}
+
+err_t
+proc_spawn_actions(char* name, char** argv, struct spawn_action *actions, int n, struct proc **p)
 {
     err_t err;
     struct proc *proc;
@@ -136,6 +146,9 @@ proc_spawn(char* name, char** argv, struct proc **p)
     vaddr_t entry_point;
     vaddr_t stackptr;
 
+    if ((err = spawn_check_actions(actions, n)) != ERR_OK) {
+        return err;
+    }
     if ((proc = proc_init(name)) == NULL) {
         return ERR_NOMEM;
     }
@@ -160,6 +173,8 @@ proc_spawn(char* name, char** argv, struct proc **p)
         goto error;
     }
 
+    spawn_apply_actions(proc, actions, n);
+
     // Set up parent for the new process
     if (proc_current()) {
         list_append((List*)&proc_current()->children, (Node*)&proc->child_node);
@@ -219,7 +234,7 @@ proc_fork()
     for (int i = 0; i < PROC_MAX_FILE; i++) {
         if (parent->files[i] != NULL) {
 	    // pipe
-  	    kpipe_ref_increase(parent->files[i], i);
+  	    kpipe_ref_increase(parent->files[i]);
             child->files[i] = parent->files[i];
             fs_reopen_file((struct file*)parent->files[i]);
         }
@@ -335,7 +350,7 @@ proc_exit(int status)
     for (int i = 0; i < PROC_MAX_FILE; i++) {
         if (p->files[i] != NULL) {
 	    // pipe
-            kpipe_ref_decrease(p->files[i], i);
+            kpipe_ref_decrease(p->files[i]);
             fs_close_file(p->files[i]);
         }
     }
@@ -467,8 +482,10 @@ stack_setup(struct proc *p, char **argv, vaddr_t* ret_stackptr)
       kprintf("bad");
     }
     kassert(as_find_memregion(&p->as, USTACK_UPPERBOUND - (10*pg_size), 9*pg_size) == NULL);
-    // lock here?
+    spinlock_acquire(&p->as.as_lock);
     mr->start = USTACK_UPPERBOUND - (10*pg_size);
+    memregion_update(mr);
+    spinlock_release(&p->as.as_lock);
     // kernel virtual address of the user stack, points to top of the stack
     // as you allocate things on stack, move stackptr downward.
     stackptr = kmap_p2v(paddr) + pg_size;
@@ -552,3 +569,51 @@ static err_t getProcByPID(int pid, struct proc** pa) {
     }
     return ERR_INVAL;
 }
+
+static err_t
+spawn_check_actions(struct spawn_action *actions, int n)
+{
+    struct proc *parent = proc_current();
+
+    if (n < 0 || n > SPAWN_MAX_ACTIONS || (n > 0 && actions == NULL)) {
+        return ERR_INVAL;
+    }
+    for (int i = 0; i < n; i++) {
+        struct spawn_action *a = &actions[i];
+        if (a->fd < 0 || a->fd >= PROC_MAX_FILE) {
+            return ERR_INVAL;
+        }
+        if (a->op == SPAWN_DUP2) {
+            if (a->newfd < 0 || a->newfd >= PROC_MAX_FILE ||
+                parent == NULL || parent->files[a->fd] == NULL) {
+                return ERR_INVAL;
+            }
+        } else if (a->op != SPAWN_CLOSE) {
+            return ERR_INVAL;
+        }
+    }
+    return ERR_OK;
+}
+
+static void
+spawn_apply_actions(struct proc *p, struct spawn_action *actions, int n)
+{
+    struct proc *parent = proc_current();
+    struct file *f;
+    int fd;
+
+    for (int i = 0; i < n; i++) {
+        fd = actions[i].op == SPAWN_DUP2 ? actions[i].newfd : actions[i].fd;
+        if (p->files[fd] != NULL) {
+            kpipe_ref_decrease(p->files[fd]);
+            fs_close_file(p->files[fd]);
+            p->files[fd] = NULL;
+        }
+        // share the open file like fork would
+        if (actions[i].op == SPAWN_DUP2 && (f = parent->files[actions[i].fd]) != NULL) {
+            kpipe_ref_increase(f);
+            fs_reopen_file(f);
+            p->files[fd] = f;
+        }
+    }
+}
@@ -12,17 +12,26 @@ static struct kmem_cache *node_allocator = NULL; // Tree node allocator
  */
 static struct radix_tree_node *radix_tree_node_create(void);
 
+#if RADIX_TREE_WIDTH_POWER > 6
+#error "tag bitmaps hold one bit per slot in a uint64_t"
+#endif
+
 /*
- * Return the max index of a tree. This is the max possible index, not max
- * allocated index.
+ * Return True if index fits in the current height of the tree.
  */
-static inline int radix_tree_max_index(const struct radix_tree_root *root);
+static inline int radix_tree_fits(const struct radix_tree_root *root, offset_t index);
+
+/*
+ * Return the mask of the index bits below a level, those that tell apart the
+ * leaves reached through one slot of a node at that level.
+ */
+static inline offset_t radix_tree_slot_mask(int level);
 
 /*
  * Given an index and a level (0 as the leaf level), return the index into the
  * node array.
  */
-static inline int radix_tree_level_index(int index, int level);
+static inline int radix_tree_level_index(offset_t index, int level);
 
 /*
  * Return the index of leaf in its parent node.
@@ -35,7 +44,7 @@ static inline int radix_tree_level_index(int index, int level);
  * Return NULL if failed to find parent (alloc = 0) or failed to allocate nodes
  * (alloc = 1)
  */
-static struct radix_tree_node *radix_tree_find_parent(struct radix_tree_root *root, int index, int alloc);
+static struct radix_tree_node *radix_tree_find_parent(struct radix_tree_root *root, offset_t index, int alloc);
 
 /*
  * Add a level to a tree. Return ERR_RADIX_TREE_ALLOC if failed to allocate
@@ -43,6 +52,41 @@ static struct radix_tree_node *radix_tree_find_parent(struct radix_tree_root *ro
  */
 static err_t radix_tree_add_level(struct radix_tree_root *root);
 
+/*
+ * Return the leaf at index if it has tag (any leaf for RADIX_TREE_ANY),
+ * without synchronizing with writers.
+ */
+static void *radix_tree_lookup_internal(struct radix_tree_root *root, offset_t index, int tag);
+
+/*
+ * Lookup synchronizing with writers, see radix_tree_lookup.
+ */
+static void *radix_tree_lookup_sync(struct radix_tree_root *root, offset_t index, int tag);
+
+/*
+ * Return the first slot >= i of node holding a child with tag (any child for
+ * RADIX_TREE_ANY), RADIX_TREE_WIDTH if none.
+ */
+static int radix_tree_next_slot(struct radix_tree_node *node, int i, int tag);
+
+/*
+ * Find the first leaf with tag at an index >= *index. Store its index in
+ * *index and return it, or return NULL if there is none.
+ */
+static void *radix_tree_find_next(struct radix_tree_root *root, offset_t *index, int tag);
+
+/*
+ * Mark the start and end of a change to the tree, lookups running across
+ * either retry. The end frees retired nodes if no lookup is in progress.
+ */
+static void radix_tree_write_begin(struct radix_tree_root *root);
+static void radix_tree_write_end(struct radix_tree_root *root);
+
+/*
+ * Free node once no lookup can still be walking it.
+ */
+static void radix_tree_node_retire(struct radix_tree_root *root, struct radix_tree_node *node);
+
 /*
  * Add a child node at an index.
  * is_node: True if child is an internal radix tree node.
@@ -55,36 +99,48 @@ radix_tree_node_create(void)
 {
     struct radix_tree_node *node;
     if (node_allocator == NULL) {
-        if ((node_allocator = kmem_cache_create(sizeof(struct radix_tree_node))) == NULL) {
+        if ((node_allocator = kmem_cache_create("radix_tree_node", sizeof(struct radix_tree_node))) == NULL) {
             return NULL;
         }
     }
     if ((node = kmem_cache_alloc(node_allocator)) != NULL) {
         node->count = 0;
         node->parent = NULL;
+        memset(node->tags, 0, sizeof(node->tags));
         memset(node->slots, 0, RADIX_TREE_WIDTH * sizeof(void*));
     }
     return node;
 }
 
 static inline int
-radix_tree_max_index(const struct radix_tree_root *root)
+radix_tree_fits(const struct radix_tree_root *root, offset_t index)
 {
     if (root->height == 0) {
-        return -1;
+        return False;
+    }
+    return (index & ~radix_tree_slot_mask(root->height)) == 0;
+}
+
+static inline offset_t
+radix_tree_slot_mask(int level)
+{
+    int bits = level * RADIX_TREE_WIDTH_POWER;
+
+    if (bits >= 64) {
+        return ~(offset_t)0;
     }
-    return (1 << (RADIX_TREE_WIDTH_POWER * root->height)) - 1;
+    return ((offset_t)1 << bits) - 1;
 }
 
 static inline int
-radix_tree_level_index(int index, int level)
+radix_tree_level_index(offset_t index, int level)
 {
-    return (index >> (level * RADIX_TREE_WIDTH_POWER)) & \
+    return (int)(index >> (level * RADIX_TREE_WIDTH_POWER)) & \
         ((1 << RADIX_TREE_WIDTH_POWER) - 1);
 }
 
 static struct radix_tree_node*
-radix_tree_find_parent(struct radix_tree_root *root, int index, int alloc)
+radix_tree_find_parent(struct radix_tree_root *root, offset_t index, int alloc)
 {
     int level, level_index;
     struct radix_tree_node *node, *child;
@@ -113,6 +169,11 @@ radix_tree_add_level(struct radix_tree_root *root)
     // Existing root node is always the 0th child node in the new root
     if (root->root_node != NULL) {
         radix_tree_add_child(node, 0, root->root_node, True);
+        for (int tag = 0; tag < RADIX_TREE_MAX_TAGS; tag++) {
+            if (root->root_node->tags[tag] != 0) {
+                node->tags[tag] = 1;
+            }
+        }
     }
     // Update root node
     root->root_node = node;
@@ -139,12 +200,46 @@ radix_tree_add_child(struct radix_tree_node *node, int index, void *child, int i
     return ERR_OK;
 }
 
+static void
+radix_tree_write_begin(struct radix_tree_root *root)
+{
+    root->seq++;
+    __sync_synchronize();
+}
+
+static void
+radix_tree_write_end(struct radix_tree_root *root)
+{
+    struct radix_tree_node *node;
+
+    __sync_synchronize();
+    root->seq++;
+    // a lookup starting from here on can't reach a retired node
+    __sync_synchronize();
+    if (root->readers == 0) {
+        while ((node = root->retired) != NULL) {
+            root->retired = node->parent;
+            kmem_cache_free(node_allocator, node);
+        }
+    }
+}
+
+static void
+radix_tree_node_retire(struct radix_tree_root *root, struct radix_tree_node *node)
+{
+    node->parent = root->retired;
+    root->retired = node;
+}
+
 void
 radix_tree_construct(struct radix_tree_root *root)
 {
     kassert(root);
     root->height = 0;
     root->root_node = NULL;
+    root->seq = 0;
+    root->readers = 0;
+    root->retired = NULL;
 }
 
 void
@@ -152,8 +247,10 @@ radix_tree_destroy(struct radix_tree_root *root)
 {
     kassert(root);
     // XXX: Deallocate all nodes in the tree
+    radix_tree_write_begin(root);
     root->root_node = NULL;
     root->height = 0;
+    radix_tree_write_end(root);
 }
 
 int
@@ -163,44 +260,77 @@ radix_tree_empty(struct radix_tree_root *root)
 }
 
 void*
-radix_tree_lookup(struct radix_tree_root *root, int index)
+radix_tree_lookup(struct radix_tree_root *root, offset_t index)
 {
-    struct radix_tree_node *node;
     kassert(root);
-    if (index > radix_tree_max_index(root)) {
+    return radix_tree_lookup_sync(root, index, RADIX_TREE_ANY);
+}
+
+static void*
+radix_tree_lookup_sync(struct radix_tree_root *root, offset_t index, int tag)
+{
+    uint32_t seq;
+    void *leaf;
+
+    __sync_add_and_fetch(&root->readers, 1);
+    do {
+        // wait out a writer in progress
+        while ((seq = __atomic_load_n(&root->seq, __ATOMIC_ACQUIRE)) & 1) {
+        }
+        leaf = radix_tree_lookup_internal(root, index, tag);
+        __sync_synchronize();
+    } while (__atomic_load_n(&root->seq, __ATOMIC_ACQUIRE) != seq);
+    __sync_sub_and_fetch(&root->readers, 1);
+    return leaf;
+}
+
+static void*
+radix_tree_lookup_internal(struct radix_tree_root *root, offset_t index, int tag)
+{
+    struct radix_tree_node *node;
+    int i = radix_tree_leaf_index(index);
+
+    if (!radix_tree_fits(root, index)) {
         return NULL;
     }
     if ((node = radix_tree_find_parent(root, index, False)) == NULL) {
         return NULL;
     }
-    return node->slots[radix_tree_leaf_index(index)];
+    if (tag != RADIX_TREE_ANY && (node->tags[tag] & ((uint64_t)1 << i)) == 0) {
+        return NULL;
+    }
+    return node->slots[i];
 }
 
 err_t
-radix_tree_insert(struct radix_tree_root *root, int index, void *leaf)
+radix_tree_insert(struct radix_tree_root *root, offset_t index, void *leaf)
 {
     struct radix_tree_node *node;
+    err_t err = ERR_OK;
 
     kassert(root);
     kassert(leaf);
+    radix_tree_write_begin(root);
     // First make sure the tree has enough levels for the leaf node
-    while (index > radix_tree_max_index(root)) {
+    while (!radix_tree_fits(root, index)) {
         if (radix_tree_add_level(root) != ERR_OK) {
-            return ERR_RADIX_TREE_ALLOC;
+            err = ERR_RADIX_TREE_ALLOC;
+            goto done;
         }
     }
     // Find the parent node and insert the leaf node
     if ((node = radix_tree_find_parent(root, index, True)) == NULL) {
-        return ERR_RADIX_TREE_ALLOC;
+        err = ERR_RADIX_TREE_ALLOC;
+    } else if (radix_tree_add_child(node, radix_tree_leaf_index(index), leaf, False) != ERR_OK) {
+        err = ERR_RADIX_TREE_NODE_EXIST;
     }
-    if (radix_tree_add_child(node, radix_tree_leaf_index(index), leaf, False) != ERR_OK) {
-        return ERR_RADIX_TREE_NODE_EXIST;
-    }
-    return ERR_OK;
+done:
+    radix_tree_write_end(root);
+    return err;
 }
 
 void*
-radix_tree_remove(struct radix_tree_root *root, int index)
+radix_tree_remove(struct radix_tree_root *root, offset_t index)
 {
     int level, level_index;
     struct radix_tree_node *node, *parent;
@@ -208,12 +338,17 @@ radix_tree_remove(struct radix_tree_root *root, int index)
 
     kassert(root);
     // Find the leaf node
-    if ((node = radix_tree_find_parent(root, index, False)) == NULL) {
+    if (!radix_tree_fits(root, index) ||
+        (node = radix_tree_find_parent(root, index, False)) == NULL) {
         return NULL;
     }
     if ((leaf = node->slots[radix_tree_leaf_index(index)]) == NULL) {
         return NULL;
     }
+    for (int tag = 0; tag < RADIX_TREE_MAX_TAGS; tag++) {
+        radix_tree_tag_clear(root, index, tag);
+    }
+    radix_tree_write_begin(root);
     // Remove empty nodes in the tree
     for (level = 0; level < root->height; level++, node = parent) {
         level_index = radix_tree_level_index(index, level);
@@ -224,9 +359,9 @@ radix_tree_remove(struct radix_tree_root *root, int index)
         node->slots[level_index] = NULL;
         if (node->count == 0) {
             parent = node->parent;
-            kmem_cache_free(node_allocator, node);
+            radix_tree_node_retire(root, node);
         } else {
-            return leaf;
+            goto done;
         }
     }
     // If we have not returned yet, the root node has been freed. Update root
@@ -234,5 +369,190 @@ radix_tree_remove(struct radix_tree_root *root, int index)
     kassert(node == NULL);
     root->root_node = NULL;
     root->height = 0;
+done:
+    radix_tree_write_end(root);
     return leaf;
 }
+
+void*
+radix_tree_replace(struct radix_tree_root *root, offset_t index, void *leaf)
+{
+    struct radix_tree_node *node;
+    void *old;
+    int i = radix_tree_leaf_index(index);
+
+    kassert(root);
+    kassert(leaf);
+    if (!radix_tree_fits(root, index) ||
+        (node = radix_tree_find_parent(root, index, False)) == NULL ||
+        (old = node->slots[i]) == NULL) {
+        return NULL;
+    }
+    // a single pointer store, no need to make lookups retry
+    __atomic_store_n(&node->slots[i], leaf, __ATOMIC_RELEASE);
+    return old;
+}
+
+size_t
+radix_tree_gang_lookup(struct radix_tree_root *root, void **results, offset_t first, size_t max)
+{
+    return radix_tree_gang_lookup_tag(root, results, first, max, RADIX_TREE_ANY);
+}
+
+size_t
+radix_tree_gang_lookup_tag(struct radix_tree_root *root, void **results, offset_t first,
+                           size_t max, int tag)
+{
+    size_t n;
+
+    kassert(root);
+    kassert(results);
+    kassert(tag == RADIX_TREE_ANY || (tag >= 0 && tag < RADIX_TREE_MAX_TAGS));
+    for (n = 0; n < max && (results[n] = radix_tree_find_next(root, &first, tag)) != NULL; n++) {
+        // the last possible index has nothing after it
+        if (++first == 0) {
+            return n + 1;
+        }
+    }
+    return n;
+}
+
+void
+radix_tree_iter_init(struct radix_tree_iter *iter, offset_t start, offset_t end, int tag)
+{
+    kassert(iter);
+    kassert(tag == RADIX_TREE_ANY || (tag >= 0 && tag < RADIX_TREE_MAX_TAGS));
+    iter->index = start;
+    iter->next = start;
+    iter->end = end;
+    iter->tag = tag;
+}
+
+void*
+radix_tree_iter_next(struct radix_tree_root *root, struct radix_tree_iter *iter)
+{
+    offset_t index = iter->next;
+    void *leaf;
+
+    kassert(root);
+    if (index >= iter->end ||
+        (leaf = radix_tree_find_next(root, &index, iter->tag)) == NULL || index >= iter->end) {
+        iter->next = iter->end;
+        return NULL;
+    }
+    iter->index = index;
+    // the last possible index ends the iteration
+    iter->next = index + 1 == 0 ? iter->end : index + 1;
+    return leaf;
+}
+
+void*
+radix_tree_tag_set(struct radix_tree_root *root, offset_t index, int tag)
+{
+    struct radix_tree_node *node;
+    int level, level_index;
+    void *leaf;
+
+    kassert(root);
+    kassert(tag >= 0 && tag < RADIX_TREE_MAX_TAGS);
+    if ((leaf = radix_tree_lookup_internal(root, index, RADIX_TREE_ANY)) == NULL) {
+        return NULL;
+    }
+    // tag the whole path down to the leaf
+    for (level = root->height - 1, node = root->root_node; level >= 0; level--) {
+        level_index = radix_tree_level_index(index, level);
+        node->tags[tag] |= (uint64_t)1 << level_index;
+        node = node->slots[level_index];
+    }
+    return leaf;
+}
+
+void*
+radix_tree_tag_clear(struct radix_tree_root *root, offset_t index, int tag)
+{
+    struct radix_tree_node *node;
+    int level;
+    void *leaf;
+
+    kassert(root);
+    kassert(tag >= 0 && tag < RADIX_TREE_MAX_TAGS);
+    if ((leaf = radix_tree_lookup_internal(root, index, RADIX_TREE_ANY)) == NULL) {
+        return NULL;
+    }
+    // untag upwards until a node still has other tagged slots
+    node = radix_tree_find_parent(root, index, False);
+    for (level = 0; node != NULL; level++, node = node->parent) {
+        node->tags[tag] &= ~((uint64_t)1 << radix_tree_level_index(index, level));
+        if (node->tags[tag] != 0) {
+            break;
+        }
+    }
+    return leaf;
+}
+
+int
+radix_tree_tag_get(struct radix_tree_root *root, offset_t index, int tag)
+{
+    kassert(root);
+    kassert(tag >= 0 && tag < RADIX_TREE_MAX_TAGS);
+    return radix_tree_lookup_sync(root, index, tag) != NULL;
+}
+
+int
+radix_tree_tagged(struct radix_tree_root *root, int tag)
+{
+    kassert(root);
+    kassert(tag >= 0 && tag < RADIX_TREE_MAX_TAGS);
+    return root->root_node != NULL && root->root_node->tags[tag] != 0;
+}
+
+static int
+radix_tree_next_slot(struct radix_tree_node *node, int i, int tag)
+{
+    uint64_t bits;
+
+    if (tag != RADIX_TREE_ANY) {
+        bits = node->tags[tag] & (~(uint64_t)0 << i);
+        return bits == 0 ? RADIX_TREE_WIDTH : __builtin_ctzll(bits);
+    }
+    while (i < RADIX_TREE_WIDTH && node->slots[i] == NULL) {
+        i++;
+    }
+    return i;
+}
+
+static void*
+radix_tree_find_next(struct radix_tree_root *root, offset_t *index, int tag)
+{
+    struct radix_tree_node *node;
+    offset_t cur = *index;
+    int level, i;
+
+    if (!radix_tree_fits(root, cur)) {
+        return NULL;
+    }
+restart:
+    for (level = root->height - 1, node = root->root_node; ; level--) {
+        i = radix_tree_next_slot(node, radix_tree_level_index(cur, level), tag);
+        if (i == RADIX_TREE_WIDTH) {
+            // nothing left in this node, continue after the subtree it covers
+            if (level == root->height - 1) {
+                return NULL;
+            }
+            cur = (cur | radix_tree_slot_mask(level + 1)) + 1;
+            if (cur == 0 || !radix_tree_fits(root, cur)) {
+                return NULL;
+            }
+            goto restart;
+        }
+        if (i != radix_tree_level_index(cur, level)) {
+            // skipped ahead, start at the beginning of slot i
+            cur = (cur & ~radix_tree_slot_mask(level + 1)) | ((offset_t)i << (level * RADIX_TREE_WIDTH_POWER));
+        }
+        if (level == 0) {
+            *index = cur;
+            return node->slots[i];
+        }
+        node = node->slots[i];
+    }
+}
@@ -3,6 +3,7 @@
 #include <kernel/console.h>
 #include <kernel/thread.h>
 #include <kernel/sched.h>
+#include <kernel/vpmap.h>
 #include <lib/errcode.h>
 #include <lib/stddef.h>
 
@@ -37,7 +38,10 @@ spinlock_acquire(struct spinlock* lock)
         panic("MEH");
     }
     kassert(lock->holder == NULL || lock->holder != curr);
-    while (lock->lock_status || __sync_lock_test_and_set(&lock->lock_status, 1) != 0);
+    while (lock->lock_status || __sync_lock_test_and_set(&lock->lock_status, 1) != 0) {
+        // the holder may be waiting for this cpu to flush its TLB
+        vpmap_shootdown_poll();
+    }
     __sync_synchronize();
     lock->holder = curr;
 }
@@ -100,6 +104,24 @@ sleeplock_acquire(struct sleeplock* lock)
     spinlock_release(&lock->lk);
 }
 
+err_t
+sleeplock_try_acquire(struct sleeplock* lock)
+{
+    err_t err = ERR_LOCK_BUSY;
+
+    if (!synch_enabled) {
+        return ERR_OK;
+    }
+    kassert(lock);
+    spinlock_acquire(&lock->lk);
+    if (lock->holder == NULL) {
+        lock->holder = thread_current();
+        err = ERR_OK;
+    }
+    spinlock_release(&lock->lk);
+    return err;
+}
+
 void
 sleeplock_release(struct sleeplock* lock)
 {
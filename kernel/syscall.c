@@ -13,9 +13,12 @@
 #include <arch/asm.h>
 #include <kernel/pipe.h>
 #include <kernel/shmms.h>
+#include <kernel/filems.h>
+#include <kernel/pmem.h>
 // syscall handlers
 static sysret_t sys_fork(void* arg);
 static sysret_t sys_spawn(void* arg);
+static sysret_t sys_spawnfa(void* arg);
 static sysret_t sys_wait(void* arg);
 static sysret_t sys_exit(void* arg);
 static sysret_t sys_getpid(void* arg);
@@ -43,10 +46,38 @@ static sysret_t sys_createMapping(void* arg);
 static sysret_t sys_destroyMapping(void* arg);
 static sysret_t sys_lockSharedRegion(void* arg);
 static sysret_t sys_unlockSharedRegion(void* arg);
+static sysret_t sys_waitSharedRegion(void* arg);
+static sysret_t sys_wakeSharedRegion(void* arg);
+static sysret_t sys_resizeSharedRegion(void* arg);
+static sysret_t sys_mmap(void* arg);
+static sysret_t sys_munmap(void* arg);
+static sysret_t sys_slabinfo(void* arg);
 
 extern size_t user_pgfault;
 struct sys_info {
     size_t num_pgfault;
+    size_t free_pages;
+    size_t free_blocks[PMEM_MAX_ORDER + 1];
+    int largest_free_order;
+};
+
+#define SLAB_NAME_LEN 24
+struct slab_info {
+    char name[SLAB_NAME_LEN];
+    size_t obj_size;
+    size_t allocs;
+    size_t frees;
+    size_t in_use;
+    size_t peak;
+    size_t total;
+    size_t slabs_full;
+    size_t slabs_partial;
+    size_t slabs_free;
+    size_t pages;
+    size_t alloc_hits;
+    size_t alloc_misses;
+    size_t free_hits;
+    size_t free_misses;
 };
 
 /*
@@ -67,6 +98,7 @@ static int alloc_fd();
 static sysret_t (*syscalls[])(void*) = {
     [SYS_fork] = sys_fork,
     [SYS_spawn] = sys_spawn,
+    [SYS_spawnfa] = sys_spawnfa,
     [SYS_wait] = sys_wait,
     [SYS_exit] = sys_exit,
     [SYS_getpid] = sys_getpid,
@@ -94,6 +126,12 @@ static sysret_t (*syscalls[])(void*) = {
     [SYS_unmap] = sys_destroyMapping,
     [SYS_lockSharedRegion] = sys_lockSharedRegion,
     [SYS_unlockSharedRegion] = sys_unlockSharedRegion,
+    [SYS_waitSharedRegion] = sys_waitSharedRegion,
+    [SYS_wakeSharedRegion] = sys_wakeSharedRegion,
+    [SYS_resizeSharedRegion] = sys_resizeSharedRegion,
+    [SYS_mmap] = sys_mmap,
+    [SYS_munmap] = sys_munmap,
+    [SYS_slabinfo] = sys_slabinfo,
 };
 /*
  *
@@ -167,46 +205,91 @@ sys_fork(void *arg)
     return p->pid;
 }
 
-// int spawn(const char *args);
-static sysret_t
-sys_spawn(void *arg)
+/*
+ * Split a copy of user string args at spaces into a NULL terminated argv for
+ * proc_spawn. The caller frees *buf and *argv.
+ */
+static err_t
+spawn_args(sysarg_t args, char **buf, char ***argv)
 {
     int argc = 0;
-    sysarg_t args;
     size_t len;
-    char *token, *buf, **argv;
-    struct proc *p;
-    err_t err;
+    char *token, *rest;
 
-    // argument fetching and validating
-    kassert(fetch_arg(arg, 1, &args));
     if (!validate_str((char*)args)) {
         return ERR_FAULT;
     }
 
     len = strlen((char*)args) + 1;
-    if ((buf = kmalloc(len)) == NULL) {
+    if ((*buf = kmalloc(len)) == NULL) {
         return ERR_NOMEM;
     }
     // make a copy of the string to not modify user data
-    memcpy(buf, (void*)args, len);
+    memcpy(*buf, (void*)args, len);
     // figure out max number of arguments possible
     len = len / 2 < PROC_MAX_ARG ? len/2 : PROC_MAX_ARG;
-    if ((argv = kmalloc((len+1)*sizeof(char*))) == NULL) {
-        kfree(buf);
+    if ((*argv = kmalloc((len+1)*sizeof(char*))) == NULL) {
+        kfree(*buf);
         return ERR_NOMEM;
     }
-    // parse arguments  
-    while ((token = strtok_r(NULL, " ", &buf)) != NULL) {
-        argv[argc] = token;
+    // parse arguments
+    rest = *buf;
+    while ((token = strtok_r(NULL, " ", &rest)) != NULL) {
+        (*argv)[argc] = token;
         argc++;
     }
-    argv[argc] = NULL;
+    (*argv)[argc] = NULL;
+    return ERR_OK;
+}
 
-    if ((err = proc_spawn(argv[0], argv, &p)) != ERR_OK) {
+// int spawn(const char *args);
+static sysret_t
+sys_spawn(void *arg)
+{
+    sysarg_t args;
+    char *buf, **argv;
+    struct proc *p;
+    err_t err;
+
+    // argument fetching and validating
+    kassert(fetch_arg(arg, 1, &args));
+    if ((err = spawn_args(args, &buf, &argv)) != ERR_OK) {
         return err;
     }
-    return p->pid;
+    err = proc_spawn(argv[0], argv, &p);
+    kfree(argv);
+    kfree(buf);
+    return err == ERR_OK ? p->pid : err;
+}
+
+// int spawnfa(const char *args, const struct spawn_action *actions, int n);
+static sysret_t
+sys_spawnfa(void *arg)
+{
+    sysarg_t args, actions, n;
+    struct spawn_action kactions[SPAWN_MAX_ACTIONS];
+    char *buf, **argv;
+    struct proc *p;
+    err_t err;
+
+    kassert(fetch_arg(arg, 1, &args));
+    kassert(fetch_arg(arg, 2, &actions));
+    kassert(fetch_arg(arg, 3, &n));
+    if ((int)n < 0 || (int)n > SPAWN_MAX_ACTIONS) {
+        return ERR_INVAL;
+    }
+    if ((int)n > 0 && !validate_bufptr((void*)actions, (int)n * sizeof(struct spawn_action))) {
+        return ERR_FAULT;
+    }
+    // the process can't change the actions once they are checked
+    memcpy(kactions, (void*)actions, (int)n * sizeof(struct spawn_action));
+    if ((err = spawn_args(args, &buf, &argv)) != ERR_OK) {
+        return err;
+    }
+    err = proc_spawn_actions(argv[0], argv, kactions, (int)n, &p);
+    kfree(argv);
+    kfree(buf);
+    return err == ERR_OK ? p->pid : err;
 }
 
 // int wait(int pid, int *wstatus);
@@ -290,7 +373,7 @@ sys_close(void *arg)
     }
     // Lab 2 addition
     // This check would be better suited in fs_close_file but need access to fd
-    kpipe_ref_decrease(process->files[(int)fd], (int)fd);
+    kpipe_ref_decrease(process->files[(int)fd]);
     fs_close_file(process->files[(int)fd]);
 
     //
@@ -532,7 +615,7 @@ sys_dup(void *arg)
         return ERR_NOMEM;
     }
     // Lab 2 addition
-    kpipe_ref_increase(process->files[(int)fd], (int)fd);
+    kpipe_ref_increase(process->files[(int)fd]);
 
     process->files[i] = process->files[(int)fd];
     fs_reopen_file(process->files[(int)fd]);
@@ -626,6 +709,11 @@ sys_info(void* arg)
     }
     // fill in using user_pgfault 
     ((struct sys_info*)info)->num_pgfault = user_pgfault;
+    struct pmem_stats stats;
+    pmem_get_stats(&stats);
+    ((struct sys_info*)info)->free_pages = stats.free_pages;
+    memcpy(((struct sys_info*)info)->free_blocks, stats.free_blocks, sizeof(stats.free_blocks));
+    ((struct sys_info*)info)->largest_free_order = stats.largest_order;
     return ERR_OK;
 }
 
@@ -650,7 +738,8 @@ sys_createSharedRegion(void* arg)
     }
     kassert(fetch_arg(arg, 2, &size));
     kassert(fetch_arg(arg, 3, &flag));
-    size = pg_round_up(size);
+    // kernel sizes regions in pages
+    size = pg_round_up(size) / pg_size;
     return createSharedRegion((char*)name, size, flag);
 }
 
@@ -668,7 +757,7 @@ sys_destroySharedRegion(void* arg)
 static sysret_t 
 sys_createMapping(void* arg)
 {
-    sysarg_t name, reg_beg;
+    sysarg_t name, reg_beg, flag;
     kassert(fetch_arg(arg, 1, &name));
     if (!validate_str((char*)name)) {
         return ERR_FAULT;
@@ -677,9 +766,13 @@ sys_createMapping(void* arg)
     if (!validate_bufptr((void*)reg_beg, sizeof(void*))) {
         return ERR_FAULT;
     }
+    kassert(fetch_arg(arg, 3, &flag));
+    if ((int)flag & ~MAP_POPULATE) {
+        return ERR_INVAL;
+    }
     // make sure user isn't sneaking in an address
     *((vaddr_t*)reg_beg) = NULL;
-    return createMapping((char*)name, (vaddr_t*)reg_beg, &proc_current()->as);
+    return createMapping((char*)name, (vaddr_t*)reg_beg, (map_flag)flag, &proc_current()->as);
 }
 
 static sysret_t 
@@ -721,6 +814,164 @@ sys_unlockSharedRegion(void* arg)
     return unlockRegion((char*)name, &proc_current()->as);
 }
 
+static sysret_t
+sys_waitSharedRegion(void* arg)
+{
+    sysarg_t addr, val;
+    kassert(fetch_arg(arg, 1, &addr));
+    kassert(fetch_arg(arg, 2, &val));
+    if (!validate_bufptr((void*)addr, sizeof(int))) {
+        return ERR_FAULT;
+    }
+    return waitRegion((vaddr_t)addr, (int)val, &proc_current()->as);
+}
+
+static sysret_t
+sys_wakeSharedRegion(void* arg)
+{
+    sysarg_t addr, n;
+    kassert(fetch_arg(arg, 1, &addr));
+    kassert(fetch_arg(arg, 2, &n));
+    if (!validate_bufptr((void*)addr, sizeof(int))) {
+        return ERR_FAULT;
+    }
+    return wakeRegion((vaddr_t)addr, (int)n, &proc_current()->as);
+}
+
+static sysret_t
+sys_resizeSharedRegion(void* arg)
+{
+    sysarg_t name, size, reg_beg;
+    kassert(fetch_arg(arg, 1, &name));
+    if (!validate_str((char*)name)) {
+        return ERR_FAULT;
+    }
+    kassert(fetch_arg(arg, 2, &size));
+    if ((int)size <= 0) {
+        return ERR_INVAL;
+    }
+    kassert(fetch_arg(arg, 3, &reg_beg));
+    if (reg_beg != NULL && !validate_bufptr((void*)reg_beg, sizeof(void*))) {
+        return ERR_FAULT;
+    }
+    return resizeRegion((char*)name, pg_round_up((int)size) / pg_size, (vaddr_t*)reg_beg, &proc_current()->as);
+}
+
+// void *mmap(int fd, int offset, int len, int prot, int flags);
+static sysret_t
+sys_mmap(void* arg)
+{
+    sysarg_t fd, offset, len, prot, flags;
+    struct proc *p = proc_current();
+    struct file *file;
+    int mode, shared;
+    vaddr_t addr;
+    err_t err;
+
+    kassert(fetch_arg(arg, 1, &fd));
+    kassert(fetch_arg(arg, 2, &offset));
+    kassert(fetch_arg(arg, 3, &len));
+    kassert(fetch_arg(arg, 4, &prot));
+    kassert(fetch_arg(arg, 5, &flags));
+
+    if (!validate_fd((int)fd, p)) {
+        return ERR_INVAL;
+    }
+    file = p->files[(int)fd];
+    if (file->f_inode == NULL || file->f_inode->i_ftype != FTYPE_FILE) {
+        return ERR_INVAL;
+    }
+    if ((int)offset < 0 || (int)offset % pg_size != 0 || (int)len <= 0) {
+        return ERR_INVAL;
+    }
+    if ((int)prot & ~(PROT_READ | PROT_WRITE) || !((int)prot & PROT_READ)) {
+        return ERR_INVAL;
+    }
+    if ((int)flags != MAP_SHARED && (int)flags != MAP_PRIVATE) {
+        return ERR_INVAL;
+    }
+    shared = (int)flags == MAP_SHARED;
+    // the mapping needs read access, and a shared writable one write access too
+    mode = file->oflag & (FS_WRONLY | FS_RDWR);
+    if (mode == FS_WRONLY || (shared && ((int)prot & PROT_WRITE) && mode != FS_RDWR)) {
+        return ERR_INVAL;
+    }
+    if ((err = filems_mmap(file, (offset_t)offset, (size_t)len,
+                           ((int)prot & PROT_WRITE) ? MEMPERM_URW : MEMPERM_UR,
+                           shared, &p->as, &addr)) != ERR_OK) {
+        return err;
+    }
+    return (sysret_t)addr;
+}
+
+// int munmap(void *addr);
+static sysret_t
+sys_munmap(void* arg)
+{
+    sysarg_t addr;
+    struct memregion *mr;
+
+    kassert(fetch_arg(arg, 1, &addr));
+    if ((mr = as_find_memregion(&proc_current()->as, (vaddr_t)addr, 1)) == NULL || mr->file == NULL) {
+        return ERR_INVAL;
+    }
+    memregion_unmap(mr);
+    return ERR_OK;
+}
+
+// int slabinfo(struct slab_info *info, int n);
+static sysret_t
+sys_slabinfo(void* arg)
+{
+    sysarg_t info, n;
+    struct kmem_cache_stats *stats = NULL;
+    struct slab_info *si;
+    size_t i, count;
+
+    kassert(fetch_arg(arg, 1, &info));
+    kassert(fetch_arg(arg, 2, &n));
+    if ((int)n < 0) {
+        return ERR_INVAL;
+    }
+    if ((int)n > 0 && !validate_bufptr((void*)info, (int)n * sizeof(struct slab_info))) {
+        return ERR_FAULT;
+    }
+    // no more entries than there are allocators are ever filled
+    count = kmem_cache_get_all_stats(NULL, 0);
+    if ((size_t)(int)n < count) {
+        count = (int)n;
+    }
+    if (count > 0 && (stats = kmalloc(count * sizeof(struct kmem_cache_stats))) == NULL) {
+        return ERR_NOMEM;
+    }
+    // stats are gathered under the allocator locks, user memory is only
+    // written once they are dropped
+    n = kmem_cache_get_all_stats(stats, count);
+    for (i = 0; i < count; i++) {
+        si = (struct slab_info*)info + i;
+        strncpy(si->name, stats[i].name, SLAB_NAME_LEN - 1);
+        si->name[SLAB_NAME_LEN - 1] = '\0';
+        si->obj_size = stats[i].obj_size;
+        si->allocs = stats[i].allocs;
+        si->frees = stats[i].frees;
+        si->in_use = stats[i].in_use;
+        si->peak = stats[i].peak;
+        si->total = stats[i].total;
+        si->slabs_full = stats[i].slabs_full;
+        si->slabs_partial = stats[i].slabs_partial;
+        si->slabs_free = stats[i].slabs_free;
+        si->pages = stats[i].pages;
+        si->alloc_hits = stats[i].alloc_hits;
+        si->alloc_misses = stats[i].alloc_misses;
+        si->free_hits = stats[i].free_hits;
+        si->free_misses = stats[i].free_misses;
+    }
+    if (stats != NULL) {
+        kfree(stats);
+    }
+    return n;
+}
+
 sysret_t
 syscall(int num, void *arg)
 {
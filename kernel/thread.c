@@ -21,7 +21,7 @@ void thread_sys_init(void)
 {
     sched_sys_init();
 
-    thread_allocator = kmem_cache_create(sizeof(struct thread));
+    thread_allocator = kmem_cache_create("thread", sizeof(struct thread));
     kassert(thread_allocator);
     spinlock_init(&tid_lock, False);
     // initialize idle thread and starts interrupt
@@ -63,6 +63,7 @@ thread_create(const char *name, struct proc *p, int priority)
     t->name[slen] = 0;
     t->proc = p;
     t->priority = priority;
+    memset(t->mr_cache, 0, sizeof(t->mr_cache));
 
     // allocate a trapframe for thread at top of kstack
     t->tf = (void*) (vaddr + pg_size - sizeof(*t->tf)); 
@@ -10,6 +10,10 @@
 static uint32_t ticks;
 static struct spinlock timer_lock;
 
+// Called every periodic_ticks ticks if set
+static uint32_t periodic_ticks;
+static void (*periodic_fn)(void);
+
 /*
  * timer trap handler
  */
@@ -18,10 +22,18 @@ static void timer_trap_handler(irq_t irq, void *dev, void *regs);
 static void
 timer_trap_handler(irq_t irq, void *dev, void *regs)
 {
+    void (*fn)(void) = NULL;
+
     // Increment timer ticks
     spinlock_acquire(&timer_lock);
     ticks++;
+    if (periodic_fn != NULL && ticks % periodic_ticks == 0) {
+        fn = periodic_fn;
+    }
     spinlock_release(&timer_lock);
+    if (fn != NULL) {
+        fn();
+    }
     trap_notify_irq_completion();
     sched_sched(READY, NULL);
 }
@@ -32,3 +44,13 @@ err_t timer_register_trap_handler(void)
     spinlock_init(&timer_lock, True);
     return trap_register_handler(T_IRQ_TIMER, NULL, timer_trap_handler);
 }
+
+void
+timer_register_periodic(uint32_t period, void (*fn)(void))
+{
+    kassert(period > 0);
+    spinlock_acquire(&timer_lock);
+    periodic_ticks = period;
+    periodic_fn = fn;
+    spinlock_release(&timer_lock);
+}
@@ -24,12 +24,13 @@ static struct kmem_cache *entry_allocator;
  */
 extern err_t syscall_register_trap_handler(void);
 extern err_t pgfault_register_trap_handler(void);
+extern err_t vpmap_register_trap_handler(void);
 
 void
 trap_sys_init(void)
 {
     radix_tree_construct(&trap_handler_table);
-    if ((entry_allocator = kmem_cache_create(sizeof(struct table_entry))) == NULL) {
+    if ((entry_allocator = kmem_cache_create("trap_entry", sizeof(struct table_entry))) == NULL) {
         panic("Failed to create trap handler table entry allocator\n");
     }
     spinlock_init(&table_lock, True);
@@ -43,6 +44,9 @@ trap_sys_init(void)
     if (pgfault_register_trap_handler() != ERR_OK) {
         goto fail;
     }
+    if (vpmap_register_trap_handler() != ERR_OK) {
+        goto fail;
+    }
     return;
 fail:
     panic("Failed to register trap handlers\n");
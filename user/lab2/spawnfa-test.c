@@ -0,0 +1,71 @@
+#include <lib/test.h>
+#include <lib/string.h>
+
+#define EXPECTED "spawnfa works\n"
+
+/*
+    Test that spawnfa redirects the child's stdout into a pipe, and rejects
+    malformed file actions
+*/
+int
+main()
+{
+    char buf[64];
+    int fds[2], pid, ret, status, n, total;
+    struct spawn_action actions[2];
+
+    if ((ret = pipe(fds)) != ERR_OK) {
+        error("spawnfa-test: pipe() failed, return value was %d", ret);
+    }
+
+    // bad actions are refused before any process is created
+    actions[0].op = SPAWN_DUP2;
+    actions[0].fd = 100;
+    actions[0].newfd = 1;
+    if ((ret = spawnfa("echo spawnfa works", actions, 1)) != ERR_INVAL) {
+        error("spawnfa-test: dup2 of an unopened fd returned %d", ret);
+    }
+    actions[0].op = 0;
+    actions[0].fd = fds[1];
+    if ((ret = spawnfa("echo spawnfa works", actions, 1)) != ERR_INVAL) {
+        error("spawnfa-test: unknown op returned %d", ret);
+    }
+    if ((ret = spawnfa("echo spawnfa works", actions, -1)) != ERR_INVAL) {
+        error("spawnfa-test: negative count returned %d", ret);
+    }
+    if ((ret = spawnfa("echo spawnfa works", (struct spawn_action*) 0xffffffffffff0000, 1)) != ERR_FAULT) {
+        error("spawnfa-test: bad actions pointer returned %d", ret);
+    }
+
+    // child writes to the pipe as its stdout, and doesn't get the read end
+    actions[0].op = SPAWN_DUP2;
+    actions[0].fd = fds[1];
+    actions[0].newfd = 1;
+    actions[1].op = SPAWN_CLOSE;
+    actions[1].fd = 0;
+    if ((pid = spawnfa("echo spawnfa works", actions, 2)) < 0) {
+        error("spawnfa-test: spawnfa() failed, return value was %d", pid);
+    }
+    if ((ret = close(fds[1])) != ERR_OK) {
+        error("spawnfa-test: failed to close write end, return value was %d", ret);
+    }
+
+    // the child's exit closes the last write end
+    total = 0;
+    while ((n = read(fds[0], buf + total, sizeof(buf) - 1 - total)) > 0) {
+        total += n;
+    }
+    buf[total] = '\0';
+    if (strcmp(buf, EXPECTED) != 0) {
+        error("spawnfa-test: read '%s' from the child", buf);
+    }
+    if ((ret = wait(pid, &status)) != pid || status != 3) {
+        error("spawnfa-test: wait returned %d with status %d", ret, status);
+    }
+    if ((ret = close(fds[0])) != ERR_OK) {
+        error("spawnfa-test: failed to close read end, return value was %d", ret);
+    }
+    pass("spawnfa-test");
+    exit(0);
+    return 0;
+}
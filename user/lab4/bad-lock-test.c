@@ -21,7 +21,7 @@ int main()
     if ((errno = lockSharedRegion(name)) != ERR_NOTEXIST) {
         error("Locking a region that has not been mapped");
     }
-    if ((errno = map(name, (void**)&addr)) != ERR_OK) {
+    if ((errno = map(name, (void**)&addr, MAP_DEFAULT)) != ERR_OK) {
         error("Failed to create region");
     }
     if ((errno = lockSharedRegion(name)) != ERR_OK) {
@@ -16,10 +16,10 @@ int main()
     if ((errno = createSharedRegion(name, 512, RS_DEFAULT)) != ERR_OK) {
         error("failed to create region");
     }
-    if ((errno = map(name, (void**)&addr)) != ERR_OK) {
+    if ((errno = map(name, (void**)&addr, MAP_DEFAULT)) != ERR_OK) {
         error("failed to map to region");
     }
-    if ((errno = map(name, (void**)&addr1)) != ERR_OK) {
+    if ((errno = map(name, (void**)&addr1, MAP_DEFAULT)) != ERR_OK) {
         error("failed to map second region");
     }
 
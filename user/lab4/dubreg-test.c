@@ -19,7 +19,7 @@ int main()
         error("created same shared region twice");
     }
     // try mapping then doing this
-    if ((errno = map(name, (void**)&addr)) != ERR_OK) {
+    if ((errno = map(name, (void**)&addr, MAP_DEFAULT)) != ERR_OK) {
         error("failed to map to region");
     }
     if ((errno = createSharedRegion(name, 512, RS_DEFAULT)) == ERR_OK) {
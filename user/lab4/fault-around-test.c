@@ -0,0 +1,90 @@
+#include <lib/usyscall.h>
+#include <lib/stdio.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+#include <lib/test.h>
+
+/*
+    Test that faulting on a region whose pages are already cached maps
+    the neighbouring pages as well, unless the region turns that off
+*/
+int main()
+{
+    char* name = "Neighbours first";
+    int errno = 0;
+    int pages = 16;
+    char* writer = NULL;
+    char* reader = NULL;
+    struct sys_info before, after;
+
+    if ((errno = createSharedRegion(name, pages * 4096, RS_DEFAULT)) != ERR_OK) {
+        error("Failed to create shared region");
+    }
+    if ((errno = map(name, (void**)&writer, MAP_DEFAULT)) != ERR_OK) {
+        error("Failed to map writer, return is %d", errno);
+    }
+    if ((errno = map(name, (void**)&reader, MAP_DEFAULT)) != ERR_OK) {
+        error("Failed to map reader, return is %d", errno);
+    }
+
+    // bring every page into the page cache through the first mapping
+    for (int i = 0; i < pages; i++) {
+        writer[i * 4096] = (char)(i + 1);
+    }
+
+    info(&before);
+    for (int i = 0; i < pages; i++) {
+        if (reader[i * 4096] != (char)(i + 1)) {
+            error("Reader sees %d instead of %d on page %d", reader[i * 4096], i + 1, i);
+        }
+    }
+    info(&after);
+    // the window is aligned, so an unaligned mapping can straddle two windows
+    if (after.num_pgfault - before.num_pgfault > 2) {
+        error("Reading %d cached pages took %d page faults", pages,
+              (int)(after.num_pgfault - before.num_pgfault));
+    }
+
+    if ((errno = unmap(name, writer)) != ERR_OK) {
+        error("Failed to unmap writer");
+    }
+    if ((errno = unmap(name, reader)) != ERR_OK) {
+        error("Failed to unmap reader");
+    }
+    if ((errno = destroySharedRegion(name)) != ERR_OK) {
+        error("Failed to destroy shared region");
+    }
+
+    // order 0 windows map only the faulting page
+    name = "One at a time";
+    if ((errno = createSharedRegion(name, pages * 4096, RS_FAULT_AROUND(0))) != ERR_OK) {
+        error("Failed to create shared region without fault-around");
+    }
+    if ((errno = map(name, (void**)&writer, MAP_DEFAULT)) != ERR_OK) {
+        error("Failed to map writer, return is %d", errno);
+    }
+    if ((errno = map(name, (void**)&reader, MAP_DEFAULT)) != ERR_OK) {
+        error("Failed to map reader, return is %d", errno);
+    }
+    for (int i = 0; i < pages; i++) {
+        writer[i * 4096] = (char)(i + 1);
+    }
+    info(&before);
+    for (int i = 0; i < pages; i++) {
+        if (reader[i * 4096] != (char)(i + 1)) {
+            error("Reader sees %d instead of %d on page %d", reader[i * 4096], i + 1, i);
+        }
+    }
+    info(&after);
+    if (after.num_pgfault - before.num_pgfault < pages) {
+        error("Reading %d pages without fault-around took only %d page faults", pages,
+              (int)(after.num_pgfault - before.num_pgfault));
+    }
+    unmap(name, writer);
+    unmap(name, reader);
+    if ((errno = destroySharedRegion(name)) != ERR_OK) {
+        error("Failed to destroy shared region");
+    }
+    pass("fault-around-test");
+    exit(0);
+}
@@ -0,0 +1,51 @@
+#include <lib/usyscall.h>
+#include <lib/stdio.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+#include <lib/test.h>
+
+/*
+    Test that a huge page backed region is faulted in a huge page at a time
+*/
+int main()
+{
+    char* name = "Go big or go home";
+    int errno = 0;
+    int huge = 2 * 1024 * 1024;
+    char* addr = NULL;
+    struct sys_info before, after;
+
+    if ((errno = createSharedRegion(name, huge, RS_HUGE)) != ERR_OK) {
+        error("Failed to create huge shared region");
+    }
+    if ((errno = map(name, (void**)&addr, MAP_DEFAULT)) != ERR_OK) {
+        error("Failed to map huge shared region, return is %d", errno);
+    }
+    if ((vaddr_t)addr % huge != 0) {
+        error("Huge region mapped at unaligned address %p", addr);
+    }
+
+    info(&before);
+    for (int i = 0; i < huge; i += 4096) {
+        addr[i] = (char)(i / 4096);
+    }
+    info(&after);
+    if (after.num_pgfault - before.num_pgfault > 1) {
+        error("Touching one huge page took %d page faults",
+              (int)(after.num_pgfault - before.num_pgfault));
+    }
+    for (int i = 0; i < huge; i += 4096) {
+        if (addr[i] != (char)(i / 4096)) {
+            error("Huge region lost a write at offset %d", i);
+        }
+    }
+
+    if ((errno = unmap(name, addr)) != ERR_OK) {
+        error("Failed to unmap huge shared region");
+    }
+    if ((errno = destroySharedRegion(name)) != ERR_OK) {
+        error("Failed to destroy huge shared region");
+    }
+    pass("huge-region-test");
+    exit(0);
+}
@@ -25,7 +25,7 @@ int main()
     error("Failed to create shared region");
   }
 
-  if ((errno = map(name, (void**)&addr)) != ERR_OK) {
+  if ((errno = map(name, (void**)&addr, MAP_DEFAULT)) != ERR_OK) {
     error("Failed to map to shared region %d", errno);
   }
 
@@ -18,7 +18,7 @@ int main()
   createSharedRegion(name, 1, 0);
 
   // map
-  if ((errno = map(name, &addr)) != ERR_OK) {
+  if ((errno = map(name, &addr, MAP_DEFAULT)) != ERR_OK) {
     error("map failed with err: %d", errno);
   }
 
@@ -0,0 +1,82 @@
+#include <lib/usyscall.h>
+#include <lib/stdio.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+#include <lib/test.h>
+
+#define LEN (2 * 4096)
+
+static char buf[LEN];
+
+/*
+    Test that shared file mappings write back to the file on munmap and
+    private ones never do
+*/
+int main()
+{
+    char* path = "mmapfile";
+    int fd, errno;
+    char* addr;
+
+    if ((fd = open(path, FS_RDWR | FS_CREAT, EMPTY_MODE)) < 0) {
+        error("Failed to create %s", path);
+    }
+    for (int i = 0; i < LEN; i++) {
+        buf[i] = (char)(i % 251);
+    }
+    if (write(fd, buf, LEN) != LEN) {
+        error("Failed to fill %s", path);
+    }
+
+    if ((long)mmap(fd, 100, LEN, PROT_READ, MAP_SHARED) != ERR_INVAL) {
+        error("Mapping at an unaligned offset did not fail");
+    }
+    if ((long)mmap(fd, 0, LEN, PROT_READ, MAP_SHARED | MAP_PRIVATE) != ERR_INVAL) {
+        error("Mapping both shared and private did not fail");
+    }
+    if ((long)(addr = mmap(fd, 0, LEN, PROT_READ | PROT_WRITE, MAP_SHARED)) < 0) {
+        error("Failed to map %s shared, return is %d", path, (int)(long)addr);
+    }
+    for (int i = 0; i < LEN; i++) {
+        if (addr[i] != (char)(i % 251)) {
+            error("Shared mapping does not match the file at %d", i);
+        }
+        addr[i] = (char)(addr[i] + 1);
+    }
+    if ((errno = munmap(addr + 4096)) != ERR_OK) {
+        error("Failed to unmap shared mapping, return is %d", errno);
+    }
+    if ((errno = munmap(buf)) != ERR_INVAL) {
+        error("Unmapping a non-mmap address, return is %d", errno);
+    }
+
+    if ((long)(addr = mmap(fd, 0, LEN, PROT_READ | PROT_WRITE, MAP_PRIVATE)) < 0) {
+        error("Failed to map %s private, return is %d", path, (int)(long)addr);
+    }
+    for (int i = 0; i < LEN; i++) {
+        if (addr[i] != (char)(i % 251 + 1)) {
+            error("Shared mapping writes did not reach the file at %d", i);
+        }
+        addr[i] = 0;
+    }
+    if ((errno = munmap(addr)) != ERR_OK) {
+        error("Failed to unmap private mapping, return is %d", errno);
+    }
+    close(fd);
+
+    if ((fd = open(path, FS_RDONLY, EMPTY_MODE)) < 0) {
+        error("Failed to reopen %s", path);
+    }
+    if (read(fd, buf, LEN) != LEN) {
+        error("Failed to read back %s", path);
+    }
+    for (int i = 0; i < LEN; i++) {
+        if (buf[i] != (char)(i % 251 + 1)) {
+            error("File does not hold the shared writes only at %d", i);
+        }
+    }
+    close(fd);
+    unlink(path);
+    pass("mmap-test");
+    exit(0);
+}
@@ -12,7 +12,7 @@ int main()
     if ((errno = createSharedRegion(name, 512, RS_PERSIST)) != ERR_OK) {
         error("failed to create region");
     }
-    if ((errno = map(name, (void**)&addr)) != ERR_OK) {
+    if ((errno = map(name, (void**)&addr, MAP_DEFAULT)) != ERR_OK) {
         error("failed to map to region");
     }
     if ((errno = unmap(name, addr)) != ERR_OK) {
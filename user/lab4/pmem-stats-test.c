@@ -0,0 +1,48 @@
+#include <lib/usyscall.h>
+#include <lib/stdio.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+#include <lib/test.h>
+
+#define NPAGES 64
+
+/*
+    Test that info reports physical memory fragmentation consistently and sees
+    pages being allocated
+*/
+int main()
+{
+    struct sys_info before, after;
+    size_t buddy_pages = 0;
+    int largest = -1;
+    char* addr;
+
+    info(&before);
+    for (int i = 0; i <= PMEM_MAX_ORDER; i++) {
+        buddy_pages += before.free_blocks[i] << i;
+        if (before.free_blocks[i] > 0) {
+            largest = i;
+        }
+    }
+    if (largest != before.largest_free_order) {
+        error("Largest free order is %d, free blocks say %d", before.largest_free_order, largest);
+    }
+    if (buddy_pages > before.free_pages) {
+        error("Free blocks hold %d pages, more than the %d free pages",
+              (int)buddy_pages, (int)before.free_pages);
+    }
+
+    if ((long)(addr = sbrk(NPAGES * 4096)) < 0) {
+        error("Failed to grow the heap");
+    }
+    for (int i = 0; i < NPAGES; i++) {
+        addr[i * 4096] = 1;
+    }
+    info(&after);
+    if (after.free_pages + NPAGES > before.free_pages) {
+        error("Touching %d heap pages only took %d free pages", NPAGES,
+              (int)(before.free_pages - after.free_pages));
+    }
+    pass("pmem-stats-test");
+    exit(0);
+}
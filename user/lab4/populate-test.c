@@ -0,0 +1,49 @@
+#include <lib/usyscall.h>
+#include <lib/stdio.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+#include <lib/test.h>
+
+/*
+    Test that a MAP_POPULATE mapping can be touched without page faults
+*/
+int main()
+{
+    char* name = "Everything is already there";
+    int errno = 0;
+    int pages = 4;
+    char* addr = NULL;
+    struct sys_info before, after;
+
+    if ((errno = createSharedRegion(name, pages * 4096, RS_DEFAULT)) != ERR_OK) {
+        error("Failed to create shared region");
+    }
+    if ((errno = map(name, (void**)&addr, 0x80)) != ERR_INVAL) {
+        error("Mapping with an unknown flag, return is %d", errno);
+    }
+    if ((errno = map(name, (void**)&addr, MAP_POPULATE)) != ERR_OK) {
+        error("Failed to map shared region with MAP_POPULATE, return is %d", errno);
+    }
+
+    info(&before);
+    for (int i = 0; i < pages * 4096; i++) {
+        if (addr[i] != 0) {
+            error("Populated page is not zero filled at %d", i);
+        }
+        addr[i] = (char)i;
+    }
+    info(&after);
+    if (after.num_pgfault != before.num_pgfault) {
+        error("Touching a populated region took %d page faults",
+              (int)(after.num_pgfault - before.num_pgfault));
+    }
+
+    if ((errno = unmap(name, addr)) != ERR_OK) {
+        error("Failed to unmap shared region");
+    }
+    if ((errno = destroySharedRegion(name)) != ERR_OK) {
+        error("Failed to destroy shared region");
+    }
+    pass("populate-test");
+    exit(0);
+}
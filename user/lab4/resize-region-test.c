@@ -0,0 +1,61 @@
+#include <lib/usyscall.h>
+#include <lib/stdio.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+#include <lib/test.h>
+
+/*
+    Test growing and shrinking a mapped shared region
+*/
+int main()
+{
+    char* name = "Room to grow";
+    int errno = 0;
+    char* addr = NULL;
+
+    if ((errno = resizeSharedRegion(name, 4096, NULL)) != ERR_NOTEXIST) {
+        error("Resizing a region that does not exist, return is %d", errno);
+    }
+    if ((errno = createSharedRegion(name, 4096, RS_DEFAULT)) != ERR_OK) {
+        error("Failed to create shared region");
+    }
+    if ((errno = resizeSharedRegion(name, 0, NULL)) != ERR_INVAL) {
+        error("Resizing a region to nothing, return is %d", errno);
+    }
+    if ((errno = map(name, (void**)&addr, MAP_DEFAULT)) != ERR_OK) {
+        error("Failed to map shared region, return is %d", errno);
+    }
+    addr[0] = 7;
+
+    if ((errno = resizeSharedRegion(name, 4 * 4096, (void**)&addr)) != ERR_OK) {
+        error("Failed to grow shared region, return is %d", errno);
+    }
+    if (addr[0] != 7) {
+        error("Growing lost the first page, found %d", addr[0]);
+    }
+    addr[3 * 4096] = 9;
+
+    if ((errno = resizeSharedRegion(name, 4096, (void**)&addr)) != ERR_OK) {
+        error("Failed to shrink shared region, return is %d", errno);
+    }
+    if (addr[0] != 7) {
+        error("Shrinking lost the first page, found %d", addr[0]);
+    }
+
+    // pages cut off by the shrink come back zero filled
+    if ((errno = resizeSharedRegion(name, 4 * 4096, (void**)&addr)) != ERR_OK) {
+        error("Failed to grow shared region again, return is %d", errno);
+    }
+    if (addr[3 * 4096] != 0) {
+        error("Page cut off by shrink kept its data, found %d", addr[3 * 4096]);
+    }
+
+    if ((errno = unmap(name, addr)) != ERR_OK) {
+        error("Failed to unmap shared region");
+    }
+    if ((errno = destroySharedRegion(name)) != ERR_OK) {
+        error("Failed to destroy shared region");
+    }
+    pass("resize-region-test");
+    exit(0);
+}
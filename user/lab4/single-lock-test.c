@@ -11,7 +11,7 @@ int main()
     if ((errno = createSharedRegion(name, 255, RS_DEFAULT)) != ERR_OK) {
         error("Failed to create region");
     }
-    if ((errno = map(name, (void**)&addr)) != ERR_OK) {
+    if ((errno = map(name, (void**)&addr, MAP_DEFAULT)) != ERR_OK) {
         error("Failed to map region");
     }
     if ((errno = lockSharedRegion(name)) != ERR_OK) {
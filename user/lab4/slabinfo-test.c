@@ -0,0 +1,74 @@
+#include <lib/usyscall.h>
+#include <lib/stdio.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+#include <lib/errcode.h>
+#include <lib/test.h>
+
+#define MAX_SLABS 64
+#define NFILES 8
+
+struct slab_info before[MAX_SLABS], after[MAX_SLABS];
+
+static struct slab_info*
+find(struct slab_info *slabs, int n, char *name)
+{
+    for (int i = 0; i < n; i++) {
+        if (strcmp(slabs[i].name, name) == 0) {
+            return &slabs[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+    Test that slabinfo reports consistent allocator statistics and sees kernel
+    objects being allocated
+*/
+int main()
+{
+    struct slab_info *b, *a;
+    int n, fds[NFILES];
+
+    if (slabinfo(NULL, -1) != ERR_INVAL) {
+        error("slabinfo accepted a negative count");
+    }
+    if (slabinfo((struct slab_info*)0xfffffff000000000, 1) != ERR_FAULT) {
+        error("slabinfo accepted a kernel address");
+    }
+    if ((n = slabinfo(NULL, 0)) <= 0) {
+        error("slabinfo reported %d allocators", n);
+    }
+    if (n > MAX_SLABS || slabinfo(before, MAX_SLABS) != n) {
+        error("slabinfo reported %d allocators, then a different count", n);
+    }
+    for (int i = 0; i < n; i++) {
+        b = &before[i];
+        if (b->in_use > b->total) {
+            error("%s has %d objects in use in %d slots", b->name, (int)b->in_use, (int)b->total);
+        }
+    }
+    if ((b = find(before, n, "file")) == NULL) {
+        error("No file allocator");
+    }
+
+    for (int i = 0; i < NFILES; i++) {
+        if ((fds[i] = open("/README", FS_RDONLY, EMPTY_MODE)) < 0) {
+            error("Failed to open /README");
+        }
+    }
+    slabinfo(after, MAX_SLABS);
+    a = find(after, n, "file");
+    if (a->allocs < b->allocs + NFILES) {
+        error("Opening %d files made %d file allocations", NFILES, (int)(a->allocs - b->allocs));
+    }
+    if (a->peak < a->in_use || a->total < a->in_use) {
+        error("file allocator has %d in use, peak %d, %d slots", (int)a->in_use,
+              (int)a->peak, (int)a->total);
+    }
+    for (int i = 0; i < NFILES; i++) {
+        close(fds[i]);
+    }
+    pass("slabinfo-test");
+    exit(0);
+}
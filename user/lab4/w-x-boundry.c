@@ -29,7 +29,7 @@ vaddr_t sm_write (void *vaddr, char *buf, size_t count) {
 int main()
 {
 
-  int size = 2;
+  int size = 2 * PG_SIZE;
   int count = PG_SIZE/sizeof(char*);
   char name[4] = "reg\0";
   char buf[count]; 
@@ -37,7 +37,7 @@ int main()
 
 
   createSharedRegion(name, size, 0);
-  map(name, &addr);
+  map(name, &addr, MAP_DEFAULT);
 
 
   // populate buf:
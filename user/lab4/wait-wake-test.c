@@ -0,0 +1,72 @@
+#include <lib/usyscall.h>
+#include <lib/stdio.h>
+#include <lib/stddef.h>
+#include <lib/string.h>
+#include <lib/test.h>
+
+/*
+    Test sleeping on and waking up a word inside a shared region
+*/
+int main()
+{
+    char* name = "Somebody wake me up when it's all over";
+    int errno = 0;
+    int pid = 0;
+    int ret = 0;
+    int local = 0;
+    int* addr = NULL;
+
+    if ((errno = createSharedRegion(name, 64, RS_DEFAULT)) != ERR_OK) {
+        error("Failed to create shared region");
+    }
+    if ((errno = map(name, (void**)&addr, MAP_DEFAULT)) != ERR_OK) {
+        error("Failed to map shared region %d", errno);
+    }
+    if ((errno = waitSharedRegion(&local, 0)) != ERR_INVAL) {
+        error("Waiting on an address outside a shared region, return is %d", errno);
+    }
+    if ((errno = waitSharedRegion((int*)((char*)addr + 1), 0)) != ERR_INVAL) {
+        error("Waiting on a misaligned address, return is %d", errno);
+    }
+    if ((errno = waitSharedRegion(addr, 1)) != ERR_INCOMP) {
+        error("Waiting with a stale value did not return immediately, return is %d", errno);
+    }
+    if ((errno = wakeSharedRegion(addr, 1)) != 0) {
+        error("Woke up %d threads with no waiters", errno);
+    }
+
+    pid = fork();
+    if (pid > 0) {
+        // give the child a chance to go to sleep
+        sleep(1);
+        addr[0] = 1;
+        while (wakeSharedRegion(addr, 1) == 0 && addr[1] == 0) {
+            sleep(1);
+        }
+        wait(pid, &ret);
+        if (ret != 1) {
+            error("Child saw %d instead of 1", ret);
+        }
+        if ((errno = unmap(name, addr)) != ERR_OK) {
+            error("Parent failed to unmap shared region");
+        }
+    } else {
+        while (addr[0] == 0) {
+            errno = waitSharedRegion(addr, 0);
+            if (errno != ERR_OK && errno != ERR_INCOMP) {
+                error("Child failed to wait on shared region, return is %d", errno);
+            }
+        }
+        ret = addr[0];
+        addr[1] = 1;
+        if ((errno = unmap(name, addr)) != ERR_OK) {
+            error("Child failed to unmap shared region");
+        }
+        exit(ret);
+    }
+    if ((errno = destroySharedRegion(name)) != ERR_OK) {
+        error("Failed to destroy shared region");
+    }
+    pass("wait-wake-test");
+    exit(0);
+}
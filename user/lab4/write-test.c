@@ -23,7 +23,7 @@ int main()
 
   createSharedRegion(name, size, 0);
 
-  map(name, &addr);
+  map(name, &addr, MAP_DEFAULT);
 
   *((char*)addr) = *name;
 
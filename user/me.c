@@ -13,14 +13,14 @@ int main(int argc, char** argv) {
         } else {
             printf("cannot create\n");
         }
-        if (map(name, &ptr) == ERR_OK) {
+        if (map(name, &ptr, MAP_DEFAULT) == ERR_OK) {
             printf("mapped at %p\n", ptr);
         }
         strcpy(ptr, name);
         printf("%s\n", ptr);
         unmap(name, ptr);
     } else {
-        if ((errno = map(name, &ptr)) == ERR_OK) {
+        if ((errno = map(name, &ptr, MAP_DEFAULT)) == ERR_OK) {
             printf("mapped at %p\n", ptr);
         } else {
             printf("error: %d\n", errno);
@@ -0,0 +1,60 @@
+#include <lib/usyscall.h>
+#include <lib/stdio.h>
+#include <lib/string.h>
+
+#define MAX_SLABS 64
+#define NAME_COL 20
+
+struct slab_info slabs[MAX_SLABS];
+
+// Return name blank-padded to NAME_COL characters.
+char*
+fmtname(char *name)
+{
+    static char buf[NAME_COL + 1];
+    int len = strlen(name);
+
+    if (len >= NAME_COL) {
+        return name;
+    }
+    memmove(buf, name, len);
+    memset(buf + len, ' ', NAME_COL - len);
+    buf[NAME_COL] = 0;
+    return buf;
+}
+
+// Print kernel object allocators, the ones holding the most pages first.
+int
+main(int argc, char *argv[])
+{
+    struct slab_info tmp;
+    int n, i, j;
+
+    if ((n = slabinfo(slabs, MAX_SLABS)) < 0) {
+        printf("slabtop: slabinfo failed\n");
+        exit(-1);
+    }
+    if (n > MAX_SLABS) {
+        printf("slabtop: showing %d of %d allocators\n", MAX_SLABS, n);
+        n = MAX_SLABS;
+    }
+
+    for (i = 1; i < n; i++) {
+        tmp = slabs[i];
+        for (j = i; j > 0 && slabs[j - 1].pages < tmp.pages; j--) {
+            slabs[j] = slabs[j - 1];
+        }
+        slabs[j] = tmp;
+    }
+
+    printf("%s size in-use peak slots slabs(full/partial/free) pages mag-hit/miss\n", fmtname("name"));
+    for (i = 0; i < n; i++) {
+        printf("%s %d %d %d %d %d/%d/%d %d %d/%d\n", fmtname(slabs[i].name),
+               (int)slabs[i].obj_size, (int)slabs[i].in_use, (int)slabs[i].peak,
+               (int)slabs[i].total, (int)slabs[i].slabs_full, (int)slabs[i].slabs_partial,
+               (int)slabs[i].slabs_free, (int)slabs[i].pages,
+               (int)(slabs[i].alloc_hits + slabs[i].free_hits),
+               (int)(slabs[i].alloc_misses + slabs[i].free_misses));
+    }
+    exit(0);
+}